@@ -0,0 +1,130 @@
+/*
+ * arena.c - per-connection bump allocation
+ *
+ * Everything a connection needs for one request, the parser, the
+ * parsed request and the header and relay buffers, is bumped off an
+ * arena and dropped all at once: the arena is reset between pipelined
+ * requests and handed back whenever the connection goes idle, so an
+ * idle connection holds none, and nothing in it outlives its request.
+ * The first block is sized for a whole request; an arena that needs
+ * more grows a chain of blocks, and keeps them across resets.
+ *
+ * Each thread keeps the arenas given back on it for its next
+ * connections, trimmed back to one block if they grew large, so in a
+ * steady state the request path never calls malloc.
+ */
+#include "csapp.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;                /* bytes of data */
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static pthread_key_t free_key;
+static __thread arena_t *free_arenas = NULL;
+static __thread int nfree = 0;
+
+static struct arena_block *new_block(size_t size) {
+    struct arena_block *b = Malloc(sizeof(struct arena_block) + size);
+
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+/* free every block of a after the first */
+static void trim(arena_t *a) {
+    struct arena_block *b, *next;
+
+    for (b = a->first->next; b != NULL; b = next) {
+        next = b->next;
+        Free(b);
+    }
+    a->first->next = NULL;
+    a->size = a->first->size;
+}
+
+/* thread exit, free the arenas it kept */
+static void free_list(void *arg) {
+    arena_t *a;
+
+    while ((a = free_arenas) != NULL) {
+        free_arenas = a->next;
+        trim(a);
+        Free(a->first);
+        Free(a);
+    }
+    nfree = 0;
+}
+
+void arena_init() {
+    pthread_key_create(&free_key, free_list);
+}
+
+/* an empty arena, one this thread gave back if it has any */
+arena_t *arena_get() {
+    arena_t *a;
+
+    if ((a = free_arenas) != NULL) {
+        free_arenas = a->next;
+        nfree--;
+        return a;
+    }
+    a = Malloc(sizeof(arena_t));
+    a->first = a->cur = new_block(ARENA_BLOCK);
+    a->size = ARENA_BLOCK;
+    a->next = NULL;
+    return a;
+}
+
+/* n bytes from a, aligned for any type, until a is reset */
+void *arena_alloc(arena_t *a, size_t n) {
+    struct arena_block *b = a->cur;
+    void *p;
+
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    while (b->size - b->used < n) {
+        /* blocks after the current one are empty, left from before a reset */
+        if (b->next == NULL) {
+            b->next = new_block(n > ARENA_BLOCK ? n : ARENA_BLOCK);
+            a->size += b->next->size;
+        }
+        b = a->cur = b->next;
+    }
+    p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+/* drop everything allocated from a, keeping its blocks */
+void arena_reset(arena_t *a) {
+    struct arena_block *b;
+
+    for (b = a->first; b != NULL; b = b->next)
+        b->used = 0;
+    a->cur = a->first;
+}
+
+/* give a back for this thread's next connection */
+void arena_put(arena_t *a) {
+    arena_reset(a);
+    if (a->size > ARENA_KEEP)
+        trim(a);
+    if (nfree == ARENA_FREE_MAX) {
+        trim(a);
+        Free(a->first);
+        Free(a);
+        return;
+    }
+    if (free_arenas == NULL)
+        pthread_setspecific(free_key, (void *)1);
+    a->next = free_arenas;
+    free_arenas = a;
+    nfree++;
+}
@@ -0,0 +1,28 @@
+/*
+ * arena.h - per-connection bump allocation
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+#define ARENA_BLOCK (96 << 10)      /* bytes of an arena's first block */
+#define ARENA_KEEP (256 << 10)      /* largest arena kept whole for reuse */
+#define ARENA_FREE_MAX 16           /* arenas a thread keeps for reuse */
+
+struct arena_block;
+
+typedef struct arena {
+    struct arena_block *first;
+    struct arena_block *cur;    /* the block allocations come from */
+    size_t size;                /* bytes of all blocks */
+    struct arena *next;         /* on the free list */
+} arena_t;
+
+void arena_init();
+arena_t *arena_get();
+void *arena_alloc(arena_t *a, size_t n);
+void arena_reset(arena_t *a);
+void arena_put(arena_t *a);
+
+#endif /* __ARENA_H__ */
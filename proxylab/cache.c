@@ -0,0 +1,598 @@
+/*
+ * cache.c - sharded LRU web object cache
+ *
+ * Blocks are indexed by a chained hash table on the normalized cache
+ * key and threaded on a doubly linked LRU list. Each block lives in a
+ * single chunk of a slab arena sized to its key and payload. The budget
+ * is charged with the chunks, plus the free room in each shard's partly
+ * used slab pages up to SHARD_SLACK. Charging whole pages would let an
+ * eviction that empties no page lower nothing, and the cache would be
+ * evicted far below its budget; the slack still counts what pages of
+ * many size classes waste, within bounds. Blocks already evicted still
+ * hold their chunks until the last reader is gone, so eviction stops
+ * once the charge less those chunks fits.
+ *
+ * The cache is split into CACHE_SHARDS shards by key hash, each with
+ * its own lock, table, LRU list and arena; the lock is only taken by
+ * writers. Readers walk the bucket chains without any lock inside an
+ * epoch critical section and pin the block they find with a reference
+ * count, so a hit can stream a block while it is being evicted. The
+ * last reference retires the block and epoch.c frees it once no reader
+ * can still reach it; inserts and readers giving blocks back both free
+ * whatever has become safe.
+ *
+ * A hit only sets the block's referenced flag; the flag is folded into
+ * the LRU order when the block reaches the tail of its list, where it
+ * gets a second chance instead of being evicted.
+ *
+ * Every block carries the freshness http.c worked out for it. A stale
+ * block stays in the cache to be revalidated, and a 304 from the origin
+ * only moves its expiry, in place, under the readers' feet.
+ *
+ * Admission follows TinyLFU: every lookup counts the key in a frequency
+ * sketch, and when a new object needs room each victim the LRU offers
+ * has to be no more popular than the newcomer. The victims are picked
+ * and compared first and only evicted once the newcomer is admitted;
+ * if one is more popular, they all stay and the newcomer is dropped
+ * instead, so a scan of one-off objects cannot flush the hot set.
+ * Since a large object needs many victims, it has that many chances
+ * to meet a hotter one and be turned away. cache_admission(0)
+ * restores plain LRU, to compare hit ratios.
+ */
+#include "cache.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "sketch.h"
+#include "stats.h"
+
+static struct cache_shard shards[CACHE_SHARDS];
+static size_t cache_size = 0;       /* the shards' charges, against MAX_CACHE_SIZE */
+static size_t cache_dying = 0;      /* chunk bytes of removed blocks not yet freed */
+static unsigned int evict_hand = 0; /* next shard to evict from */
+static int admission = 1;           /* TinyLFU admission, else plain LRU */
+
+/* FNV-1a hash of a nul-terminated key */
+static unsigned int hash_key(char *key) {
+    unsigned int h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct cache_shard *shard_of(unsigned int hash) {
+    return &shards[(hash >> 24) & (CACHE_SHARDS - 1)];
+}
+
+static struct cache_block **bucket_of(struct cache_shard *s, unsigned int hash) {
+    return &s->buckets[hash & (SHARD_BUCKETS - 1)];
+}
+
+/* unlink block from the LRU list */
+static void lru_remove(struct cache_block *b) {
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+/* link block at the most recently used end of the LRU list */
+static void lru_push(struct cache_shard *s, struct cache_block *b) {
+    b->next = s->lru.next;
+    b->prev = &s->lru;
+    s->lru.next->prev = b;
+    s->lru.next = b;
+}
+
+/*
+ * charge a shard's chunks and up to SHARD_SLACK of the free room in its
+ * pages to the cache, caller holds the shard mutex
+ */
+static void recharge(struct cache_shard *s) {
+    size_t slack = s->arena.bytes - s->chunks, charge;
+
+    charge = s->chunks + (slack < SHARD_SLACK ? slack : SHARD_SLACK);
+    if (charge > s->charge)
+        __atomic_add_fetch(&cache_size, charge - s->charge, __ATOMIC_RELAXED);
+    else
+        __atomic_sub_fetch(&cache_size, s->charge - charge, __ATOMIC_RELAXED);
+    s->charge = charge;
+}
+
+/* hand the chunk of a retired block back to its shard's arena */
+static void free_block(struct epoch_node *n) {
+    struct cache_block *b = (struct cache_block *)
+        ((char *)n - offsetof(struct cache_block, reclaim));
+    struct cache_shard *s = b->shard;
+
+    stats_add(STAT_CACHED_BYTES, -(long)b->size);
+    P(&s->mutex);
+    __atomic_sub_fetch(&cache_dying, b->charge, __ATOMIC_RELAXED);
+    s->chunks -= b->charge;
+    slab_free(&s->arena, b);
+    recharge(s);
+    V(&s->mutex);
+}
+
+/* bytes the cache holds beyond what evictions will give back */
+static size_t cache_charged() {
+    size_t dying = __atomic_load_n(&cache_dying, __ATOMIC_RELAXED);
+    size_t size = __atomic_load_n(&cache_size, __ATOMIC_RELAXED);
+    return (size > dying) ? size - dying : 0;
+}
+
+/* pin a block found by a reader, fails once the block is dying */
+static int block_get(struct cache_block *b) {
+    int cnt = __atomic_load_n(&b->refcnt, __ATOMIC_RELAXED);
+    while (cnt > 0)
+        if (__atomic_compare_exchange_n(&b->refcnt, &cnt, cnt + 1, 1,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+/* drop a reference, the last one retires the block; no lock held or not */
+static void block_put(struct cache_block *b) {
+    if (__atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        epoch_retire(&b->reclaim, free_block);
+}
+
+/*
+ * give back a block a reader pinned, and free the retired blocks that
+ * are safe by now, so a run of hits reclaims them as well as inserts do
+ */
+void cache_release(struct cache_block *b) {
+    block_put(b);
+    epoch_reclaim();
+}
+
+/* find block by key and hash in a shard, readers and writers alike */
+static struct cache_block *lookup(struct cache_shard *s, char *cache_key,
+        unsigned int hash) {
+    struct cache_block *b = __atomic_load_n(bucket_of(s, hash), __ATOMIC_ACQUIRE);
+    for (; b != NULL; b = __atomic_load_n(&b->hnext, __ATOMIC_ACQUIRE))
+        if (b->hash == hash && !strcmp(b->key, cache_key))
+            return b;
+    return NULL;
+}
+
+/*
+ * unlink block from the table and the list and drop the table's
+ * reference, caller holds the shard mutex
+ */
+static void remove_block(struct cache_shard *s, struct cache_block *b) {
+    struct cache_block **pp = bucket_of(s, b->hash);
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    __atomic_store_n(pp, b->hnext, __ATOMIC_RELEASE);
+    lru_remove(b);
+    __atomic_add_fetch(&cache_dying, b->charge, __ATOMIC_RELAXED);
+    block_put(b);
+}
+
+/* blocks picked to make room, each pinned until it is evicted or spared */
+struct victims {
+    struct cache_block **b;
+    long n;
+    long cap;
+};
+
+static int picked(struct victims *v, struct cache_block *b) {
+    long i;
+    for (i = 0; i < v->n; i++)
+        if (v->b[i] == b)
+            return 1;
+    return 0;
+}
+
+/*
+ * pick the least recently used block of a shard not picked yet for a
+ * newcomer seen freq times, giving referenced blocks a second chance,
+ * and pin it in v; return 0 if there is none, -1 if it is more popular
+ * than the newcomer, which must then give way
+ */
+static int pick_victim(struct cache_shard *s, int freq, struct victims *v) {
+    struct cache_block *b, *prev;
+    int rc = 0;
+
+    P(&s->mutex);
+    for (b = s->lru.prev; b != &s->lru; b = prev) {
+        prev = b->prev;
+        if (picked(v, b))
+            continue;
+        if (__atomic_load_n(&b->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&b->referenced, 0, __ATOMIC_RELAXED);
+            lru_remove(b);
+            lru_push(s, b);
+            continue;
+        }
+        if (admission && sketch_estimate(b->hash) > freq) {
+            lru_remove(b);
+            lru_push(s, b);
+            rc = -1;
+            break;
+        }
+        if (v->n == v->cap) {
+            v->cap = v->cap ? 2 * v->cap : 16;
+            v->b = Realloc(v->b, v->cap * sizeof(struct cache_block *));
+        }
+        __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+        v->b[v->n++] = b;
+        rc = 1;
+        break;
+    }
+    V(&s->mutex);
+    return rc;
+}
+
+/*
+ * evict a picked block unless somebody else already did, demoting it
+ * to the disk tier if there is one; the pin goes with it
+ */
+static void evict(struct cache_block *b) {
+    struct cache_shard *s = b->shard;
+    int evicted;
+
+    P(&s->mutex);
+    if ((evicted = (lookup(s, b->key, b->hash) == b)))
+        remove_block(s, b);
+    V(&s->mutex);
+    if (evicted)
+        stats_add(STAT_EVICTIONS, 1);
+    if (evicted && disk_active())
+        disk_demote(b);
+    else
+        block_put(b);
+}
+
+/*
+ * bring the cache back under budget for a newcomer seen freq times:
+ * pick victims round robin over the shards until they cover the
+ * excess, and evict them only if none is more popular than the
+ * newcomer. return 0 if the newcomer is turned away, nothing evicted
+ * for it
+ */
+static int make_room(int freq) {
+    struct victims v = { NULL, 0, 0 };
+    size_t over, planned;
+    int idle, rc, admitted = 1;
+    long i;
+
+    while (admitted && (over = cache_charged()) > MAX_CACHE_SIZE) {
+        over -= MAX_CACHE_SIZE;
+        planned = 0;
+        idle = 0;
+        while (planned < over && idle < CACHE_SHARDS) {
+            unsigned int hand = __atomic_fetch_add(&evict_hand, 1, __ATOMIC_RELAXED);
+            if ((rc = pick_victim(&shards[hand & (CACHE_SHARDS - 1)], freq, &v)) < 0) {
+                admitted = 0;
+                break;
+            }
+            if (rc > 0)
+                planned += v.b[v.n - 1]->charge;
+            idle = rc ? 0 : idle + 1;
+        }
+        for (i = 0; i < v.n; i++) {
+            if (admitted)
+                evict(v.b[i]);
+            else
+                block_put(v.b[i]);
+        }
+        if (v.n == 0)
+            break;
+        v.n = 0;
+    }
+    Free(v.b);
+    return admitted;
+}
+
+/* initialize cache */
+void cache_init() {
+    int i;
+
+    epoch_init();
+    sketch_init();
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *s = &shards[i];
+        Sem_init(&s->mutex, 0, 1);
+        memset(s->buckets, 0, sizeof(s->buckets));
+        s->lru.next = s->lru.prev = &s->lru;
+        slab_init(&s->arena, sizeof(struct cache_block) + MAXLINE + MAX_OBJECT_SIZE);
+        s->chunks = s->charge = 0;
+    }
+    cache_size = cache_dying = 0;
+}
+
+/* clean up every cached block, no other thread may use the cache */
+void cache_deinit() {
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *s = &shards[i];
+        P(&s->mutex);
+        while (s->lru.prev != &s->lru)
+            remove_block(s, s->lru.prev);
+        V(&s->mutex);
+    }
+    epoch_drain();
+    for (i = 0; i < CACHE_SHARDS; i++)
+        slab_deinit(&shards[i].arena);
+}
+
+/*
+ * build the normalized cache key host:port/path into a MAXLINE buffer,
+ * the host name is case insensitive so it is folded to lower case;
+ * path is path_len bytes, empty for "/". return -1 if it does not fit
+ */
+int make_cache_key(char *key, char *host, char *port, char *path, size_t path_len) {
+    char *p = key;
+    int n;
+
+    while (*host && p < key + MAXLINE / 2)
+        *p++ = tolower((unsigned char)*host++);
+    if (*host)
+        return -1;
+    if (path_len == 0) {
+        path = "/";
+        path_len = 1;
+    }
+    n = snprintf(p, MAXLINE - (p - key), ":%s%.*s", (*port) ? port : "80",
+            (int)path_len, path);
+    return (n < MAXLINE - (p - key)) ? 0 : -1;
+}
+
+/* find and pin the block for cache_key without taking any lock */
+static struct cache_block *find(char *cache_key, unsigned int hash) {
+    struct cache_block *b;
+
+    epoch_enter();
+    if ((b = lookup(shard_of(hash), cache_key, hash)) != NULL && !block_get(b))
+        b = NULL;
+    epoch_exit();
+    return b;
+}
+
+static struct cache_block *insert(char *cache_key, unsigned int hash, char *buf,
+        size_t size, size_t hdr_len, struct cache_fresh *fr);
+
+/*
+ * bring the object for cache_key back from a restored snapshot or the
+ * disk tier, pinned
+ */
+static struct cache_block *promote(char *cache_key, unsigned int hash) {
+    struct cache_block *b;
+    struct cache_fresh fr;
+    size_t size, hdr_len;
+    char *buf = NULL;
+
+    if (snapshot_active())
+        buf = snapshot_read(cache_key, hash, &size, &hdr_len, &fr);
+    if (buf == NULL && disk_active())
+        buf = disk_read(cache_key, &size, &hdr_len, &fr);
+    if (buf == NULL)
+        return NULL;
+    b = insert(cache_key, hash, buf, size, hdr_len, &fr);
+    Free(buf);
+    return b;
+}
+
+/*
+ * find cache by cache_key, in memory without taking any lock and then
+ * in the snapshot and on disk, return the block pinned for the caller,
+ * who gives it back with cache_release; return NULL on a miss
+ */
+struct cache_block *cache_lookup(char *cache_key) {
+    unsigned int hash = hash_key(cache_key);
+    struct cache_block *b;
+
+    sketch_add(hash);
+    stats_add(STAT_LOOKUPS, 1);
+    if ((b = find(cache_key, hash)) == NULL && (snapshot_active() || disk_active()))
+        b = promote(cache_key, hash);
+    if (b == NULL)
+        return NULL;
+    stats_add(STAT_LOOKUP_HITS, 1);
+    if (!__atomic_load_n(&b->referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&b->referenced, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+/*
+ * find cache by cache_key in memory like cache_lookup, but without
+ * counting it as an access
+ */
+struct cache_block *cache_peek(char *cache_key) {
+    return find(cache_key, hash_key(cache_key));
+}
+
+/* is the block still fresh */
+int cache_fresh(struct cache_block *b) {
+    return time(NULL) < __atomic_load_n(&b->fresh.expires, __ATOMIC_RELAXED);
+}
+
+/* may the stale block be served while it is refreshed in the background */
+int cache_usable(struct cache_block *b) {
+    return time(NULL) < __atomic_load_n(&b->fresh.usable, __ATOMIC_RELAXED);
+}
+
+/* give a block the freshness of a successful revalidation */
+void cache_refresh(struct cache_block *b, struct cache_fresh *fr) {
+    __atomic_store_n(&b->fresh.date, fr->date, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->fresh.usable, fr->usable, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->fresh.must_revalidate, fr->must_revalidate, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->fresh.expires, fr->expires, __ATOMIC_RELAXED);
+}
+
+/* choose TinyLFU admission or plain LRU eviction */
+void cache_admission(int on) {
+    admission = on;
+}
+
+/* lookups so far and how many of them hit */
+void cache_stats(long *nlookups, long *nhits) {
+    *nlookups = stats_total(STAT_LOOKUPS);
+    *nhits = stats_total(STAT_LOOKUP_HITS);
+}
+
+/*
+ * insert a new object into cache, its headers ending at hdr_len and
+ * fresh as fr says, and forget any older copy on disk or in the snapshot
+ */
+void insert_block(char *cache_key, char *buf, size_t size, size_t hdr_len,
+        struct cache_fresh *fr) {
+    unsigned int hash = hash_key(cache_key);
+    struct cache_block *b;
+
+    if (disk_active())
+        disk_remove(cache_key);
+    if (snapshot_active())
+        snapshot_remove(cache_key, hash);
+    if ((b = insert(cache_key, hash, buf, size, hdr_len, fr)) != NULL)
+        cache_release(b);
+}
+
+/*
+ * pin every block in memory, each shard's from the most recently used,
+ * for a snapshot; return them in an array for the caller to release
+ * and free, their number in *n
+ */
+struct cache_block **cache_collect(long *n) {
+    struct cache_block **blocks = NULL, *b;
+    long cap = 0;
+    int i;
+
+    *n = 0;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *s = &shards[i];
+        P(&s->mutex);
+        for (b = s->lru.next; b != &s->lru; b = b->next) {
+            if (*n == cap) {
+                cap = cap ? 2 * cap : 64;
+                blocks = Realloc(blocks, cap * sizeof(struct cache_block *));
+            }
+            __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+            blocks[(*n)++] = b;
+        }
+        V(&s->mutex);
+    }
+    return blocks;
+}
+
+/*
+ * add to *charged what the cache would charge a block for key holding
+ * size bytes, the slack its shards may add left out of the budget;
+ * return 0, adding nothing, once the block would not fit
+ */
+int cache_charge_fits(size_t *charged, char *key, size_t size) {
+    size_t key_len = strlen(key) + 1, chunk;
+
+    if (size > MAX_OBJECT_SIZE || key_len > MAXLINE)
+        return 0;
+    chunk = slab_class_size(&shards[0].arena,
+            sizeof(struct cache_block) + key_len + size);
+    if (chunk == 0 || *charged + chunk > MAX_CACHE_SIZE - CACHE_SHARDS * SHARD_SLACK)
+        return 0;
+    *charged += chunk;
+    return 1;
+}
+
+/*
+ * insert an object into memory once least recently used blocks round
+ * robin over the shards make room for it, or drop it if one of them is
+ * more popular. return the block pinned, even if it was dropped, NULL
+ * if it is too large
+ */
+static struct cache_block *insert(char *cache_key, unsigned int hash, char *buf,
+        size_t size, size_t hdr_len, struct cache_fresh *fr) {
+    size_t key_len = strlen(cache_key) + 1;
+    struct cache_shard *s = shard_of(hash);
+    struct cache_block *b, *old, **bucket;
+    int freq = admission ? sketch_estimate(hash) : 0;
+    int admitted;
+
+    if (size > MAX_OBJECT_SIZE || key_len > MAXLINE)
+        return NULL;
+
+    /* the chunk is charged now, so the room made counts it */
+    P(&s->mutex);
+    b = slab_alloc(&s->arena, sizeof(struct cache_block) + key_len + size);
+    b->key = (char *)(b + 1);
+    memcpy(b->key, cache_key, key_len);
+    b->response = b->key + key_len;
+    memcpy(b->response, buf, size);
+    b->size = size;
+    b->hdr_len = hdr_len;
+    b->fresh = *fr;
+    b->refreshing = 0;
+    b->charge = slab_chunk_size(b);
+    s->chunks += b->charge;
+    recharge(s);
+    b->hash = hash;
+    b->refcnt = 2;
+    b->referenced = 0;
+    b->shard = s;
+    stats_add(STAT_CACHED_BYTES, size);
+    /* an older copy goes whether or not this one stays */
+    if ((old = lookup(s, cache_key, hash)) != NULL)
+        remove_block(s, old);
+    V(&s->mutex);
+
+    admitted = make_room(freq);
+
+    P(&s->mutex);
+    if (admitted) {
+        if ((old = lookup(s, cache_key, hash)) != NULL)
+            remove_block(s, old);
+        bucket = bucket_of(s, hash);
+        b->hnext = *bucket;
+        __atomic_store_n(bucket, b, __ATOMIC_RELEASE);
+        lru_push(s, b);
+    } else {
+        /* the caller still serves it, the table never had it */
+        __atomic_add_fetch(&cache_dying, b->charge, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    V(&s->mutex);
+    if (!admitted && disk_active()) {
+        __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+        disk_demote(b);
+    }
+    epoch_reclaim();
+    return b;
+}
+
+/* start an empty capture buffer */
+void objbuf_init(objbuf_t *ob) {
+    ob->data = NULL;
+    ob->len = ob->cap = 0;
+    ob->too_large = 0;
+}
+
+/* append n bytes, doubling the buffer, and drop it past MAX_OBJECT_SIZE */
+void objbuf_append(objbuf_t *ob, char *buf, size_t n) {
+    if (ob->too_large)
+        return;
+    if (ob->len + n > MAX_OBJECT_SIZE) {
+        objbuf_free(ob);
+        ob->too_large = 1;
+        return;
+    }
+    if (ob->len + n > ob->cap) {
+        size_t cap = ob->cap ? ob->cap : MAXBUF;
+        while (cap < ob->len + n)
+            cap *= 2;
+        if (cap > MAX_OBJECT_SIZE)
+            cap = MAX_OBJECT_SIZE;
+        ob->data = Realloc(ob->data, cap);
+        ob->cap = cap;
+    }
+    memcpy(ob->data + ob->len, buf, n);
+    ob->len += n;
+}
+
+/* release the capture buffer */
+void objbuf_free(objbuf_t *ob) {
+    if (ob->data)
+        Free(ob->data);
+    ob->data = NULL;
+    ob->len = ob->cap = 0;
+}
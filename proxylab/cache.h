@@ -0,0 +1,92 @@
+/*
+ * cache.h - web object cache shared by the proxy threads
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include "slab.h"
+#include "epoch.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Shards and hash buckets per shard, both powers of two */
+#define CACHE_SHARDS 16
+#define SHARD_BUCKETS 512
+
+/* free room in partly used slab pages charged per shard at most */
+#define SHARD_SLACK (MAX_CACHE_SIZE / CACHE_SHARDS / 8)
+
+/* freshness of a cached response, in seconds since the epoch */
+struct cache_fresh {
+    long date;                      /* generated, as corrected by its Age */
+    long expires;                   /* fresh until */
+    long usable;                    /* may be served stale while refreshed until */
+    int must_revalidate;            /* never to be served stale */
+};
+
+/*
+ * cache block data structure, the key and the response are stored
+ * right behind it in the same slab chunk
+ */
+struct cache_block {
+    char *key;                      /* normalized host:port/path */
+    char *response;                 /* cached object */
+    size_t size;                    /* bytes in response */
+    size_t hdr_len;                 /* end of the headers, the blank line follows */
+    size_t charge;                  /* its chunk, dying until the chunk is freed */
+    struct cache_fresh fresh;       /* updated in place on revalidation */
+    int refreshing;                 /* queued for a background refresh */
+    unsigned int hash;              /* hash of key */
+    int refcnt;                     /* one for the table plus one per reader */
+    int referenced;                 /* hit since it was last considered for eviction */
+    struct cache_shard *shard;
+    struct cache_block *hnext;      /* next block in the same bucket */
+    struct cache_block *prev;       /* LRU list, towards most recent */
+    struct cache_block *next;       /* LRU list, towards least recent */
+    struct epoch_node reclaim;
+};
+
+/* one shard: its own lock, table, LRU list and slab arena */
+struct cache_shard {
+    sem_t mutex;                    /* serializes writers, readers never take it */
+    struct cache_block *buckets[SHARD_BUCKETS];
+    struct cache_block lru;         /* sentinel: lru.next is most recent */
+    slab_arena arena;
+    size_t chunks;                  /* bytes of the chunks in its arena */
+    size_t charge;                  /* its share of the cache's charge */
+};
+
+/*
+ * length-tracked capture of a response for the cache, binary safe,
+ * gives up once the object grows past MAX_OBJECT_SIZE
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int too_large;
+} objbuf_t;
+
+void cache_init();
+void cache_deinit();
+int make_cache_key(char *key, char *host, char *port, char *path, size_t path_len);
+struct cache_block *cache_lookup(char *cache_key);
+struct cache_block *cache_peek(char *cache_key);
+void cache_admission(int on);
+void cache_stats(long *nlookups, long *nhits);
+void cache_release(struct cache_block *b);
+int cache_fresh(struct cache_block *b);
+int cache_usable(struct cache_block *b);
+void cache_refresh(struct cache_block *b, struct cache_fresh *fr);
+void insert_block(char *cache_key, char *buf, size_t size, size_t hdr_len,
+        struct cache_fresh *fr);
+struct cache_block **cache_collect(long *n);
+int cache_charge_fits(size_t *charged, char *key, size_t size);
+void objbuf_init(objbuf_t *ob);
+void objbuf_append(objbuf_t *ob, char *buf, size_t n);
+void objbuf_free(objbuf_t *ob);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,533 @@
+/*
+ * disk.c - on-disk second tier behind the web object cache
+ *
+ * Blocks evicted from the memory cache are queued here and a writer
+ * thread appends them to the newest segment file in the cache
+ * directory, so the proxy's threads never wait on the disk. Segments are
+ * DISK_SEGMENT_SIZE bytes, only ever appended to, and mapped into
+ * memory for reading; a miss in memory that finds the object here
+ * copies it back into the memory cache. Each file is sized to the whole
+ * segment when it is opened, so the mapping never runs past its end,
+ * and a segment found on startup is as long as its intact records.
+ *
+ * The index lives in memory and is also logged to the file "index" in
+ * the directory, one record per object added or removed. On startup the
+ * log is replayed against the segments, each record checked against
+ * its checksum, so a restart comes back warm. The log is rewritten from
+ * the live entries once it has grown well past them.
+ *
+ * When the segments pass the size limit the oldest one is dropped
+ * whole. Every second without work the writer also compacts one sealed
+ * segment that is less than DISK_COMPACT_LIVE percent live, copying the
+ * objects still indexed into the newest segment and deleting the file.
+ */
+#include "disk.h"
+#include "cache.h"
+
+struct segment {
+    uint32_t id;
+    int fd;
+    char *map;                  /* DISK_SEGMENT_SIZE bytes, read only */
+    size_t len;                 /* bytes written */
+    size_t live;                /* bytes of records still indexed */
+    struct segment *next;       /* next newer segment */
+};
+
+struct disk_entry {
+    char *key;
+    unsigned int hash;
+    struct segment *seg;
+    uint32_t off;               /* of the record in seg */
+    uint32_t len;               /* of the record */
+    struct disk_entry *next;
+};
+
+static int enabled = 0;
+static char *disk_dir;
+static size_t disk_limit;
+static size_t disk_bytes = 0;   /* written to all segments */
+static struct segment *segs = NULL;         /* oldest first */
+static struct segment *newest = NULL;       /* the one being appended to */
+static uint32_t next_id = 0;
+static struct disk_entry *entries[DISK_BUCKETS];
+static long nentries = 0;
+static long log_records = 0;
+static int index_fd = -1;
+static sem_t disk_mutex;        /* guards everything above */
+
+static struct cache_block *queue[DISK_QUEUE];   /* evicted, pinned */
+static int queue_head = 0, queue_count = 0;
+static sem_t queue_mutex, queue_items;
+
+static void *writer_thread(void *vargp);
+static struct disk_rec *rec_at(struct segment *s, size_t off);
+
+/* FNV-1a over n bytes, continuing from h */
+static uint32_t fnv(uint32_t h, const char *buf, size_t n) {
+    while (n-- > 0) {
+        h ^= (unsigned char)*buf++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static unsigned int hash_disk_key(char *key) {
+    return fnv(2166136261u, key, strlen(key));
+}
+
+/* bytes a record takes in a segment, kept 8 byte aligned */
+static uint32_t rec_len(size_t key_len, size_t size) {
+    return (sizeof(struct disk_rec) + key_len + size + 7) & ~7u;
+}
+
+static void seg_path(char *buf, uint32_t id) {
+    snprintf(buf, MAXLINE, "%s/seg.%08u", disk_dir, id);
+}
+
+/* open segment id, creating it if asked, and link it in id order */
+static struct segment *seg_open(uint32_t id, int create) {
+    char path[MAXLINE];
+    struct segment *s, **pp;
+    struct disk_rec *r;
+    struct stat st;
+    size_t off;
+    int fd;
+
+    seg_path(path, id);
+    if ((fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size > DISK_SEGMENT_SIZE ||
+            (st.st_size < DISK_SEGMENT_SIZE && ftruncate(fd, DISK_SEGMENT_SIZE) < 0)) {
+        close(fd);
+        return NULL;
+    }
+    s = Calloc(1, sizeof(struct segment));
+    s->id = id;
+    s->fd = fd;
+    s->map = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (s->map == MAP_FAILED) {
+        close(fd);
+        Free(s);
+        return NULL;
+    }
+    /* the rest of an old segment, torn or never written, is zeros */
+    s->len = create ? 0 : st.st_size;
+    for (off = 0; (r = rec_at(s, off)) != NULL; off += rec_len(r->key_len, r->size))
+        ;
+    s->len = off;
+    for (pp = &segs; *pp != NULL && (*pp)->id < id; pp = &(*pp)->next)
+        ;
+    s->next = *pp;
+    *pp = s;
+    disk_bytes += s->len;
+    if (id >= next_id)
+        next_id = id + 1;
+    return s;
+}
+
+static struct segment *seg_find(uint32_t id) {
+    struct segment *s;
+    for (s = segs; s != NULL && s->id != id; s = s->next)
+        ;
+    return s;
+}
+
+/*
+ * the record at off in s if it is whole and intact, else NULL; a crash
+ * can leave the end of a segment or of the index torn
+ */
+static struct disk_rec *rec_at(struct segment *s, size_t off) {
+    struct disk_rec *r;
+    char *key;
+
+    if (off % 8 || off + sizeof(struct disk_rec) > s->len)
+        return NULL;
+    r = (struct disk_rec *)(s->map + off);
+    if (r->magic != DISK_MAGIC || r->key_len == 0 || r->key_len > MAXLINE ||
+            r->size > MAX_OBJECT_SIZE || r->hdr_len > r->size ||
+            off + rec_len(r->key_len, r->size) > s->len)
+        return NULL;
+    key = (char *)(r + 1);
+    if (key[r->key_len - 1] != '\0' ||
+            fnv(2166136261u, key, r->key_len + r->size) != r->sum)
+        return NULL;
+    return r;
+}
+
+/* find key in the index, with the link pointing at it in *pp */
+static struct disk_entry *entry_find(char *key, struct disk_entry ***pp) {
+    unsigned int hash = hash_disk_key(key);
+    struct disk_entry **link = &entries[hash & (DISK_BUCKETS - 1)];
+
+    for (; *link != NULL; link = &(*link)->next)
+        if ((*link)->hash == hash && !strcmp((*link)->key, key))
+            break;
+    if (pp)
+        *pp = link;
+    return *link;
+}
+
+/* unlink the entry *pp points at */
+static void entry_del(struct disk_entry **pp) {
+    struct disk_entry *e = *pp;
+
+    *pp = e->next;
+    e->seg->live -= e->len;
+    nentries--;
+    Free(e->key);
+    Free(e);
+}
+
+/* index the record at off in s under its key, replacing an older one */
+static void entry_set(struct segment *s, uint32_t off, struct disk_rec *r) {
+    char *key = (char *)(r + 1);
+    struct disk_entry *e, **pp;
+
+    if ((e = entry_find(key, &pp)) != NULL)
+        entry_del(pp);
+    e = Malloc(sizeof(struct disk_entry));
+    e->key = Malloc(r->key_len);
+    memcpy(e->key, key, r->key_len);
+    e->hash = hash_disk_key(key);
+    e->seg = s;
+    e->off = off;
+    e->len = rec_len(r->key_len, r->size);
+    e->next = entries[e->hash & (DISK_BUCKETS - 1)];
+    entries[e->hash & (DISK_BUCKETS - 1)] = e;
+    s->live += e->len;
+    nentries++;
+}
+
+static void log_write(uint32_t op, struct segment *s, uint32_t off) {
+    struct disk_index_rec ir;
+
+    memset(&ir, 0, sizeof(ir));
+    ir.op = op;
+    ir.seg = s->id;
+    ir.off = off;
+    if (write(index_fd, &ir, sizeof(ir)) == sizeof(ir))
+        log_records++;
+}
+
+/* forget every object in s and delete its file */
+static void seg_drop(struct segment *s) {
+    char path[MAXLINE];
+    struct segment **pp;
+    struct disk_entry *e, **link;
+    struct disk_rec *r;
+    size_t off;
+    int i;
+
+    for (off = 0; s->live > 0 && (r = rec_at(s, off)) != NULL;
+            off += rec_len(r->key_len, r->size))
+        if ((e = entry_find((char *)(r + 1), &link)) != NULL && e->seg == s)
+            entry_del(link);
+    for (i = 0; s->live > 0 && i < DISK_BUCKETS; i++)
+        for (link = &entries[i]; *link != NULL; )
+            if ((*link)->seg == s)
+                entry_del(link);
+            else
+                link = &(*link)->next;
+    for (pp = &segs; *pp != s; pp = &(*pp)->next)
+        ;
+    *pp = s->next;
+    disk_bytes -= s->len;
+    munmap(s->map, DISK_SEGMENT_SIZE);
+    close(s->fd);
+    seg_path(path, s->id);
+    unlink(path);
+    Free(s);
+}
+
+/*
+ * append an object record to the newest segment, starting a new one
+ * when it is full, and index it; return -1 if it could not be written
+ */
+static int append(char *key, char *data, size_t size, size_t hdr_len,
+        struct cache_fresh *fr) {
+    struct disk_rec r;
+    struct iovec iov[4];
+    uint32_t len, off;
+    char pad[8] = {0};
+
+    memset(&r, 0, sizeof(r));
+    r.magic = DISK_MAGIC;
+    r.key_len = strlen(key) + 1;
+    r.size = size;
+    r.hdr_len = hdr_len;
+    r.must_revalidate = fr->must_revalidate;
+    r.date = fr->date;
+    r.expires = fr->expires;
+    r.usable = fr->usable;
+    r.sum = fnv(fnv(2166136261u, key, r.key_len), data, size);
+    len = rec_len(r.key_len, size);
+
+    if (newest == NULL || newest->len + len > DISK_SEGMENT_SIZE)
+        if ((newest = seg_open(next_id, 1)) == NULL)
+            return -1;
+    off = newest->len;
+    iov[0].iov_base = &r;
+    iov[0].iov_len = sizeof(r);
+    iov[1].iov_base = key;
+    iov[1].iov_len = r.key_len;
+    iov[2].iov_base = data;
+    iov[2].iov_len = size;
+    iov[3].iov_base = pad;
+    iov[3].iov_len = len - (sizeof(r) + r.key_len + size);
+    if (pwritev(newest->fd, iov, 4, off) != len)
+        return -1;
+    newest->len += len;
+    disk_bytes += len;
+    entry_set(newest, off, (struct disk_rec *)(newest->map + off));
+    log_write(DISK_ADD, newest, off);
+    return 0;
+}
+
+/* drop the oldest segments until the limit holds, never the newest */
+static void enforce_limit() {
+    while (disk_bytes > disk_limit && segs != newest)
+        seg_drop(segs);
+}
+
+/*
+ * copy the live objects of the first sealed segment that has become
+ * mostly dead into the newest one and delete it
+ */
+static void compact() {
+    struct segment *s;
+    struct disk_entry *e;
+    struct disk_rec *r;
+    struct cache_fresh fr;
+    size_t off;
+
+    for (s = segs; s != NULL && s != newest; s = s->next)
+        if (s->live * 100 < s->len * DISK_COMPACT_LIVE)
+            break;
+    if (s == NULL || s == newest)
+        return;
+    for (off = 0; s->live > 0 && (r = rec_at(s, off)) != NULL;
+            off += rec_len(r->key_len, r->size)) {
+        char *key = (char *)(r + 1);
+        if ((e = entry_find(key, NULL)) == NULL || e->seg != s || e->off != off)
+            continue;
+        fr.date = r->date;
+        fr.expires = r->expires;
+        fr.usable = r->usable;
+        fr.must_revalidate = r->must_revalidate;
+        if (append(key, key + r->key_len, r->size, r->hdr_len, &fr) < 0)
+            return;
+    }
+    seg_drop(s);
+}
+
+/* rewrite the index log with only the live entries once it is mostly dead */
+static void checkpoint() {
+    char path[MAXLINE], tmp[MAXLINE];
+    struct disk_entry *e;
+    int i, fd, old;
+
+    if (log_records < 2 * nentries + 1024)
+        return;
+    snprintf(path, MAXLINE, "%s/index", disk_dir);
+    snprintf(tmp, MAXLINE, "%s/index.tmp", disk_dir);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return;
+    old = index_fd;
+    index_fd = fd;
+    log_records = 0;
+    for (i = 0; i < DISK_BUCKETS; i++)
+        for (e = entries[i]; e != NULL; e = e->next)
+            log_write(DISK_ADD, e->seg, e->off);
+    if (rename(tmp, path) < 0) {
+        close(fd);
+        index_fd = old;
+        return;
+    }
+    close(old);
+}
+
+/* rebuild the index from the segments and the log in dir */
+static int load(char *dir) {
+    char path[MAXLINE];
+    struct disk_index_rec ir;
+    struct disk_entry *e, **pp;
+    struct segment *s;
+    struct disk_rec *r;
+    struct dirent *de;
+    unsigned int id;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+        return -1;
+    while ((de = readdir(dp)) != NULL)
+        if (sscanf(de->d_name, "seg.%8u", &id) == 1)
+            seg_open(id, 0);
+    closedir(dp);
+
+    snprintf(path, MAXLINE, "%s/index", dir);
+    if ((index_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0)
+        return -1;
+    while (read(index_fd, &ir, sizeof(ir)) == sizeof(ir)) {
+        log_records++;
+        if ((s = seg_find(ir.seg)) == NULL || (r = rec_at(s, ir.off)) == NULL)
+            continue;
+        if (ir.op == DISK_ADD) {
+            entry_set(s, ir.off, r);
+        } else if ((e = entry_find((char *)(r + 1), &pp)) != NULL &&
+                e->seg == s && e->off == ir.off) {
+            entry_del(pp);
+        }
+    }
+    return 0;
+}
+
+/*
+ * open the second tier in dir, created if needed, holding at most
+ * limit_mb megabytes; what an earlier run left there is indexed again.
+ * return -1 if the directory cannot be used
+ */
+int disk_init(char *dir, long limit_mb) {
+    pthread_t tid;
+
+    Sem_init(&disk_mutex, 0, 1);
+    Sem_init(&queue_mutex, 0, 1);
+    Sem_init(&queue_items, 0, 0);
+    memset(entries, 0, sizeof(entries));
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+    disk_dir = Malloc(strlen(dir) + 1);
+    strcpy(disk_dir, dir);
+    disk_limit = (size_t)limit_mb << 20;
+    if (load(dir) < 0)
+        return -1;
+
+    /* never append after what may be a torn tail, start a new segment */
+    newest = NULL;
+    P(&disk_mutex);
+    enforce_limit();
+    log_records = 2 * nentries + 1024;
+    checkpoint();
+    V(&disk_mutex);
+
+    enabled = 1;
+    Pthread_create(&tid, NULL, writer_thread, NULL);
+    return 0;
+}
+
+/* is the second tier in use */
+int disk_active() {
+    return enabled;
+}
+
+/*
+ * take an evicted block, pinned by the caller, to be written out; it
+ * is dropped instead when the writer is too far behind
+ */
+void disk_demote(struct cache_block *b) {
+    P(&queue_mutex);
+    if (queue_count == DISK_QUEUE) {
+        V(&queue_mutex);
+        cache_release(b);
+        return;
+    }
+    queue[(queue_head + queue_count++) % DISK_QUEUE] = b;
+    V(&queue_mutex);
+    V(&queue_items);
+}
+
+/*
+ * copy the object stored under key out of its segment, with its size,
+ * where its headers end and its freshness; return NULL if it is not on
+ * disk
+ */
+char *disk_read(char *key, size_t *size, size_t *hdr_len, struct cache_fresh *fr) {
+    struct disk_entry *e, **pp;
+    struct disk_rec *r;
+    char *buf = NULL;
+
+    P(&disk_mutex);
+    if ((e = entry_find(key, &pp)) != NULL &&
+            (r = rec_at(e->seg, e->off)) == NULL) {
+        /* damaged under us, forget it rather than serve it */
+        log_write(DISK_DEL, e->seg, e->off);
+        entry_del(pp);
+    } else if (e != NULL) {
+        buf = Malloc(r->size);
+        memcpy(buf, (char *)(r + 1) + r->key_len, r->size);
+        *size = r->size;
+        *hdr_len = r->hdr_len;
+        fr->date = r->date;
+        fr->expires = r->expires;
+        fr->usable = r->usable;
+        fr->must_revalidate = r->must_revalidate;
+    }
+    V(&disk_mutex);
+    return buf;
+}
+
+/* forget the object stored under key, a newer one replaced it */
+void disk_remove(char *key) {
+    struct disk_entry *e, **pp;
+
+    P(&disk_mutex);
+    if ((e = entry_find(key, &pp)) != NULL) {
+        log_write(DISK_DEL, e->seg, e->off);
+        entry_del(pp);
+    }
+    V(&disk_mutex);
+}
+
+/*
+ * write out one demoted block unless the same object, as fresh, is
+ * already on disk
+ */
+static void store(struct cache_block *b) {
+    struct disk_entry *e;
+    struct disk_rec *r;
+    struct cache_fresh fr;
+
+    fr.date = __atomic_load_n(&b->fresh.date, __ATOMIC_RELAXED);
+    fr.expires = __atomic_load_n(&b->fresh.expires, __ATOMIC_RELAXED);
+    fr.usable = __atomic_load_n(&b->fresh.usable, __ATOMIC_RELAXED);
+    fr.must_revalidate = __atomic_load_n(&b->fresh.must_revalidate, __ATOMIC_RELAXED);
+    P(&disk_mutex);
+    e = entry_find(b->key, NULL);
+    r = e ? (struct disk_rec *)(e->seg->map + e->off) : NULL;
+    if (r == NULL || r->size != b->size || r->hdr_len != b->hdr_len ||
+            r->expires != fr.expires ||
+            memcmp((char *)(r + 1) + r->key_len, b->response, b->size)) {
+        append(b->key, b->response, b->size, b->hdr_len, &fr);
+        enforce_limit();
+    }
+    V(&disk_mutex);
+    cache_release(b);
+}
+
+/*
+ * routine for the writer thread: write demoted blocks as they come,
+ * and compact and checkpoint when there are none for a second
+ */
+static void *writer_thread(void *vargp) {
+    struct cache_block *b;
+    struct timespec ts;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        if (sem_timedwait(&queue_items, &ts) < 0) {
+            P(&disk_mutex);
+            compact();
+            checkpoint();
+            V(&disk_mutex);
+            continue;
+        }
+        P(&queue_mutex);
+        b = queue[queue_head];
+        queue_head = (queue_head + 1) % DISK_QUEUE;
+        queue_count--;
+        V(&queue_mutex);
+        store(b);
+    }
+    return NULL;
+}
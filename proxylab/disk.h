@@ -0,0 +1,50 @@
+/*
+ * disk.h - on-disk second tier behind the web object cache
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define DISK_SEGMENT_SIZE  (4 << 20)    /* bytes per segment file */
+#define DISK_DEFAULT_LIMIT 64           /* megabytes kept on disk by default */
+#define DISK_BUCKETS       4096         /* index hash table size, a power of two */
+#define DISK_QUEUE         64           /* evicted blocks waiting to be written */
+#define DISK_COMPACT_LIVE  50           /* compact a segment under this percent live */
+#define DISK_MAGIC         0x50584f44u
+
+/* header of every object record in a segment, key and response follow */
+struct disk_rec {
+    uint32_t magic;
+    uint32_t key_len;           /* with its nul */
+    uint32_t size;
+    uint32_t hdr_len;
+    uint32_t sum;               /* FNV-1a of the key and the response */
+    uint32_t must_revalidate;
+    int64_t date;               /* freshness, as in struct cache_fresh */
+    int64_t expires;
+    int64_t usable;
+};
+
+/* one index log entry, an object record added or removed */
+struct disk_index_rec {
+    uint32_t op;                /* DISK_ADD or DISK_DEL */
+    uint32_t seg;
+    uint32_t off;
+    uint32_t pad;
+};
+#define DISK_ADD 1
+#define DISK_DEL 2
+
+struct cache_block;
+struct cache_fresh;
+
+int disk_init(char *dir, long limit_mb);
+int disk_active();
+void disk_demote(struct cache_block *b);
+char *disk_read(char *key, size_t *size, size_t *hdr_len, struct cache_fresh *fr);
+void disk_remove(char *key);
+
+#endif /* __DISK_H__ */
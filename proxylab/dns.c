@@ -0,0 +1,341 @@
+/*
+ * dns.c - origin name resolution cache
+ *
+ * Every miss used to call getaddrinfo, so a slow resolver stalled the
+ * worker behind it. Resolutions of host:port are now kept for DNS_TTL
+ * seconds, and failures for DNS_NEGATIVE_TTL, so a missing name is not
+ * asked for again on every request.
+ *
+ * A name used within DNS_REFRESH_AHEAD of its expiry is marked, and a
+ * background thread resolves the marked names again once a second,
+ * so a name in steady use is never resolved on the request path. A
+ * failed refresh keeps the old answer and is tried again after
+ * DNS_REFRESH_RETRY, so a resolver outage neither stalls requests nor
+ * gets a retry every second. The same thread forgets names unused for
+ * DNS_IDLE_TTL. It also takes the queries of event loops, which must
+ * not block in getaddrinfo: a name dns_cached does not know is
+ * dns_submit'ted, and the loop resumes once the query is done.
+ *
+ * An optional hosts file in the /etc/hosts format is consulted first;
+ * its names never expire and never reach the resolver, which lets the
+ * proxy run against test origins without any DNS.
+ */
+#include "dns.h"
+
+struct dns_entry {
+    char *key;                  /* host:port, host lower case */
+    char *host;
+    char *port;
+    dns_result res;
+    time_t expires;
+    time_t used;                /* last lookup */
+    int refresh;                /* wanted by the refresh thread */
+    struct dns_entry *next;
+};
+
+/* one hosts file line: an address and one of its names */
+struct host_line {
+    char *name;
+    int family;
+    unsigned char addr[16];
+    struct host_line *next;
+};
+
+static struct dns_entry *names[DNS_BUCKETS];
+static struct host_line *hosts = NULL;
+static sem_t dns_mutex;
+
+static dns_query *queries = NULL, *queries_tail = NULL;
+static pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t query_ready = PTHREAD_COND_INITIALIZER;
+
+static void *refresh_thread(void *vargp);
+
+static unsigned int hash_name(char *key) {
+    unsigned int h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* read hosts_file, lines of an address followed by names, # comments */
+static void load_hosts(char *hosts_file) {
+    char line[MAXLINE], *tok, *save, *addr;
+    struct host_line *h;
+    unsigned char buf[16];
+    int family;
+    FILE *fp;
+
+    if ((fp = fopen(hosts_file, "r")) == NULL) {
+        fprintf(stderr, "cannot open hosts file %s: %s\n", hosts_file, strerror(errno));
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "#")] = '\0';
+        if ((addr = strtok_r(line, " \t\r\n", &save)) == NULL)
+            continue;
+        if (inet_pton(AF_INET, addr, buf) == 1)
+            family = AF_INET;
+        else if (inet_pton(AF_INET6, addr, buf) == 1)
+            family = AF_INET6;
+        else
+            continue;
+        while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            h = Malloc(sizeof(struct host_line));
+            h->name = Malloc(strlen(tok) + 1);
+            strcpy(h->name, tok);
+            h->family = family;
+            memcpy(h->addr, buf, sizeof(buf));
+            h->next = hosts;
+            hosts = h;
+        }
+    }
+    fclose(fp);
+}
+
+/* answer host:port from the hosts file, return 0 if it has no such name */
+static int hosts_lookup(char *host, char *port, dns_result *res) {
+    struct host_line *h;
+    struct dns_addr *a;
+
+    res->n = 0;
+    for (h = hosts; h != NULL && res->n < DNS_MAX_ADDRS; h = h->next) {
+        if (strcasecmp(h->name, host))
+            continue;
+        a = &res->addrs[res->n++];
+        memset(a, 0, sizeof(struct dns_addr));
+        a->family = h->family;
+        a->socktype = SOCK_STREAM;
+        if (h->family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&a->addr;
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(atoi(port));
+            memcpy(&sin->sin_addr, h->addr, 4);
+            a->addrlen = sizeof(struct sockaddr_in);
+        } else {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&a->addr;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(atoi(port));
+            memcpy(&sin6->sin6_addr, h->addr, 16);
+            a->addrlen = sizeof(struct sockaddr_in6);
+        }
+    }
+    return res->n > 0;
+}
+
+/* ask the system resolver, no lock held; res->n is 0 if it failed */
+static void resolve(char *host, char *port, dns_result *res) {
+    struct addrinfo hints, *listp, *p;
+    struct dns_addr *a;
+
+    res->n = 0;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &listp) != 0)
+        return;
+    for (p = listp; p != NULL && res->n < DNS_MAX_ADDRS; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+        a = &res->addrs[res->n++];
+        a->family = p->ai_family;
+        a->socktype = p->ai_socktype;
+        a->protocol = p->ai_protocol;
+        a->addrlen = p->ai_addrlen;
+        memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+    }
+    freeaddrinfo(listp);
+}
+
+/* when a fresh result for a name should expire */
+static time_t expiry(dns_result *res, time_t now) {
+    return now + (res->n > 0 ? DNS_TTL : DNS_NEGATIVE_TTL);
+}
+
+/* find host:port, caller holds the mutex */
+static struct dns_entry *find_entry(char *key, struct dns_entry ***bucketp) {
+    struct dns_entry **bucket = &names[hash_name(key) & (DNS_BUCKETS - 1)], *e;
+
+    for (e = *bucket; e != NULL; e = e->next)
+        if (!strcmp(e->key, key))
+            break;
+    if (bucketp)
+        *bucketp = bucket;
+    return e;
+}
+
+static void make_key(char *key, char *host, char *port) {
+    char *p = key;
+    while (*host && p < key + MAXLINE / 2)
+        *p++ = tolower((unsigned char)*host++);
+    snprintf(p, MAXLINE - (p - key), ":%s", port);
+}
+
+/* initialize the cache, with the names in hosts_file if it is not NULL */
+void dns_init(char *hosts_file) {
+    pthread_t tid;
+
+    Sem_init(&dns_mutex, 0, 1);
+    memset(names, 0, sizeof(names));
+    if (hosts_file)
+        load_hosts(hosts_file);
+    Pthread_create(&tid, NULL, refresh_thread, NULL);
+}
+
+/*
+ * answer host:port into res from the hosts file or the cache; return
+ * 0, -1 if the name is known not to resolve, DNS_MISS if it is not
+ * known
+ */
+int dns_cached(char *host, char *port, dns_result *res) {
+    char key[MAXLINE];
+    struct dns_entry *e;
+    time_t now = time(NULL);
+
+    if (hosts != NULL && hosts_lookup(host, port, res))
+        return 0;
+
+    make_key(key, host, port);
+    P(&dns_mutex);
+    if ((e = find_entry(key, NULL)) != NULL && now < e->expires) {
+        *res = e->res;
+        e->used = now;
+        if (e->expires - now < DNS_REFRESH_AHEAD && res->n > 0)
+            e->refresh = 1;
+        V(&dns_mutex);
+        return (res->n > 0) ? 0 : -1;
+    }
+    V(&dns_mutex);
+    return DNS_MISS;
+}
+
+/*
+ * resolve host:port into res, from the hosts file, the cache or the
+ * resolver in that order; return 0, or -1 if the name does not resolve
+ */
+int dns_resolve(char *host, char *port, dns_result *res) {
+    char key[MAXLINE];
+    struct dns_entry *e, **bucket;
+    time_t now = time(NULL);
+    int rc;
+
+    if ((rc = dns_cached(host, port, res)) != DNS_MISS)
+        return rc;
+    resolve(host, port, res);
+
+    make_key(key, host, port);
+    P(&dns_mutex);
+    if ((e = find_entry(key, &bucket)) == NULL) {
+        e = Calloc(1, sizeof(struct dns_entry));
+        e->key = Malloc(strlen(key) + 1);
+        strcpy(e->key, key);
+        e->host = Malloc(strlen(host) + 1);
+        strcpy(e->host, host);
+        e->port = Malloc(strlen(port) + 1);
+        strcpy(e->port, port);
+        e->next = *bucket;
+        *bucket = e;
+    }
+    e->res = *res;
+    e->expires = expiry(res, now);
+    e->used = now;
+    e->refresh = 0;
+    V(&dns_mutex);
+    return (res->n > 0) ? 0 : -1;
+}
+
+/*
+ * take the names marked for refresh out of the table one at a time,
+ * resolve them with no lock held and put the answers back; drop the
+ * ones nobody has used for DNS_IDLE_TTL
+ */
+static void refresh_pass() {
+    struct dns_entry **pp, *e;
+    char host[MAXLINE], port[MAXLINE], key[MAXLINE];
+    dns_result res;
+    time_t now;
+    int i;
+
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        P(&dns_mutex);
+        now = time(NULL);
+        pp = &names[i];
+        while ((e = *pp) != NULL) {
+            if (now - e->used > DNS_IDLE_TTL && now >= e->expires) {
+                *pp = e->next;
+                Free(e->key);
+                Free(e->host);
+                Free(e->port);
+                Free(e);
+                continue;
+            }
+            if (e->refresh) {
+                e->refresh = 0;
+                strcpy(key, e->key);
+                strcpy(host, e->host);
+                strcpy(port, e->port);
+                V(&dns_mutex);
+                resolve(host, port, &res);
+                P(&dns_mutex);
+                /*
+                 * keep the old answer over a failed refresh, long
+                 * enough for lookups not to mark it again at once
+                 */
+                if ((e = find_entry(key, NULL)) != NULL && res.n > 0) {
+                    e->res = res;
+                    e->expires = expiry(&res, time(NULL));
+                } else if (e != NULL) {
+                    e->expires = time(NULL) + DNS_REFRESH_AHEAD + DNS_REFRESH_RETRY;
+                }
+                pp = &names[i];     /* the chain may have changed */
+                continue;
+            }
+            pp = &e->next;
+        }
+        V(&dns_mutex);
+    }
+}
+
+/* resolve q->host:q->port without blocking the caller, q->done reports it */
+void dns_submit(dns_query *q) {
+    q->next = NULL;
+    pthread_mutex_lock(&query_lock);
+    if (queries_tail)
+        queries_tail->next = q;
+    else
+        queries = q;
+    queries_tail = q;
+    pthread_cond_signal(&query_ready);
+    pthread_mutex_unlock(&query_lock);
+}
+
+/*
+ * routine for the refresh thread: answer submitted queries as they
+ * come, and make a refresh pass every second
+ */
+static void *refresh_thread(void *vargp) {
+    struct timespec next = { time(NULL) + 1, 0 };
+    dns_query *q;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&query_lock);
+        while (queries == NULL &&
+                pthread_cond_timedwait(&query_ready, &query_lock, &next) != ETIMEDOUT)
+            ;
+        if ((q = queries) != NULL && (queries = q->next) == NULL)
+            queries_tail = NULL;
+        pthread_mutex_unlock(&query_lock);
+        if (q != NULL) {
+            dns_resolve(q->host, q->port, &q->res);
+            q->done(q);
+        }
+        if (time(NULL) >= next.tv_sec) {
+            refresh_pass();
+            next.tv_sec = time(NULL) + 1;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * dns.h - origin name resolution cache
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+#define DNS_BUCKETS       256   /* names hash table size, a power of two */
+#define DNS_MAX_ADDRS     8     /* addresses kept per name */
+#define DNS_TTL           60    /* seconds a resolution is trusted */
+#define DNS_NEGATIVE_TTL  5     /* seconds a failed resolution is remembered */
+#define DNS_REFRESH_AHEAD 15    /* refresh a used name this long before it expires */
+#define DNS_REFRESH_RETRY 5     /* seconds before a failed refresh is tried again */
+#define DNS_IDLE_TTL      600   /* forget a name unused for this long */
+
+struct dns_addr {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+};
+
+/* the addresses of host:port, in the order to try them */
+typedef struct {
+    int n;                      /* 0 when the name does not resolve */
+    struct dns_addr addrs[DNS_MAX_ADDRS];
+} dns_result;
+
+/*
+ * a resolution handed to the refresh thread by dns_submit; done is
+ * called on that thread with res filled in
+ */
+typedef struct dns_query {
+    char *host;
+    char *port;
+    dns_result res;
+    void (*done)(struct dns_query *q);
+    struct dns_query *next;
+} dns_query;
+
+#define DNS_MISS 1              /* dns_cached: not known, dns_submit it */
+
+void dns_init(char *hosts_file);
+int dns_resolve(char *host, char *port, dns_result *res);
+int dns_cached(char *host, char *port, dns_result *res);
+void dns_submit(dns_query *q);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,152 @@
+/*
+ * epoch.c - epoch based reclamation for lock-free readers
+ *
+ * A reader brackets its access to shared nodes with epoch_enter and
+ * epoch_exit, which only touch the calling thread's own record. A node
+ * unlinked by a writer is retired with the epoch current at that time
+ * and freed once the global epoch has moved two steps past it: by then
+ * every reader that could still have seen the node has left its
+ * critical section. The global epoch only advances when every active
+ * reader has observed the current one.
+ */
+#include "csapp.h"
+#include "epoch.h"
+
+/* per-thread record, reused after its thread exits */
+struct epoch_rec {
+    unsigned long epoch;
+    int active;
+    int in_use;
+    struct epoch_rec *next;
+};
+
+static unsigned long global_epoch = 0;
+static struct epoch_rec *records = NULL;
+static __thread struct epoch_rec *self = NULL;
+static pthread_key_t rec_key;
+
+static struct epoch_node *limbo = NULL;     /* retired, not yet freed */
+static sem_t limbo_mutex;
+
+/* thread exit, hand the record to a later thread */
+static void release_rec(void *arg) {
+    struct epoch_rec *r = arg;
+    __atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* find the record of the calling thread, registering it on first use */
+static struct epoch_rec *get_rec() {
+    struct epoch_rec *r;
+    int unused = 0;
+
+    if (self != NULL)
+        return self;
+    for (r = __atomic_load_n(&records, __ATOMIC_ACQUIRE); r; r = r->next) {
+        if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+        unused = 0;
+    }
+    if (r == NULL) {
+        r = Calloc(1, sizeof(struct epoch_rec));
+        r->in_use = 1;
+        r->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &r->next, r, 1,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(rec_key, r);
+    self = r;
+    return r;
+}
+
+void epoch_init() {
+    Sem_init(&limbo_mutex, 0, 1);
+    pthread_key_create(&rec_key, release_rec);
+}
+
+/* begin a read side critical section */
+void epoch_enter() {
+    struct epoch_rec *r = get_rec();
+    __atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&r->active, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* end a read side critical section */
+void epoch_exit() {
+    __atomic_store_n(&self->active, 0, __ATOMIC_RELEASE);
+}
+
+/* queue n to be freed by free_fn once no reader can reach it */
+void epoch_retire(struct epoch_node *n, void (*free_fn)(struct epoch_node *)) {
+    n->free_fn = free_fn;
+    n->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    P(&limbo_mutex);
+    n->next = limbo;
+    __atomic_store_n(&limbo, n, __ATOMIC_RELAXED);
+    V(&limbo_mutex);
+}
+
+/* move the global epoch on if every active reader has caught up */
+static void try_advance() {
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    struct epoch_rec *r;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (r = __atomic_load_n(&records, __ATOMIC_ACQUIRE); r; r = r->next)
+        if (__atomic_load_n(&r->active, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE) != e)
+            return;
+    __atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/*
+ * free the retired nodes that are safe, the free functions run with no
+ * lock held so they may take their owner's locks
+ */
+void epoch_reclaim() {
+    struct epoch_node *n, **pp, *ready = NULL;
+    unsigned long e;
+
+    if (__atomic_load_n(&limbo, __ATOMIC_RELAXED) == NULL)
+        return;
+    try_advance();
+    e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    P(&limbo_mutex);
+    pp = &limbo;
+    while ((n = *pp) != NULL) {
+        if (n->epoch + 2 <= e) {
+            __atomic_store_n(pp, n->next, __ATOMIC_RELAXED);
+            n->next = ready;
+            ready = n;
+        } else {
+            pp = &n->next;
+        }
+    }
+    V(&limbo_mutex);
+
+    while ((n = ready) != NULL) {
+        ready = n->next;
+        n->free_fn(n);
+    }
+}
+
+/* free everything still retired, only safe once all readers are gone */
+void epoch_drain() {
+    struct epoch_node *n;
+
+    P(&limbo_mutex);
+    n = limbo;
+    limbo = NULL;
+    V(&limbo_mutex);
+    while (n != NULL) {
+        struct epoch_node *next = n->next;
+        n->free_fn(n);
+        n = next;
+    }
+}
@@ -0,0 +1,21 @@
+/*
+ * epoch.h - epoch based reclamation for lock-free readers
+ */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+/* intrusive node for an object waiting to be freed */
+struct epoch_node {
+    struct epoch_node *next;
+    unsigned long epoch;                    /* global epoch when retired */
+    void (*free_fn)(struct epoch_node *);   /* called once it is safe */
+};
+
+void epoch_init();
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(struct epoch_node *n, void (*free_fn)(struct epoch_node *));
+void epoch_reclaim();
+void epoch_drain();
+
+#endif /* __EPOCH_H__ */
@@ -0,0 +1,513 @@
+/*
+ * event.c - epoll based proxy engine
+ *
+ * Instead of parking a thread on every connection, a few loop threads
+ * each run an epoll instance over non-blocking sockets. The listening
+ * socket is shared by all loops with EPOLLEXCLUSIVE, so an incoming
+ * connection wakes one loop, which owns it from then on.
+ *
+ * Every connection is a small state machine:
+ *
+ *   READ_REQUEST   collect the request line and headers from the client
+ *   RESOLVE        wait for the dns.c thread to resolve the origin name
+ *   CONNECT        non-blocking connect to the origin, one address at a time
+ *   SEND_REQUEST   write the rewritten request to the origin
+ *   RELAY          copy the response to the client and fill the cache,
+ *                  or take a 304 revalidating a stale copy and serve that
+ *   WRITE_OUT      write a cache hit or an error message to the client
+ *
+ * What is done with the request, from parsing it to the cache, the
+ * stats page and revalidation, is the exchange.c part of a connection,
+ * shared with uring.c; this file only moves the bytes it asks for.
+ * Reads from the origin stop while the client has relayed bytes left to
+ * take, so a slow client never makes the proxy buffer a whole response.
+ * Origin names that are not cached are resolved on the dns.c thread,
+ * which wakes the loop through the eventfd of its waker, so the loop
+ * never waits in getaddrinfo.
+ *
+ * Each connection has a deadline for what it waits on, see
+ * exchange_wait: the client has CLIENT_IDLE_TIMEOUT to send its
+ * request, and the origin has the -t connect, first byte and stall
+ * timeouts upstream.c applies to the thread engine; a client that stops
+ * taking bytes gets the stall timeout too. Every loop checks the
+ * deadlines of its connections each EVENT_TICK and lets exchange_timeout
+ * decide between a 408, a 504 and just closing.
+ */
+#include "csapp.h"
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include "http.h"
+#include "exchange.h"
+#include "event.h"
+
+#define MAX_EVENTS 256
+#define EVENT_TICK 100          /* ms between checks of the deadlines */
+
+enum conn_state {
+    READ_REQUEST,
+    RESOLVE,
+    CONNECT,
+    SEND_REQUEST,
+    RELAY,
+    WRITE_OUT,
+    CLOSED
+};
+
+struct conn;
+
+/* a registered descriptor, epoll hands it back in data.ptr */
+struct endpoint {
+    struct conn *c;
+    int fd;
+    int registered;
+    unsigned int events;        /* current interest set */
+};
+
+/* one loop thread and its epoll instance */
+struct loop {
+    int epfd;
+    int listenfd;
+    exchange_waker_t waker;     /* the dns.c thread's wakeups */
+    struct conn *conns;         /* open connections, for their deadlines */
+    struct conn *dead;          /* closed during this batch of events */
+    long checked;               /* when the deadlines were last checked */
+};
+
+struct conn {
+    exchange_t x;               /* first, exchange_resolved hands it back */
+    enum conn_state state;
+    struct loop *loop;
+    struct endpoint client;
+    struct endpoint server;
+    struct iovec *out_next;     /* WRITE_OUT: rest of x.out */
+    char *relay;                /* RELAY: where the origin response is read */
+    char *wbuf;                 /* RELAY: bytes read but not yet written */
+    size_t relay_len;
+    size_t relay_off;
+    struct conn *prev;          /* loop's open connections */
+    struct conn *next;
+    struct conn *next_dead;
+};
+
+static void *loop_thread(void *vargp);
+static void conn_close(struct conn *c);
+static void on_send_request(struct conn *c);
+static void on_write_out(struct conn *c);
+
+static void set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* make events the interest set of ep, registering it on first use */
+static void watch(struct loop *lp, struct endpoint *ep, unsigned int events) {
+    struct epoll_event ev;
+
+    if (ep->fd < 0 || (ep->registered && ep->events == events))
+        return;
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(lp->epfd, ep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                ep->fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ep->registered = 1;
+    ep->events = events;
+}
+
+/* forget an endpoint and close its descriptor */
+static void endpoint_close(struct endpoint *ep) {
+    if (ep->fd >= 0)
+        close(ep->fd);
+    ep->fd = -1;
+    ep->registered = 0;
+    ep->events = 0;
+}
+
+/*
+ * write as much of the cnt iovecs at *iov to fd as it takes, moving
+ * past what was written; return 1 when all is out, 0 when fd is full,
+ * -1 on error
+ */
+static int writev_some(int fd, struct iovec **iov, int *cnt) {
+    ssize_t n;
+
+    while (*cnt > 0) {
+        if ((n = writev(fd, *iov, *cnt)) < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        while (*cnt > 0 && (size_t)n >= (*iov)->iov_len) {
+            n -= (*iov)->iov_len;
+            (*iov)++;
+            (*cnt)--;
+        }
+        if (*cnt > 0) {
+            (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+            (*iov)->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+/* write the answer the exchange queued in x.out and close once it is out */
+static void write_out(struct conn *c) {
+    c->out_next = c->x.out;
+    c->state = WRITE_OUT;
+    exchange_wait(&c->x, WAIT_STALL);
+    on_write_out(c);
+}
+
+/*
+ * start a non-blocking connect to the next origin address, close the
+ * connection once every address has failed
+ */
+static void start_connect(struct conn *c) {
+    struct dns_addr *p;
+    int fd;
+
+    endpoint_close(&c->server);
+    while (c->x.next_addr < c->x.addrs->n) {
+        p = &c->x.addrs->addrs[c->x.next_addr++];
+        if ((fd = socket(p->family, p->socktype, p->protocol)) < 0)
+            continue;
+        set_nonblock(fd);
+        c->server.fd = fd;
+        if (connect(fd, (struct sockaddr *)&p->addr, p->addrlen) == 0) {
+            stats_since(STAGE_CONNECT, c->x.connecting);
+            c->state = SEND_REQUEST;
+            on_send_request(c);
+            return;
+        }
+        if (errno == EINPROGRESS) {
+            c->state = CONNECT;
+            exchange_wait(&c->x, WAIT_CONNECT);
+            watch(c->loop, &c->server, EPOLLOUT);
+            return;
+        }
+        endpoint_close(&c->server);
+    }
+    conn_close(c);
+}
+
+/* do what the exchange asked for next */
+static void proceed(struct conn *c, int next) {
+    switch (next) {
+    case XCHG_WRITE:
+        write_out(c);
+        break;
+    case XCHG_RESOLVE:
+        c->state = RESOLVE;
+        break;
+    case XCHG_CONNECT:
+        start_connect(c);
+        break;
+    default:
+        conn_close(c);
+        break;
+    }
+}
+
+/* resume the connections whose origin names the dns.c thread resolved */
+static void on_resolved(struct loop *lp) {
+    exchange_t *x;
+    uint64_t n;
+
+    if (read(lp->waker.fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        unix_error("eventfd read error");
+    while ((x = exchange_resolved(&lp->waker)) != NULL)
+        proceed((struct conn *)x, x->addrs->n > 0 ? XCHG_CONNECT : XCHG_CLOSE);
+}
+
+/* READ_REQUEST: feed bytes to the parser until the request is complete */
+static void on_request_data(struct conn *c) {
+    exchange_t *x = &c->x;
+    ssize_t n;
+    int rc;
+
+    while ((n = read(c->client.fd, x->in + x->in_len,
+                    sizeof(x->in) - x->in_len)) > 0) {
+        if ((rc = exchange_feed(x, n)) == HTTP_OK) {
+            watch(c->loop, &c->client, 0);
+            proceed(c, exchange_start(x, &c->loop->waker));
+            return;
+        }
+        if (rc != HTTP_MORE)
+            break;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    conn_close(c);
+}
+
+/* CONNECT: the origin socket became writable, see how connect went */
+static void on_connected(struct conn *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        start_connect(c);
+        return;
+    }
+    stats_since(STAGE_CONNECT, c->x.connecting);
+    c->state = SEND_REQUEST;
+}
+
+/* SEND_REQUEST: push the rewritten request to the origin */
+static void on_send_request(struct conn *c) {
+    int rc;
+
+    if ((rc = writev_some(c->server.fd, &c->x.send, &c->x.send_cnt)) <= 0) {
+        if (rc == 0) {
+            exchange_wait(&c->x, WAIT_STALL);
+            watch(c->loop, &c->server, EPOLLOUT);
+        } else {
+            conn_close(c);
+        }
+        return;
+    }
+    c->relay = arena_alloc(c->x.arena, RELAY_CHUNK);
+    c->relay_len = c->relay_off = 0;
+    c->state = RELAY;
+    exchange_wait(&c->x, WAIT_FIRST_BYTE);
+    watch(c->loop, &c->server, EPOLLIN);
+}
+
+/*
+ * RELAY: flush relayed bytes to the client, return 1 once the relay
+ * buffer is empty again
+ */
+static int flush_relay(struct conn *c) {
+    ssize_t n;
+
+    while (c->relay_off < c->relay_len) {
+        n = write(c->client.fd, c->wbuf + c->relay_off,
+                c->relay_len - c->relay_off);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(c->loop, &c->server, 0);
+                watch(c->loop, &c->client, EPOLLOUT);
+                return 0;
+            }
+            conn_close(c);
+            return 0;
+        }
+        c->relay_off += n;
+        exchange_wait(&c->x, WAIT_STALL);
+    }
+    c->relay_len = c->relay_off = 0;
+    watch(c->loop, &c->client, 0);
+    watch(c->loop, &c->server, EPOLLIN);
+    return 1;
+}
+
+/* RELAY: read the origin response, pass it on and capture it */
+static void on_relay_data(struct conn *c) {
+    ssize_t n;
+    int rc;
+
+    while ((n = read(c->server.fd, c->relay, RELAY_CHUNK)) > 0) {
+        exchange_wait(&c->x, WAIT_STALL);
+        c->wbuf = c->relay;
+        c->relay_len = n;
+        c->relay_off = 0;
+        if ((rc = exchange_response(&c->x, &c->wbuf, &c->relay_len)) == XCHG_READ) {
+            c->relay_len = 0;
+            continue;
+        }
+        if (rc == XCHG_WRITE) {
+            /* a 304 revalidated the stale copy, the origin is done with */
+            endpoint_close(&c->server);
+            write_out(c);
+            return;
+        }
+        if (!flush_relay(c))
+            return;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n == 0)
+        exchange_response_end(&c->x);
+    conn_close(c);
+}
+
+/* WRITE_OUT: write the pending bytes and close when done */
+static void on_write_out(struct conn *c) {
+    if (writev_some(c->client.fd, &c->out_next, &c->x.out_cnt) == 0) {
+        exchange_wait(&c->x, WAIT_STALL);
+        watch(c->loop, &c->client, EPOLLOUT);
+        return;
+    }
+    conn_close(c);
+}
+
+/* the deadline of c passed, answer or close as the exchange decides */
+static void on_timeout(struct conn *c) {
+    int next = exchange_timeout(&c->x);
+
+    if (next == XCHG_WRITE) {
+        watch(c->loop, &c->client, 0);
+        endpoint_close(&c->server);
+    }
+    proceed(c, next);
+}
+
+/* answer or close the connections of lp whose deadline has passed */
+static void check_deadlines(struct loop *lp) {
+    struct conn *c, *next;
+    long now = stats_now();
+
+    if (now - lp->checked < EVENT_TICK * 1000)
+        return;
+    lp->checked = now;
+    for (c = lp->conns; c != NULL; c = next) {
+        next = c->next;
+        if (c->x.deadline && now >= c->x.deadline)
+            on_timeout(c);
+    }
+}
+
+/* dispatch one epoll event to the connection's state handler */
+static void on_event(struct endpoint *ep, unsigned int events) {
+    struct conn *c = ep->c;
+    int is_client = (ep == &c->client);
+
+    if (c->state == CLOSED)
+        return;
+    if ((events & (EPOLLERR | EPOLLHUP)) && !(events & (EPOLLIN | EPOLLOUT))) {
+        if (c->state == CONNECT && !is_client)
+            start_connect(c);
+        else
+            conn_close(c);
+        return;
+    }
+    switch (c->state) {
+    case READ_REQUEST:
+        on_request_data(c);
+        break;
+    case RESOLVE:
+        break;
+    case CONNECT:
+        on_connected(c);
+        if (c->state == SEND_REQUEST)
+            on_send_request(c);
+        break;
+    case SEND_REQUEST:
+        on_send_request(c);
+        break;
+    case RELAY:
+        if (is_client) {
+            if (flush_relay(c))
+                on_relay_data(c);
+        } else {
+            on_relay_data(c);
+        }
+        break;
+    case WRITE_OUT:
+        on_write_out(c);
+        break;
+    case CLOSED:
+        break;
+    }
+}
+
+/* accept every pending connection on the shared listening socket */
+static void on_accept(struct loop *lp) {
+    struct conn *c;
+    int fd, one = 1;
+
+    while ((fd = accept(lp->listenfd, NULL, NULL)) >= 0) {
+        set_nonblock(fd);
+        /* relayed responses go out in pieces, don't let Nagle hold them */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c = Calloc(1, sizeof(struct conn));
+        c->state = READ_REQUEST;
+        c->loop = lp;
+        c->client.c = c->server.c = c;
+        c->client.fd = fd;
+        c->server.fd = -1;
+        exchange_open(&c->x);
+        if ((c->next = lp->conns) != NULL)
+            c->next->prev = c;
+        lp->conns = c;
+        watch(lp, &c->client, EPOLLIN);
+    }
+}
+
+/*
+ * tear a connection down; the memory is kept until the current batch
+ * of events is done since later events may still point at it
+ */
+static void conn_close(struct conn *c) {
+    if (c->state == CLOSED)
+        return;
+    c->state = CLOSED;
+    endpoint_close(&c->client);
+    endpoint_close(&c->server);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        c->loop->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    exchange_close(&c->x);
+    c->next_dead = c->loop->dead;
+    c->loop->dead = c;
+}
+
+static void *loop_thread(void *vargp) {
+    struct loop *lp = vargp;
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    int i, n;
+
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.events = EPOLLIN;
+    ev.data.ptr = lp;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->waker.fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    while (1) {
+        if ((n = epoll_wait(lp->epfd, events, MAX_EVENTS, EVENT_TICK)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                on_accept(lp);
+            else if (events[i].data.ptr == lp)
+                on_resolved(lp);
+            else
+                on_event(events[i].data.ptr, events[i].events);
+        }
+        check_deadlines(lp);
+        while (lp->dead != NULL) {
+            struct conn *c = lp->dead;
+            lp->dead = c->next_dead;
+            Free(c);
+        }
+    }
+    return NULL;
+}
+
+/* run nloops event loops on listenfd, never returns */
+void event_run(int listenfd, int nloops) {
+    pthread_t *tid = Calloc(nloops, sizeof(pthread_t));
+    int i;
+
+    set_nonblock(listenfd);
+    exchange_init();
+    for (i = 0; i < nloops; i++) {
+        struct loop *lp = Calloc(1, sizeof(struct loop));
+        if ((lp->epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+        exchange_waker_init(&lp->waker);
+        set_nonblock(lp->waker.fd);
+        lp->listenfd = listenfd;
+        Pthread_create(&tid[i], NULL, loop_thread, lp);
+    }
+    for (i = 0; i < nloops; i++)
+        Pthread_join(tid[i], NULL);
+    Free(tid);
+}
@@ -0,0 +1,9 @@
+/*
+ * event.h - epoll based proxy engine
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_run(int listenfd, int nloops);
+
+#endif /* __EVENT_H__ */
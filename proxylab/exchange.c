@@ -0,0 +1,343 @@
+/*
+ * exchange.c - request handling shared by the event loop engines
+ *
+ * event.c and uring.c differ in how they move bytes, not in what they
+ * do with them. An exchange is the part of a connection that does not
+ * care: it parses the request, answers it from the cache or the stats
+ * page, sets up the rewritten request and the origin addresses, holds
+ * back the response to a revalidation until its status is known,
+ * captures what is relayed for the cache and decides what a missed
+ * deadline is answered with. Each call returns an XCHG_ code telling
+ * the engine what to do next, which it does with its own sockets.
+ *
+ * Origin names missing from the dns.c cache are handed to the dns.c
+ * thread, which queues the finished lookup on the loop's waker and
+ * signals its eventfd; the loop then takes the exchanges back with
+ * exchange_resolved.
+ */
+#include "csapp.h"
+#include <sys/eventfd.h>
+#include "cache.h"
+#include "http.h"
+#include "dns.h"
+#include "refresh.h"
+#include "upstream.h"
+#include "exchange.h"
+
+/* an origin name resolved off the loop for an exchange */
+struct exchange_lookup {
+    dns_query q;
+    exchange_waker_t *waker;
+    exchange_t *x;              /* NULL once the connection is closed */
+    struct exchange_lookup *next;
+};
+
+static int connect_ms, first_byte_ms, stall_ms;     /* upstream.c's timeouts */
+
+/* take the timeouts set with -t, once upstream_init has run */
+void exchange_init() {
+    upstream_timeouts(&connect_ms, &first_byte_ms, &stall_ms);
+}
+
+/* a waker whose eventfd blocks, event.c makes it non-blocking for epoll */
+void exchange_waker_init(exchange_waker_t *w) {
+    if ((w->fd = eventfd(0, 0)) < 0)
+        unix_error("eventfd error");
+    pthread_mutex_init(&w->lock, NULL);
+    w->resolved = NULL;
+}
+
+/* a connection was accepted, wait for its request */
+void exchange_open(exchange_t *x) {
+    x->start = stats_now();
+    http_parser_init(&x->parser);
+    objbuf_init(&x->obj);
+    exchange_wait(x, WAIT_CLIENT);
+}
+
+/* start a wait of the given kind, its deadline from the timeouts */
+void exchange_wait(exchange_t *x, int waiting) {
+    long ms = 0;
+
+    switch (waiting) {
+    case WAIT_CLIENT:
+        ms = CLIENT_IDLE_TIMEOUT * 1000;
+        break;
+    case WAIT_CONNECT:
+        ms = connect_ms;
+        break;
+    case WAIT_FIRST_BYTE:
+        ms = first_byte_ms;
+        break;
+    case WAIT_STALL:
+        ms = stall_ms;
+        break;
+    }
+    x->waiting = waiting;
+    x->deadline = (ms > 0) ? stats_now() + ms * 1000 : 0;
+}
+
+/*
+ * n more request bytes were read into in: HTTP_OK once the request is
+ * complete, HTTP_MORE while there is room for the rest, else
+ * HTTP_BAD_REQUEST
+ */
+int exchange_feed(exchange_t *x, size_t n) {
+    int rc;
+
+    x->in_len += n;
+    if ((rc = http_parse_feed(&x->parser, x->in, x->in_len)) == HTTP_OK)
+        return HTTP_OK;
+    if (rc != HTTP_MORE || x->in_len == sizeof(x->in))
+        return HTTP_BAD_REQUEST;
+    return HTTP_MORE;
+}
+
+/* answer with the cnt iovecs in out */
+static int write_out(exchange_t *x, int cnt) {
+    x->out_cnt = cnt;
+    return XCHG_WRITE;
+}
+
+/* answer with the pinned block hit */
+static int write_hit(exchange_t *x) {
+    int cnt, i;
+
+    /* one request per connection here, the hit says so */
+    x->req->keep_alive = 0;
+    cnt = http_hit_iov(x->hit, x->req, x->out, x->in);
+    stats_add(STAT_HITS, 1);
+    for (i = 0; i < cnt; i++)
+        stats_add(STAT_BYTES_SAVED, x->out[i].iov_len);
+    stats_first_byte(&x->req->timer);
+    return write_out(x, cnt);
+}
+
+/* answer with an error message, kept in the now unused request buffer */
+static int write_error(exchange_t *x, char *cause, char *errnum,
+        char *shortmsg, char *longmsg) {
+    x->out[0].iov_base = x->in;
+    x->out[0].iov_len = http_error_response(x->in, sizeof(x->in), cause, errnum,
+            shortmsg, longmsg);
+    return write_out(x, 1);
+}
+
+/* on the dns.c thread: queue the finished lookup and wake its loop */
+static void lookup_done(dns_query *q) {
+    struct exchange_lookup *l = (struct exchange_lookup *)q;
+    exchange_waker_t *w = l->waker;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&w->lock);
+    l->next = w->resolved;
+    w->resolved = l;
+    pthread_mutex_unlock(&w->lock);
+    if (write(w->fd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+}
+
+/* hand the origin name of x to the dns.c thread */
+static int resolve_later(exchange_t *x, exchange_waker_t *w) {
+    size_t host_len = strlen(x->req->host) + 1, port_len = strlen(x->req->port) + 1;
+    struct exchange_lookup *l = Malloc(sizeof(struct exchange_lookup) + host_len + port_len);
+
+    l->q.host = (char *)(l + 1);
+    memcpy(l->q.host, x->req->host, host_len);
+    l->q.port = l->q.host + host_len;
+    memcpy(l->q.port, x->req->port, port_len);
+    l->q.done = lookup_done;
+    l->waker = w;
+    l->x = x;
+    x->lookup = l;
+    exchange_wait(x, WAIT_CONNECT);
+    dns_submit(&l->q);
+    return XCHG_RESOLVE;
+}
+
+/*
+ * the next exchange whose origin name the dns.c thread resolved for
+ * the loop of w, with addrs filled in, NULL when there is none
+ */
+exchange_t *exchange_resolved(exchange_waker_t *w) {
+    struct exchange_lookup *l;
+    exchange_t *x;
+
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        if ((l = w->resolved) != NULL)
+            w->resolved = l->next;
+        pthread_mutex_unlock(&w->lock);
+        if (l == NULL)
+            return NULL;
+        if ((x = l->x) != NULL) {
+            x->lookup = NULL;
+            *x->addrs = l->q.res;
+        }
+        Free(l);
+        if (x != NULL)
+            return x;
+    }
+}
+
+/* a complete request is in, serve it from the cache or the origin */
+int exchange_start(exchange_t *x, exchange_waker_t *w) {
+    http_request *req;
+    char method[MAXLINE];
+    long looked;
+    int rc, json;
+
+    /* an idle connection holds no arena, it takes one once a request is in */
+    x->arena = arena_get();
+    req = x->req = arena_alloc(x->arena, sizeof(http_request));
+    req->arena = x->arena;
+    req->timer.start = 0;
+    if ((rc = http_parse_request(&x->parser, req, 0)) != HTTP_OK) {
+        if (rc != HTTP_NOT_IMPL)
+            return XCHG_CLOSE;
+        snprintf(method, sizeof(method), "%.*s", (int)req->method.iov_len,
+                (char *)req->method.iov_base);
+        return write_error(x, method, "501", "Not Implemented",
+                "Tiny does not implement this method");
+    }
+
+    stats_start(&req->timer, x->start);
+    stats_add(STAT_REQUESTS, 1);
+    if (req->origin_form &&
+            (json = stats_wanted(req->path.iov_base, req->path.iov_len)) != 0) {
+        x->page = arena_alloc(x->arena, STATS_PAGE_MAX + MAXLINE);
+        if ((rc = stats_page(x->page, STATS_PAGE_MAX + MAXLINE, json == 2, 0)) < 0)
+            return XCHG_CLOSE;
+        x->out[0].iov_base = x->page;
+        x->out[0].iov_len = rc;
+        stats_first_byte(&req->timer);
+        return write_out(x, 1);
+    }
+
+    looked = stats_now();
+    x->hit = cache_lookup(req->cache_key);
+    stats_since(STAGE_LOOKUP, looked);
+    if (x->hit != NULL) {
+        if (cache_usable(x->hit) && !req->no_cache) {
+            if (!cache_fresh(x->hit)) {
+                refresh_schedule(x->hit, req);
+                stats_add(STAT_STALE_HITS, 1);
+            }
+            return write_hit(x);
+        }
+        if (!req->conditional && http_add_conditional(req, x->hit))
+            x->stale = x->hit;
+        else
+            cache_release(x->hit);
+        x->hit = NULL;
+    }
+    x->send = req->iov;
+    x->send_cnt = req->iovcnt;
+
+    x->connecting = stats_now();
+    x->addrs = arena_alloc(x->arena, sizeof(dns_result));
+    x->next_addr = 0;
+    if ((rc = dns_cached(req->host, req->port, x->addrs)) == DNS_MISS)
+        return resolve_later(x, w);
+    return (rc < 0) ? XCHG_CLOSE : XCHG_CONNECT;
+}
+
+/*
+ * while revalidating: hold the response back until its status line is
+ * in. anything but a 304 is then relayed from the start, a 304 refreshes
+ * the stale copy, which is served once the headers are in
+ */
+static int revalidating(exchange_t *x, char **buf, size_t *len) {
+    char *end;
+
+    if (x->obj.len < 12)
+        return XCHG_READ;
+    if (strncmp(x->obj.data + 8, " 304", 4)) {
+        cache_release(x->stale);
+        x->stale = NULL;
+        *buf = arena_alloc(x->arena, x->obj.len);
+        memcpy(*buf, x->obj.data, x->obj.len);
+        *len = x->obj.len;
+        return XCHG_RELAY;
+    }
+    if ((end = http_body_start(x->obj.data, x->obj.len)) == NULL)
+        return XCHG_READ;
+    http_revalidated(x->stale, x->obj.data, end - x->obj.data);
+    stats_add(STAT_REVALIDATED, 1);
+    x->hit = x->stale;
+    x->stale = NULL;
+    return write_hit(x);
+}
+
+/*
+ * the *len bytes at *buf of the origin response arrived: capture them,
+ * and XCHG_RELAY to pass the *len bytes now at *buf to the client, which
+ * is the whole response so far once a revalidation turned out not to be
+ * a 304. XCHG_READ while the response is held back, XCHG_WRITE to serve
+ * the revalidated copy instead, the origin is done with then
+ */
+int exchange_response(exchange_t *x, char **buf, size_t *len) {
+    int rc;
+
+    objbuf_append(&x->obj, *buf, *len);
+    if (x->stale && (rc = revalidating(x, buf, len)) != XCHG_RELAY)
+        return rc;
+    if (!x->req->timer.first_byte) {
+        stats_add(STAT_MISSES, 1);
+        stats_first_byte(&x->req->timer);
+    }
+    return XCHG_RELAY;
+}
+
+/* the origin closed a response that was relayed whole, cache it if it may be */
+void exchange_response_end(exchange_t *x) {
+    if (!x->obj.too_large && !x->stale && !x->req->no_store && !x->req->conditional)
+        http_cache_response(x->req->cache_key, x->obj.data, x->obj.len);
+}
+
+/*
+ * the deadline of x passed: a request that is late coming gets a 408,
+ * one the origin did not answer a 504 unless the client already has
+ * part of the response, else the connection just closes. XCHG_CONNECT
+ * gives a connect that timed out the next origin address to try
+ */
+int exchange_timeout(exchange_t *x) {
+    x->deadline = 0;
+    if (x->req == NULL) {
+        if (x->in_len == 0)
+            return XCHG_CLOSE;
+        return write_error(x, "request", "408", "Request Timeout",
+                "The request did not arrive in time");
+    }
+    if (x->out_cnt > 0 || x->req->timer.first_byte)
+        return XCHG_CLOSE;
+
+    /* still waiting on the origin */
+    stats_add(STAT_UPSTREAM_TIMEOUTS, 1);
+    if (x->waiting == WAIT_CONNECT && x->lookup == NULL &&
+            x->next_addr < x->addrs->n)
+        return XCHG_CONNECT;
+    if (x->lookup) {
+        x->lookup->x = NULL;
+        x->lookup = NULL;
+    }
+    return write_error(x, x->req->host, "504", "Gateway Timeout",
+            "The origin server did not answer in time");
+}
+
+/* let go of everything x holds, the engine closes the sockets */
+void exchange_close(exchange_t *x) {
+    if (x->lookup)
+        x->lookup->x = NULL;
+    if (x->hit)
+        cache_release(x->hit);
+    if (x->stale)
+        cache_release(x->stale);
+    objbuf_free(&x->obj);
+    if (x->req) {
+        if (x->req->timer.start)
+            stats_since(STAGE_TOTAL, x->req->timer.start);
+        Free(x->req->decoded);
+    }
+    if (x->arena)
+        arena_put(x->arena);
+}
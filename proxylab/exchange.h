@@ -0,0 +1,71 @@
+/*
+ * exchange.h - request handling shared by the event loop engines
+ */
+#ifndef __EXCHANGE_H__
+#define __EXCHANGE_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "dns.h"
+
+/* what the engine does next, returned by the exchange_ calls */
+#define XCHG_CLOSE   0      /* close the connection */
+#define XCHG_WRITE   1      /* write the out_cnt iovecs in out, then close */
+#define XCHG_RESOLVE 2      /* wait for the origin name, see exchange_resolved */
+#define XCHG_CONNECT 3      /* connect to addrs from next_addr on, then send */
+#define XCHG_READ    4      /* read more of the origin response */
+#define XCHG_RELAY   5      /* pass the response bytes on to the client */
+
+/* what a deadline is for, see exchange_wait */
+#define WAIT_CLIENT     0   /* the client to send its request */
+#define WAIT_CONNECT    1   /* the origin name and connection */
+#define WAIT_FIRST_BYTE 2   /* the origin to start its response */
+#define WAIT_STALL      3   /* either side to take or send more bytes */
+
+struct exchange_lookup;
+
+/* how the dns.c thread wakes a loop it resolved names for */
+typedef struct {
+    int fd;                     /* eventfd the loop waits on */
+    pthread_mutex_t lock;       /* guards resolved */
+    struct exchange_lookup *resolved;
+} exchange_waker_t;
+
+/* one client request on a loop, kept in the engine's connection */
+typedef struct exchange {
+    char in[MAXBUF];            /* request line and headers */
+    size_t in_len;
+    http_parser parser;
+    http_request *req;          /* points into in */
+    struct iovec *send;         /* rest of req->iov for the origin */
+    int send_cnt;
+    dns_result *addrs;          /* origin addresses */
+    int next_addr;              /* the next one to try */
+    struct exchange_lookup *lookup; /* the origin name being resolved */
+    struct iovec out[3];        /* XCHG_WRITE: bytes for the client */
+    int out_cnt;
+    struct cache_block *hit;    /* pinned block behind out */
+    struct cache_block *stale;  /* pinned copy the request revalidates */
+    objbuf_t obj;               /* response captured for the cache */
+    char *page;                 /* the stats page */
+    arena_t *arena;             /* req and the buffers above, from exchange_start */
+    long start;                 /* when the connection was accepted */
+    long connecting;            /* when the origin connection was begun */
+    long deadline;              /* when the current wait gives up, 0 for never */
+    int waiting;                /* WAIT_ kind of the current wait */
+} exchange_t;
+
+void exchange_init();
+void exchange_waker_init(exchange_waker_t *w);
+void exchange_open(exchange_t *x);
+void exchange_wait(exchange_t *x, int waiting);
+int exchange_feed(exchange_t *x, size_t n);
+int exchange_start(exchange_t *x, exchange_waker_t *w);
+exchange_t *exchange_resolved(exchange_waker_t *w);
+int exchange_response(exchange_t *x, char **buf, size_t *len);
+void exchange_response_end(exchange_t *x);
+int exchange_timeout(exchange_t *x);
+void exchange_close(exchange_t *x);
+
+#endif /* __EXCHANGE_H__ */
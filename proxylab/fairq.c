@@ -0,0 +1,236 @@
+/*
+ * fairq.c - fair queuing of origin transfers by client address
+ *
+ * Cache hits are answered as soon as they are parsed, and so are
+ * requests following another's fetch or ranges found in cached
+ * chunks. Only a transfer from the origin, a fetch or a run of missing
+ * chunks, first takes one of a fixed number of transfer slots. While
+ * slots are free a request takes one at once; when they are all taken
+ * it waits in its client's queue, one queue per client address,
+ * however many connections that client opened.
+ *
+ * Freed slots go round the clients with waiting requests by deficit
+ * round robin on bytes. A request's size is only known once it has
+ * been sent, so the bytes are charged when it gives its slot back,
+ * as read off the client socket. A client gets a slot on its turn
+ * while its deficit is positive. When no waiting client has credit,
+ * each is credited FAIRQ_QUANTUM bytes per round, as many rounds as
+ * the least indebted needs. A client moving many bytes runs up a debt
+ * and waits while clients asking for small objects are served. Credit
+ * is dropped when a client has nothing left waiting. Its debt outlives
+ * its last request by FAIRQ_GRACE seconds, so closing and reopening
+ * connections does not clear it; idle clients past that are swept from
+ * the bucket being looked up and one more bucket per request done.
+ */
+#include "csapp.h"
+#include <sys/ioctl.h>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
+#include "fairq.h"
+#include "stats.h"
+
+/* a request waiting for a slot, on its waiting thread's stack */
+struct waiter {
+    sem_t ready;
+    struct waiter *next;
+};
+
+struct fairq_client {
+    int family;
+    unsigned char addr[16];
+    unsigned int hash;
+    long deficit;               /* bytes it may move before its turn is skipped */
+    int users;                  /* its requests waiting or transferring */
+    time_t idle;                /* when users last dropped to 0 */
+    struct waiter *head;        /* its waiting requests, oldest first */
+    struct waiter *tail;
+    int queued;                 /* on the round robin ring */
+    struct fairq_client *hnext;
+    struct fairq_client *rnext;
+};
+
+static int enabled = 0;
+static int free_slots;
+static struct fairq_client *clients[FAIRQ_BUCKETS];
+static struct fairq_client *ring_head = NULL, *ring_tail = NULL;
+static unsigned int sweep_at = 0;   /* next bucket fairq_leave sweeps */
+static sem_t mutex;             /* guards everything above */
+
+/* initialize with slots transfers at once, 0 leaves transfers unscheduled */
+void fairq_init(int slots) {
+    Sem_init(&mutex, 0, 1);
+    free_slots = slots;
+    enabled = slots > 0;
+}
+
+/* bytes written to the socket so far, acked or still queued */
+static unsigned long written(int fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    int outq = 0;
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return 0;
+    ioctl(fd, SIOCOUTQ, &outq);
+    return info.tcpi_bytes_acked + outq;
+}
+
+/* forget idle clients in a bucket owing nothing or past their grace; mutex held */
+static void sweep(unsigned int bucket, time_t now) {
+    struct fairq_client **pp = &clients[bucket], *c;
+
+    while ((c = *pp) != NULL) {
+        if (c->users == 0 && (c->deficit >= 0 || now - c->idle >= FAIRQ_GRACE)) {
+            *pp = c->hnext;
+            Free(c);
+        } else {
+            pp = &c->hnext;
+        }
+    }
+}
+
+/* the client with address ss, made if it is new; mutex held */
+static struct fairq_client *client_get(struct sockaddr_storage *ss) {
+    struct fairq_client *c;
+    unsigned char *addr;
+    unsigned int h = 2166136261u;
+    size_t i, n;
+
+    if (ss->ss_family == AF_INET6) {
+        addr = ((struct sockaddr_in6 *)ss)->sin6_addr.s6_addr;
+        n = 16;
+    } else {
+        addr = (unsigned char *)&((struct sockaddr_in *)ss)->sin_addr;
+        n = 4;
+    }
+    for (i = 0; i < n; i++) {
+        h ^= addr[i];
+        h *= 16777619u;
+    }
+    sweep(h & (FAIRQ_BUCKETS - 1), time(NULL));
+    for (c = clients[h & (FAIRQ_BUCKETS - 1)]; c != NULL; c = c->hnext)
+        if (c->hash == h && c->family == ss->ss_family && !memcmp(c->addr, addr, n))
+            return c;
+    c = Calloc(1, sizeof(struct fairq_client));
+    c->family = ss->ss_family;
+    memcpy(c->addr, addr, n);
+    c->hash = h;
+    c->hnext = clients[h & (FAIRQ_BUCKETS - 1)];
+    clients[h & (FAIRQ_BUCKETS - 1)] = c;
+    return c;
+}
+
+static void ring_push(struct fairq_client *c) {
+    c->rnext = NULL;
+    if (ring_tail)
+        ring_tail->rnext = c;
+    else
+        ring_head = c;
+    ring_tail = c;
+    c->queued = 1;
+}
+
+static struct fairq_client *ring_pop() {
+    struct fairq_client *c = ring_head;
+
+    if ((ring_head = c->rnext) == NULL)
+        ring_tail = NULL;
+    c->queued = 0;
+    return c;
+}
+
+/*
+ * if no waiting client has credit, give them all as many quanta as
+ * the least indebted of them needs to have some; mutex held
+ */
+static void credit() {
+    struct fairq_client *c;
+    long rounds = -1, r;
+
+    for (c = ring_head; c != NULL; c = c->rnext) {
+        if (c->deficit > 0)
+            return;
+        r = -c->deficit / FAIRQ_QUANTUM + 1;
+        if (rounds < 0 || r < rounds)
+            rounds = r;
+    }
+    for (c = ring_head; c != NULL; c = c->rnext)
+        c->deficit += rounds * FAIRQ_QUANTUM;
+}
+
+/* hand free slots to waiting requests, a client at a time; mutex held */
+static void dispatch() {
+    struct fairq_client *c;
+    struct waiter *w;
+
+    while (free_slots > 0 && ring_head != NULL) {
+        credit();
+        c = ring_pop();
+        if (c->deficit > 0) {
+            w = c->head;
+            if ((c->head = w->next) == NULL)
+                c->tail = NULL;
+            free_slots--;
+            V(&w->ready);
+        }
+        if (c->head != NULL)
+            ring_push(c);
+        else if (c->deficit > 0)
+            c->deficit = 0;
+    }
+}
+
+/* wait for a transfer slot for a request from the client on client_fd */
+void fairq_enter(fairq_ticket *t, int client_fd) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    struct waiter w;
+    long queued;
+
+    t->c = NULL;
+    if (!enabled || getpeername(client_fd, (struct sockaddr *)&ss, &len) < 0)
+        return;
+    P(&mutex);
+    t->c = client_get(&ss);
+    t->c->users++;
+    if (free_slots > 0 && ring_head == NULL) {
+        free_slots--;
+        V(&mutex);
+    } else {
+        Sem_init(&w.ready, 0, 0);
+        w.next = NULL;
+        if (t->c->tail)
+            t->c->tail->next = &w;
+        else
+            t->c->head = &w;
+        t->c->tail = &w;
+        if (!t->c->queued)
+            ring_push(t->c);
+        dispatch();
+        V(&mutex);
+        queued = stats_now();
+        P(&w.ready);
+        sem_destroy(&w.ready);
+        stats_add(STAT_QUEUED, 1);
+        stats_since(STAGE_QUEUE, queued);
+    }
+    t->written = written(client_fd);
+}
+
+/* give the slot back, charging the client for what the request sent */
+void fairq_leave(fairq_ticket *t, int client_fd) {
+    unsigned long n;
+
+    if (t->c == NULL)
+        return;
+    n = written(client_fd) - t->written;
+    P(&mutex);
+    t->c->deficit -= n;
+    if (--t->c->users == 0)
+        t->c->idle = time(NULL);
+    sweep(sweep_at++ & (FAIRQ_BUCKETS - 1), time(NULL));
+    free_slots++;
+    dispatch();
+    V(&mutex);
+}
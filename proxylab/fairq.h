@@ -0,0 +1,24 @@
+/*
+ * fairq.h - fair queuing of origin transfers by client address
+ */
+#ifndef __FAIRQ_H__
+#define __FAIRQ_H__
+
+#define FAIRQ_SLOTS    32           /* origin transfers at once by default */
+#define FAIRQ_QUANTUM  (64 << 10)   /* bytes a waiting client is credited per round */
+#define FAIRQ_BUCKETS  256          /* client table size, a power of two */
+#define FAIRQ_GRACE    30           /* seconds an idle client keeps its debt */
+
+struct fairq_client;
+
+/* a request's hold on a transfer slot */
+typedef struct {
+    struct fairq_client *c;     /* NULL if it was not scheduled */
+    unsigned long written;      /* bytes sent to the client before it */
+} fairq_ticket;
+
+void fairq_init(int slots);
+void fairq_enter(fairq_ticket *t, int client_fd);
+void fairq_leave(fairq_ticket *t, int client_fd);
+
+#endif /* __FAIRQ_H__ */
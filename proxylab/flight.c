@@ -0,0 +1,237 @@
+/*
+ * flight.c - in-flight cache misses shared by concurrent requests
+ *
+ * The first request to miss on a key becomes the leader of a flight:
+ * it fetches from the origin and appends everything it relays to the
+ * flight's buffer. Requests that miss on the same key while the flight
+ * is listed join it as followers and stream the response out of that
+ * buffer at their own pace, so the origin sees a single request.
+ *
+ * Followers only ever see a response that is shared whole: one the
+ * cache may store and that fits in MAX_OBJECT_SIZE. Its headers are
+ * handed out as soon as its length is known to fit, else once the body
+ * is in. A response that turns out not to be shared leaves the table
+ * and stops buffering, and its followers, which have sent nothing yet,
+ * fetch it on their own.
+ */
+#include "flight.h"
+#include "cache.h"
+
+static struct flight *flights[FLIGHT_BUCKETS];
+static sem_t flight_mutex;      /* guards the table and every refcnt */
+
+static unsigned int hash_flight(char *key) {
+    unsigned int h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* take f out of the table, caller holds flight_mutex */
+static void unlist(struct flight *f) {
+    struct flight **pp = &flights[f->hash & (FLIGHT_BUCKETS - 1)];
+
+    if (!f->listed)
+        return;
+    while (*pp != f)
+        pp = &(*pp)->next;
+    *pp = f->next;
+    f->listed = 0;
+}
+
+/* initialize the in-flight table */
+void flight_init() {
+    Sem_init(&flight_mutex, 0, 1);
+    memset(flights, 0, sizeof(flights));
+}
+
+/*
+ * join the flight fetching key, or start one and lead it; *leader
+ * tells which, either way the caller ends with flight_leave
+ */
+struct flight *flight_join(char *key, int *leader) {
+    unsigned int hash = hash_flight(key);
+    struct flight **bucket = &flights[hash & (FLIGHT_BUCKETS - 1)];
+    struct flight *f;
+
+    P(&flight_mutex);
+    for (f = *bucket; f != NULL; f = f->next)
+        if (f->hash == hash && !strcmp(f->key, key))
+            break;
+    if (f != NULL) {
+        f->refcnt++;
+        V(&flight_mutex);
+        *leader = 0;
+        return f;
+    }
+
+    f = Calloc(1, sizeof(struct flight));
+    f->key = Malloc(strlen(key) + 1);
+    strcpy(f->key, key);
+    f->hash = hash;
+    f->refcnt = 1;
+    f->listed = 1;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->grown, NULL);
+    f->next = *bucket;
+    *bucket = f;
+    V(&flight_mutex);
+    *leader = 1;
+    return f;
+}
+
+/*
+ * a flight for a request whose response is its own, nobody joins it
+ * and it buffers nothing; the caller leads it and ends with
+ * flight_leave
+ */
+struct flight *flight_solo(char *key) {
+    struct flight *f = Calloc(1, sizeof(struct flight));
+
+    f->key = Malloc(strlen(key) + 1);
+    strcpy(f->key, key);
+    f->hash = hash_flight(key);
+    f->refcnt = 1;
+    f->dropped = 1;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->grown, NULL);
+    return f;
+}
+
+/*
+ * leader: stop sharing and buffering the response unless followers
+ * already have its headers, and send them to fetch it on their own;
+ * return whether it is now dropped
+ */
+int flight_detach(struct flight *f) {
+    pthread_mutex_lock(&f->lock);
+    if (f->hdr_len == 0) {
+        f->dropped = 1;
+        f->done = FLIGHT_UNSHARED;
+        pthread_cond_broadcast(&f->grown);
+    }
+    pthread_mutex_unlock(&f->lock);
+    if (!f->dropped)
+        return 0;
+
+    P(&flight_mutex);
+    unlist(f);
+    V(&flight_mutex);
+    if (f->data) {
+        Free(f->data);
+        f->data = NULL;
+        f->len = f->cap = 0;
+    }
+    return f->dropped;
+}
+
+/* leader: add n relayed bytes for the followers */
+void flight_append(struct flight *f, char *buf, size_t n) {
+    if (f->dropped)
+        return;
+    if (f->len + n > MAX_OBJECT_SIZE && flight_detach(f))
+        return;
+
+    pthread_mutex_lock(&f->lock);
+    if (f->len + n > f->cap) {
+        size_t cap = f->cap ? f->cap : MAXBUF;
+        while (cap < f->len + n)
+            cap *= 2;
+        f->data = Realloc(f->data, cap);
+        f->cap = cap;
+    }
+    memcpy(f->data + f->len, buf, n);
+    f->len += n;
+    pthread_cond_broadcast(&f->grown);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * leader: the response is to be shared, hand followers its headers,
+ * which end at hdr_len with the blank line after them
+ */
+void flight_headers_done(struct flight *f, size_t hdr_len) {
+    if (f->dropped)
+        return;
+    pthread_mutex_lock(&f->lock);
+    f->hdr_len = hdr_len;
+    pthread_cond_broadcast(&f->grown);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * leader: the response is complete, or failed; new misses on the key
+ * start a fresh flight from now on
+ */
+void flight_end(struct flight *f, int ok) {
+    P(&flight_mutex);
+    unlist(f);
+    V(&flight_mutex);
+
+    pthread_mutex_lock(&f->lock);
+    if (f->done == 0)
+        f->done = ok ? 1 : -1;
+    pthread_cond_broadcast(&f->grown);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * follower: wait for the headers, return where they end or 0 if the
+ * flight failed or was not shared first
+ */
+size_t flight_wait_headers(struct flight *f) {
+    size_t hdr_len;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->hdr_len == 0 && f->done == 0)
+        pthread_cond_wait(&f->grown, &f->lock);
+    hdr_len = f->hdr_len;
+    if (f->done < 0)
+        hdr_len = 0;
+    pthread_mutex_unlock(&f->lock);
+    return hdr_len;
+}
+
+/*
+ * follower: copy up to size bytes from offset off, waiting until there
+ * are some; return 0 once the complete response has been read, -1 if
+ * the flight failed
+ */
+ssize_t flight_read(struct flight *f, size_t off, char *buf, size_t size) {
+    ssize_t n;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->len <= off && f->done == 0)
+        pthread_cond_wait(&f->grown, &f->lock);
+    if (f->done < 0) {
+        n = -1;
+    } else {
+        n = (f->len > off) ? f->len - off : 0;
+        if ((size_t)n > size)
+            n = size;
+        memcpy(buf, f->data + off, n);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return n;
+}
+
+/* drop a reference, the last one frees the flight */
+void flight_leave(struct flight *f) {
+    int last;
+
+    P(&flight_mutex);
+    last = (--f->refcnt == 0);
+    if (last)
+        unlist(f);
+    V(&flight_mutex);
+    if (!last)
+        return;
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->grown);
+    if (f->data)
+        Free(f->data);
+    Free(f->key);
+    Free(f);
+}
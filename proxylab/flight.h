@@ -0,0 +1,44 @@
+/*
+ * flight.h - in-flight cache misses shared by concurrent requests
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+
+#define FLIGHT_BUCKETS 64       /* in-flight table size, a power of two */
+#define FLIGHT_UNSHARED -2      /* done: followers must fetch on their own */
+
+/*
+ * one origin fetch and the response it has produced so far: the end to
+ * end headers, the blank line at hdr_len, then the body as the origin
+ * sent it
+ */
+struct flight {
+    char *key;                  /* cache key being fetched */
+    unsigned int hash;
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t hdr_len;             /* 0 until the headers are in */
+    int done;                   /* 1 complete, -1 failed, 0 running, or FLIGHT_UNSHARED */
+    int dropped;                /* not shared, not buffered */
+    int listed;                 /* still in the table for new followers */
+    int refcnt;                 /* the leader plus one per follower */
+    pthread_mutex_t lock;
+    pthread_cond_t grown;       /* signalled on more data and at the end */
+    struct flight *next;
+};
+
+void flight_init();
+struct flight *flight_join(char *key, int *leader);
+struct flight *flight_solo(char *key);
+int flight_detach(struct flight *f);
+void flight_append(struct flight *f, char *buf, size_t n);
+void flight_headers_done(struct flight *f, size_t hdr_len);
+void flight_end(struct flight *f, int ok);
+size_t flight_wait_headers(struct flight *f);
+ssize_t flight_read(struct flight *f, size_t off, char *buf, size_t size);
+void flight_leave(struct flight *f);
+
+#endif /* __FLIGHT_H__ */
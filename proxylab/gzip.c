@@ -0,0 +1,79 @@
+/*
+ * gzip.c - gzip coding of cached bodies
+ *
+ * Text bodies are kept in the cache gzip coded, which fits several
+ * times as many of them in the same memory and disk. Clients that take
+ * gzip get the stored bytes as they are, the rest get them decoded on
+ * the way out. Both directions are single zlib calls over whole bodies,
+ * cached objects are small enough for that.
+ */
+#include "csapp.h"
+#include <zlib.h>
+#include "gzip.h"
+
+/*
+ * gzip len bytes at in into a new buffer and set *out_len; NULL if
+ * zlib fails or the result would not save at least 1/GZIP_MIN_SAVING
+ */
+char *gzip_compress(char *in, size_t len, size_t *out_len) {
+    z_stream zs;
+    size_t limit = len - len / GZIP_MIN_SAVING;
+    char *out;
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16 more window bits ask for a gzip wrapper instead of zlib's */
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    out = Malloc(limit);
+    zs.next_in = (unsigned char *)in;
+    zs.avail_in = len;
+    zs.next_out = (unsigned char *)out;
+    zs.avail_out = limit;
+    rc = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        Free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * decode the gzip stream of len bytes at in into a new buffer and set
+ * *out_len; NULL if it is corrupt or decodes to more than limit bytes
+ */
+char *gzip_decompress(char *in, size_t len, size_t limit, size_t *out_len) {
+    z_stream zs;
+    unsigned char *t;
+    size_t size;
+    char *out;
+    int rc;
+
+    if (len < 18)
+        return NULL;
+    /* the trailer holds the decoded size, a hint good enough for the buffer */
+    t = (unsigned char *)in + len - 4;
+    size = t[0] | t[1] << 8 | t[2] << 16 | (size_t)t[3] << 24;
+    if (size > limit)
+        return NULL;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        return NULL;
+    out = Malloc(size + 1);
+    zs.next_in = (unsigned char *)in;
+    zs.avail_in = len;
+    zs.next_out = (unsigned char *)out;
+    zs.avail_out = size + 1;
+    rc = inflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END || *out_len != size) {
+        Free(out);
+        return NULL;
+    }
+    return out;
+}
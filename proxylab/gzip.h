@@ -0,0 +1,16 @@
+/*
+ * gzip.h - gzip coding of cached bodies
+ */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <stddef.h>
+
+#define GZIP_LEVEL 6          /* zlib compression level for stored bodies */
+#define GZIP_MIN_SIZE 256     /* bodies smaller than this are stored as they are */
+#define GZIP_MIN_SAVING 8     /* keep the gzip copy if it saves an eighth */
+
+char *gzip_compress(char *in, size_t len, size_t *out_len);
+char *gzip_decompress(char *in, size_t len, size_t limit, size_t *out_len);
+
+#endif /* __GZIP_H__ */
@@ -0,0 +1,1278 @@
+/*
+ * http.c - request parsing and rewriting shared by the proxy engines
+ */
+#include <limits.h>
+#include "http.h"
+#include "gzip.h"
+
+/* You won't lose style points for including these long lines in your code */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *http_version_hdr = "HTTP/1.0\r\n";
+static const char *http11_version_hdr = "HTTP/1.1\r\n";
+static const char *connection_hdr = "Connection: close\r\n";
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n";
+static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip\r\n";
+static const char *identity_hdr = "Accept-Encoding: identity\r\n";
+static const char *gzip_tag = "-gzip\"";     /* ends the ETag of a body the proxy coded */
+
+/* is line a header named name, compared case insensitively */
+static int is_header(char *line, char *name) {
+    size_t n = strlen(name);
+    return !strncasecmp(line, name, n) && line[n] == ':';
+}
+
+/* connection scoped headers, never passed across the proxy */
+static int is_hop_by_hop(char *line) {
+    return is_header(line, "Connection") || is_header(line, "Proxy-Connection") ||
+        is_header(line, "Keep-Alive");
+}
+
+/* copy the next CRLF terminated line of hdrs into line, return its end */
+static char *next_line(char *hdrs, char *line) {
+    char *end = strchr(hdrs, '\n');
+    size_t n = end ? (size_t)(end - hdrs + 1) : strlen(hdrs);
+    if (n >= MAXLINE)
+        n = MAXLINE - 1;
+    memcpy(line, hdrs, n);
+    line[n] = '\0';
+    return hdrs + n;
+}
+
+/* start parsing a new request */
+void http_parser_init(http_parser *p) {
+    memset(p, 0, sizeof(http_parser));
+    p->state = P_METHOD;
+}
+
+/* end the current token at pos into sl */
+static void take(http_parser *p, http_slice *sl) {
+    sl->off = p->tok;
+    sl->len = p->pos - p->tok;
+    p->tok = p->pos + 1;
+}
+
+/* end the current header line, value trimmed of trailing blanks */
+static void end_header(http_parser *p, size_t value_end, size_t line_end) {
+    struct http_header *h = &p->headers[p->nheaders++];
+    while (value_end > h->value.off &&
+            (p->base[value_end - 1] == ' ' || p->base[value_end - 1] == '\t'))
+        value_end--;
+    h->value.len = value_end - h->value.off;
+    h->line.len = line_end - h->line.off;
+}
+
+/*
+ * go on parsing the request at the start of buf, len bytes of which
+ * are there, from where the last call stopped; buf may have moved in
+ * between. return HTTP_OK once the blank line is in and p->len is the
+ * request's length, HTTP_MORE to wait for more bytes, or
+ * HTTP_BAD_REQUEST. Every byte is looked at once
+ */
+int http_parse_feed(http_parser *p, char *buf, size_t len) {
+    struct http_header *h;
+    char c;
+
+    p->base = buf;
+    for (; p->pos < len; p->pos++) {
+        c = buf[p->pos];
+        h = &p->headers[p->nheaders];
+        switch (p->state) {
+        case P_METHOD:
+            if ((c == '\r' || c == '\n') && p->pos == p->tok) {
+                p->tok++;           /* empty lines before the request */
+            } else if (c == ' ') {
+                take(p, &p->method);
+                p->state = P_URI;
+            } else if (c < '!' || c > '~') {
+                return HTTP_BAD_REQUEST;
+            }
+            break;
+        case P_URI:
+            if (c == ' ') {
+                take(p, &p->uri);
+                p->state = P_VERSION;
+            } else if (c == '\r' || c == '\n') {
+                return HTTP_BAD_REQUEST;
+            }
+            break;
+        case P_VERSION:
+            if (c == '\r' || c == '\n') {
+                take(p, &p->version);
+                p->state = (c == '\r') ? P_REQUEST_LF : P_NAME_START;
+            }
+            break;
+        case P_REQUEST_LF:
+            if (c != '\n')
+                return HTTP_BAD_REQUEST;
+            p->state = P_NAME_START;
+            break;
+        case P_NAME_START:
+            if (c == '\r') {
+                p->state = P_END_LF;
+                break;
+            } else if (c == '\n') {
+                p->len = p->pos + 1;
+                return HTTP_OK;
+            } else if (c == ' ' || c == '\t' || c == ':' ||
+                    p->nheaders == HTTP_MAX_HEADERS) {
+                return HTTP_BAD_REQUEST;
+            }
+            h->line.off = h->name.off = p->pos;
+            p->state = P_NAME;
+            break;
+        case P_NAME:
+            if (c == ':') {
+                h->name.len = p->pos - h->name.off;
+                p->state = P_VALUE_START;
+            } else if (c == '\r' || c == '\n') {
+                return HTTP_BAD_REQUEST;
+            }
+            break;
+        case P_VALUE_START:
+            if (c == ' ' || c == '\t')
+                break;
+            h->value.off = p->pos;
+            p->state = P_VALUE;
+            /* fall through */
+        case P_VALUE:
+            if (c == '\r') {
+                p->tok = p->pos;
+                p->state = P_LINE_LF;
+            } else if (c == '\n') {
+                end_header(p, p->pos, p->pos + 1);
+                p->state = P_NAME_START;
+            }
+            break;
+        case P_LINE_LF:
+            if (c != '\n')
+                return HTTP_BAD_REQUEST;
+            end_header(p, p->tok, p->pos + 1);
+            p->state = P_NAME_START;
+            break;
+        case P_END_LF:
+            if (c != '\n')
+                return HTTP_BAD_REQUEST;
+            p->len = p->pos + 1;
+            return HTTP_OK;
+        }
+    }
+    return HTTP_MORE;
+}
+
+/*
+ * parse the next request on rp's connection in place in its buffer,
+ * reading more when it is not all there yet and moving a partial
+ * request to the front to make room; on success rp is left at the
+ * bytes that follow, a pipelined request perhaps. return -1 if the
+ * peer goes away or the request does not fit in the buffer
+ */
+int http_read_request(rio_t *rp, http_parser *p) {
+    ssize_t n;
+    int rc;
+
+    http_parser_init(p);
+    while ((rc = http_parse_feed(p, rp->rio_bufptr, rp->rio_cnt)) == HTTP_MORE) {
+        if (rp->rio_bufptr != rp->rio_buf) {
+            memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        if (rp->rio_cnt == RIO_BUFSIZE)
+            return -1;
+        while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                        RIO_BUFSIZE - rp->rio_cnt)) < 0 && errno == EINTR)
+            ;
+        if (n <= 0)
+            return -1;
+        rp->rio_cnt += n;
+    }
+    if (rc != HTTP_OK)
+        return -1;
+    rp->rio_bufptr += p->len;
+    rp->rio_cnt -= p->len;
+    return 0;
+}
+
+/* does slice sl of the parsed request equal s, ignoring case */
+static int slice_is(http_parser *p, http_slice sl, char *s) {
+    return sl.len == strlen(s) && !strncasecmp(p->base + sl.off, s, sl.len);
+}
+
+/* does the len bytes at s contain word, compared case insensitively */
+static int contains(char *s, size_t len, char *word) {
+    size_t n = strlen(word), i;
+    for (i = 0; i + n <= len; i++)
+        if (!strncasecmp(s + i, word, n))
+            return 1;
+    return 0;
+}
+
+/* do the parameters of an Accept-Encoding item leave it a q value above 0 */
+static int q_positive(char *s, char *end) {
+    for (; s < end; s++) {
+        if (*s != ';')
+            continue;
+        for (s++; s < end && (*s == ' ' || *s == '\t'); s++)
+            ;
+        if (end - s < 2 || tolower((unsigned char)s[0]) != 'q' || s[1] != '=')
+            continue;
+        /* 0, 0.0 up to 0.000 turn it down, any other digit does not */
+        for (s += 2; s < end && (*s == '0' || *s == '.'); s++)
+            ;
+        return s < end && isdigit((unsigned char)*s);
+    }
+    return 1;
+}
+
+/*
+ * does an Accept-Encoding value take gzip: by name with a q value
+ * above 0, or failing that as "*" with one
+ */
+static int accepts_gzip(char *s, size_t len) {
+    char *end = s + len, *item;
+    int gzip = -1, star = -1;
+    size_t n;
+
+    while (s < end) {
+        while (s < end && (*s == ' ' || *s == '\t' || *s == ','))
+            s++;
+        for (item = s; s < end && *s != ','; s++)
+            ;
+        for (n = 0; item + n < s && item[n] != ';' && item[n] != ' ' && item[n] != '\t'; n++)
+            ;
+        if ((n == 4 && !strncasecmp(item, "gzip", 4)) ||
+                (n == 6 && !strncasecmp(item, "x-gzip", 6)))
+            gzip = q_positive(item + n, s);
+        else if (n == 1 && *item == '*')
+            star = q_positive(item + n, s);
+    }
+    return (gzip >= 0) ? gzip : star > 0;
+}
+
+/*
+ * parse a Range value asking for one byte range into req: range_last
+ * is -1 for a range to the end, range_first -1 for the last range_last
+ * bytes; return 0 for several ranges or anything else
+ */
+static int parse_range(http_request *req, char *s, size_t len) {
+    char v[64], *p, *end;
+    long first, last;
+
+    if (len < 7 || len - 6 >= sizeof(v) || strncasecmp(s, "bytes=", 6))
+        return 0;
+    memcpy(v, s + 6, len - 6);
+    v[len - 6] = '\0';
+    if (strchr(v, ',') || !isdigit((unsigned char)v[v[0] == '-']))
+        return 0;
+    if (v[0] == '-') {
+        first = -1;
+        if ((last = strtol(v + 1, &end, 10)) <= 0)
+            return 0;
+    } else {
+        first = strtol(v, &p, 10);
+        if (*p != '-')
+            return 0;
+        if (p[1] == '\0') {
+            last = -1;
+            end = p + 1;
+        } else if (!isdigit((unsigned char)p[1]) ||
+                (last = strtol(p + 1, &end, 10)) < first) {
+            return 0;
+        }
+    }
+    if (*end != '\0')
+        return 0;
+    req->range_first = first;
+    req->range_last = last;
+    return 1;
+}
+
+/* add len bytes at base to the outgoing request */
+static void emit(http_request *req, const char *base, size_t len) {
+    req->iov[req->iovcnt].iov_base = (char *)base;
+    req->iov[req->iovcnt].iov_len = len;
+    req->iovcnt++;
+    req->len += len;
+}
+
+/*
+ * split host[:port] at s into req->host and req->port, "80" by
+ * default; return -1 if either does not fit
+ */
+static int set_host(http_request *req, char *s, size_t len) {
+    char *colon = memchr(s, ':', len);
+    size_t host_len = colon ? (size_t)(colon - s) : len;
+    size_t port_len = colon ? len - host_len - 1 : 0;
+
+    if (host_len == 0 || host_len >= sizeof(req->host) ||
+            port_len >= sizeof(req->port))
+        return -1;
+    memcpy(req->host, s, host_len);
+    req->host[host_len] = '\0';
+    if (port_len > 0) {
+        memcpy(req->port, colon + 1, port_len);
+        req->port[port_len] = '\0';
+    } else {
+        strcpy(req->port, "80");
+    }
+    return 0;
+}
+
+/*
+ * take the request URI apart: an absolute http:// URI, or one without
+ * a scheme, gives the host and the path, an origin form one only the
+ * path; other schemes are refused
+ */
+static int split_uri(http_parser *p, http_request *req) {
+    char *uri = p->base + p->uri.off, *end = uri + p->uri.len, *slash, *colon;
+
+    req->origin_form = uri == end || *uri == '/';
+    if (!req->origin_form) {
+        slash = memchr(uri, '/', end - uri);
+        colon = memchr(uri, ':', (slash ? slash : end) - uri);
+        if (colon && colon + 2 < end && colon + 1 == slash && colon[2] == '/') {
+            if (colon - uri != 4 || strncasecmp(uri, "http", 4))
+                return -1;
+            uri = colon + 3;
+            slash = memchr(uri, '/', end - uri);
+        }
+        if (set_host(req, uri, (slash ? slash : end) - uri) < 0)
+            return -1;
+        uri = slash ? slash : end;
+    }
+    req->path.iov_base = uri;
+    req->path.iov_len = end - uri;
+    return 0;
+}
+
+/*
+ * turn the request parsed by p into the request for the origin, an
+ * iovec list over the client's own bytes and a few constant headers;
+ * with keep_alive it asks for a persistent HTTP/1.1 connection
+ */
+int http_parse_request(http_parser *p, http_request *req, int keep_alive) {
+    struct http_header *h;
+    char *value;
+    int i, accept = 0, host = 0, if_header = 0;
+
+    req->iovcnt = 0;
+    req->len = 0;
+    req->host[0] = '\0';
+    req->method.iov_base = p->base + p->method.off;
+    req->method.iov_len = p->method.len;
+    req->http11 = slice_is(p, p->version, "HTTP/1.1");
+    req->keep_alive = req->http11;
+    req->no_store = req->no_cache = req->conditional = req->credentials = 0;
+    req->ranged = 0;
+    req->range_at = req->coding_at = -1;
+    req->accept_gzip = 0;
+    req->decoded = NULL;
+    if (!slice_is(p, p->method, "GET"))
+        return HTTP_NOT_IMPL;
+    if (split_uri(p, req) < 0)
+        return HTTP_BAD_REQUEST;
+
+    emit(req, req->method.iov_base, req->method.iov_len);
+    emit(req, " ", 1);
+    if (req->path.iov_len > 0)
+        emit(req, req->path.iov_base, req->path.iov_len);
+    else
+        emit(req, "/", 1);
+    emit(req, " ", 1);
+    emit(req, keep_alive ? http11_version_hdr : http_version_hdr,
+            strlen(keep_alive ? http11_version_hdr : http_version_hdr));
+
+    for (i = 0; i < p->nheaders; i++) {
+        h = &p->headers[i];
+        value = p->base + h->value.off;
+        if (slice_is(p, h->name, "Connection") ||
+                slice_is(p, h->name, "Proxy-Connection")) {
+            if (slice_is(p, h->value, "close"))
+                req->keep_alive = 0;
+            else if (slice_is(p, h->value, "keep-alive"))
+                req->keep_alive = 1;
+            continue;
+        }
+        if (slice_is(p, h->name, "Keep-Alive") || slice_is(p, h->name, "User-Agent"))
+            continue;
+        if (slice_is(p, h->name, "Cache-Control") || slice_is(p, h->name, "Pragma")) {
+            if (contains(value, h->value.len, "no-store"))
+                req->no_store = 1;
+            if (contains(value, h->value.len, "no-cache") ||
+                    contains(value, h->value.len, "max-age=0"))
+                req->no_cache = 1;
+        } else if (slice_is(p, h->name, "Authorization")) {
+            req->no_store = req->credentials = 1;
+        } else if (slice_is(p, h->name, "Cookie")) {
+            req->credentials = 1;
+        } else if (slice_is(p, h->name, "Range")) {
+            req->conditional = 1;
+            req->ranged = parse_range(req, value, h->value.len);
+            req->range_at = req->iovcnt;
+        } else if (h->name.len > 3 && !strncasecmp(p->base + h->name.off, "If-", 3)) {
+            req->conditional = 1;
+            if_header = 1;
+        }
+        if (slice_is(p, h->name, "Accept-Encoding")) {
+            req->accept_gzip = accepts_gzip(value, h->value.len);
+            continue;
+        } else if (slice_is(p, h->name, "Accept")) {
+            accept = 1;
+        } else if (slice_is(p, h->name, "Host")) {
+            if (req->host[0] == '\0' && set_host(req, value, h->value.len) < 0)
+                return HTTP_BAD_REQUEST;
+            host = 1;
+        }
+        emit(req, p->base + h->line.off, h->line.len);
+    }
+
+    emit(req, user_agent_hdr, strlen(user_agent_hdr));
+    if (keep_alive) {
+        emit(req, keep_alive_hdr, strlen(keep_alive_hdr));
+    } else {
+        emit(req, connection_hdr, strlen(connection_hdr));
+        emit(req, proxy_connection_hdr, strlen(proxy_connection_hdr));
+    }
+    /*
+     * the origin is only offered gzip, to clients that take it, so every
+     * client sharing a flight of the same coding can use its response
+     */
+    req->coding_at = req->iovcnt;
+    if (req->accept_gzip)
+        emit(req, accept_encoding_hdr, strlen(accept_encoding_hdr));
+    else
+        emit(req, identity_hdr, strlen(identity_hdr));
+    /* a range made conditional by the client is the origin's to answer */
+    if (if_header)
+        req->ranged = 0;
+    if (!accept)
+        emit(req, accept_hdr, strlen(accept_hdr));
+    if (req->host[0] == '\0')
+        return HTTP_BAD_REQUEST;
+    if (!host) {
+        emit(req, "Host: ", 6);
+        emit(req, req->host, strlen(req->host));
+        emit(req, ":", 1);
+        emit(req, req->port, strlen(req->port));
+        emit(req, "\r\n", 2);
+    }
+    emit(req, "\r\n", 2);
+    if (make_cache_key(req->cache_key, req->host, req->port, req->path.iov_base,
+                req->path.iov_len) < 0)
+        return HTTP_BAD_REQUEST;
+    return HTTP_OK;
+}
+
+/*
+ * read a start line and headers up to the blank line into hdrs,
+ * return -1 if the peer goes away or they do not fit
+ */
+int http_read_headers(rio_t *rp, char *hdrs, size_t size) {
+    size_t len = 0;
+    ssize_t n;
+
+    while ((n = rio_readlineb(rp, hdrs + len, size - len)) > 0) {
+        if (!strcmp(hdrs + len, "\r\n") || !strcmp(hdrs + len, "\n"))
+            return (len > 0) ? 0 : -1;
+        len += n;
+        if (len >= size - 1)
+            return -1;
+    }
+    return -1;
+}
+
+/*
+ * parse the status line and headers of an origin response in hdrs,
+ * work out its framing and whether the connection stays usable, and
+ * keep the end to end headers for the client, who gets its own
+ * Connection header and the blank line from http_conn_header
+ */
+int http_parse_response(char *hdrs, http_response *resp) {
+    char line[MAXLINE], *p;
+    int minor = 0, conn_close = 0, conn_keep = 0;
+    size_t n;
+
+    resp->content_length = -1;
+    resp->chunked = 0;
+    resp->len = 0;
+    hdrs = next_line(hdrs, line);
+    if (sscanf(line, "HTTP/1.%d %d", &minor, &resp->status) != 2)
+        return HTTP_BAD_REQUEST;
+
+    for (; line[0] != '\0' && strcmp(line, "\r\n"); hdrs = next_line(hdrs, line)) {
+        if (is_hop_by_hop(line) || is_header(line, "Transfer-Encoding")) {
+            for (p = line + strcspn(line, ":"); *p; p++)
+                *p = tolower((unsigned char)*p);
+            if (strstr(line, "close"))
+                conn_close = 1;
+            if (strstr(line, "keep-alive"))
+                conn_keep = 1;
+            if (strstr(line, "chunked"))
+                resp->chunked = 1;
+            if (is_hop_by_hop(line))
+                continue;
+        }
+        if (is_header(line, "Content-Length"))
+            resp->content_length = atol(line + strlen("Content-Length:"));
+        n = strlen(line);
+        if (resp->len + n >= sizeof(resp->buf) - HDR_SLACK)
+            return HTTP_BAD_REQUEST;
+        memcpy(resp->buf + resp->len, line, n);
+        resp->len += n;
+    }
+
+    if (resp->chunked)
+        resp->content_length = -1;
+
+    /* a close delimited body ends the connection */
+    resp->keep_alive = (minor >= 1) ? !conn_close : conn_keep;
+    if (http_has_body(resp) && !resp->chunked && resp->content_length < 0)
+        resp->keep_alive = 0;
+    return HTTP_OK;
+}
+
+/* responses to GET carry a body except for 1xx, 204 and 304 */
+int http_has_body(http_response *resp) {
+    return !(resp->status / 100 == 1 || resp->status == 204 || resp->status == 304);
+}
+
+/*
+ * can the client tell where this response ends without the connection
+ * closing: a length, or chunks for a client that understands them
+ */
+int http_client_framed(http_response *resp, http_request *req) {
+    if (!http_has_body(resp) || resp->content_length >= 0)
+        return 1;
+    return resp->chunked && req->http11;
+}
+
+/* format the Connection header and the blank line ending the headers */
+int http_conn_header(char *buf, int keep_alive) {
+    return sprintf(buf, "%s\r\n", keep_alive ? keep_alive_hdr : connection_hdr);
+}
+
+/* find the blank line ending the headers in raw, return the body */
+char *http_body_start(char *raw, size_t len) {
+    size_t i;
+    for (i = 0; i + 4 <= len; i++)
+        if (!memcmp(raw + i, "\r\n\r\n", 4))
+            return raw + i + 4;
+    return NULL;
+}
+
+/* drop every header named name from a header block, return the new length */
+static size_t strip_header(char *buf, size_t len, char *name) {
+    char *line = buf, *end;
+    while (line < buf + len) {
+        end = memchr(line, '\n', buf + len - line);
+        end = end ? end + 1 : buf + len;
+        if (is_header(line, name)) {
+            memmove(line, end, buf + len - end);
+            len -= end - line;
+        } else {
+            line = end;
+        }
+    }
+    return len;
+}
+
+/*
+ * drop the Transfer-Encoding of a chunked response for a client that
+ * does not speak HTTP/1.1; it gets the data alone, ended by the
+ * connection closing
+ */
+void http_strip_chunked(http_response *resp) {
+    resp->len = strip_header(resp->buf, resp->len, "Transfer-Encoding");
+}
+
+/* decode a chunked body in place, return its length or -1 if it is cut short */
+static long dechunk(char *body, size_t len) {
+    char *in = body, *out = body, *end = body + len;
+    long size;
+
+    while (in < end) {
+        size = strtol(in, NULL, 16);
+        if (size < 0 || (in = memchr(in, '\n', end - in)) == NULL)
+            return -1;
+        in++;
+        if (size == 0)
+            return out - body;
+        if (in + size > end)
+            return -1;
+        memmove(out, in, size);
+        out += size;
+        in += size + 2;
+    }
+    return -1;
+}
+
+enum { DC_SIZE, DC_EXT, DC_DATA, DC_DATA_END, DC_TRAILER_START, DC_TRAILER, DC_DONE };
+
+void http_dechunk_init(http_dechunker *d) {
+    d->state = DC_SIZE;
+    d->size = d->left = 0;
+}
+
+/*
+ * decode the next len bytes of a chunked body in place, whatever way
+ * it is split; return how many data bytes are left at the front of
+ * buf, -1 if the framing is bad. anything after the last chunk and
+ * its trailers is dropped
+ */
+long http_dechunk(http_dechunker *d, char *buf, size_t len) {
+    char *in = buf, *out = buf, *end = buf + len;
+    size_t n;
+    int c;
+
+    while (in < end) {
+        switch (d->state) {
+        case DC_SIZE:
+            c = (unsigned char)*in++;
+            if (isxdigit(c) && d->size < (LONG_MAX >> 4))
+                d->size = d->size * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+            else if (c == ';' || c == ' ' || c == '\t' || c == '\r')
+                d->state = DC_EXT;
+            else if (c == '\n')
+                d->state = d->size ? DC_DATA : DC_TRAILER_START;
+            else
+                return -1;
+            if (d->state == DC_DATA)
+                d->left = d->size;
+            break;
+        case DC_EXT:
+            if (*in++ == '\n') {
+                d->state = d->size ? DC_DATA : DC_TRAILER_START;
+                d->left = d->size;
+            }
+            break;
+        case DC_DATA:
+            n = (end - in < d->left) ? (size_t)(end - in) : (size_t)d->left;
+            memmove(out, in, n);
+            out += n;
+            in += n;
+            if ((d->left -= n) == 0)
+                d->state = DC_DATA_END;
+            break;
+        case DC_DATA_END:
+            if (*in++ == '\n') {
+                d->state = DC_SIZE;
+                d->size = 0;
+            }
+            break;
+        case DC_TRAILER_START:
+            c = *in++;
+            if (c == '\n')
+                d->state = DC_DONE;
+            else if (c != '\r')
+                d->state = DC_TRAILER;
+            break;
+        case DC_TRAILER:
+            if (*in++ == '\n')
+                d->state = DC_TRAILER_START;
+            break;
+        default:
+            in = end;
+            break;
+        }
+    }
+    return out - buf;
+}
+
+/* what the headers of a response say about its freshness */
+struct fresh_hdrs {
+    long date;                  /* -1 for any field that is absent */
+    long expires;               /* 0 if present but not a valid date */
+    long last_modified;
+    long age;
+    long max_age;
+    long s_maxage;
+    long swr;                   /* stale-while-revalidate seconds */
+    int no_store;               /* no-store, private, Set-Cookie or a Vary the key misses */
+    int no_cache;
+    int must_revalidate;
+};
+
+/* parse an IMF-fixdate like "Sun, 06 Nov 1994 08:49:37 GMT", -1 if it is not one */
+static long parse_date(char *s, size_t len) {
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char v[64], mon[4], *m;
+    struct tm tm;
+
+    if (len >= sizeof(v))
+        return -1;
+    memcpy(v, s, len);
+    v[len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(v, "%*[^,], %d %3s %d %d:%d:%d", &tm.tm_mday, mon, &tm.tm_year,
+                &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+            (m = strstr(months, mon)) == NULL || (m - months) % 3)
+        return -1;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/* the seconds of a delta-seconds directive like max-age=N at s, or -1 */
+static long directive_seconds(char *s, size_t len, char *name) {
+    size_t n = strlen(name), i;
+
+    for (i = 0; i + n < len; i++)
+        if (!strncasecmp(s + i, name, n) && s[i + n] == '=' &&
+                (i == 0 || s[i - 1] == ' ' || s[i - 1] == ','))
+            return atol(s + i + n + 1 + (s[i + n + 1] == '"'));
+    return -1;
+}
+
+/*
+ * find the value of header name in the len bytes of header lines at
+ * hdrs, the last one if it repeats; return its length, -1 if absent
+ */
+static long header_value(char *hdrs, size_t len, char *name, char **value) {
+    char *line = hdrs, *end = hdrs + len, *eol, *v;
+    size_t n = strlen(name);
+    long found = -1;
+
+    for (; line < end; line = eol + 1) {
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            eol = end;
+        if ((size_t)(eol - line) <= n || strncasecmp(line, name, n) || line[n] != ':')
+            continue;
+        for (v = line + n + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+            ;
+        *value = v;
+        for (found = eol - v; found > 0 && isspace((unsigned char)v[found - 1]); found--)
+            ;
+    }
+    return found;
+}
+
+/*
+ * does the cache key, which is only the URL, cover every field a Vary
+ * value names: the proxy sends every origin the same User-Agent, and
+ * gives each client the coding it takes of the one stored copy, plain
+ * or gzip, so a response varying on those two alone has a single
+ * stored variant. scan_fresh keeps any other coding out of the cache
+ */
+static int vary_covered(char *s, size_t len) {
+    char *end = s + len, *tok;
+    size_t n;
+
+    while (s < end) {
+        while (s < end && (isspace((unsigned char)*s) || *s == ','))
+            s++;
+        for (tok = s; s < end && *s != ',' && !isspace((unsigned char)*s); s++)
+            ;
+        if ((n = s - tok) > 0 &&
+                !(n == 15 && !strncasecmp(tok, "Accept-Encoding", 15)) &&
+                !(n == 10 && !strncasecmp(tok, "User-Agent", 10)))
+            return 0;
+    }
+    return 1;
+}
+
+/* gather the freshness headers from len bytes of header lines into h */
+static void scan_fresh(char *hdrs, size_t len, struct fresh_hdrs *h) {
+    char *line = hdrs, *end = hdrs + len, *eol, *v;
+    long n;
+
+    if ((n = header_value(hdrs, len, "Date", &v)) >= 0)
+        h->date = parse_date(v, n);
+    if ((n = header_value(hdrs, len, "Expires", &v)) >= 0 &&
+            (h->expires = parse_date(v, n)) < 0)
+        h->expires = 0;
+    if ((n = header_value(hdrs, len, "Last-Modified", &v)) >= 0)
+        h->last_modified = parse_date(v, n);
+    if ((n = header_value(hdrs, len, "Age", &v)) >= 0)
+        h->age = atol(v);
+    /* a hit can only take gzip off for a client, no other coding */
+    if ((n = header_value(hdrs, len, "Content-Encoding", &v)) >= 0 &&
+            !(n == 4 && !strncasecmp(v, "gzip", 4)) &&
+            !(n == 8 && !strncasecmp(v, "identity", 8)))
+        h->no_store = 1;
+    /* a cookie set for one client must not be handed to the next */
+    if (header_value(hdrs, len, "Set-Cookie", &v) >= 0)
+        h->no_store = 1;
+
+    /* Cache-Control and Vary may come in several lines, Pragma only counts alone */
+    for (; line < end; line = eol + 1) {
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            eol = end;
+        if (eol - line > 5 && !strncasecmp(line, "Vary:", 5) &&
+                !vary_covered(line + 5, eol - line - 5))
+            h->no_store = 1;
+        if (eol - line < 14 || strncasecmp(line, "Cache-Control:", 14))
+            continue;
+        v = line + 14;
+        n = eol - v;
+        if (contains(v, n, "no-store") || contains(v, n, "private"))
+            h->no_store = 1;
+        if (contains(v, n, "no-cache"))
+            h->no_cache = 1;
+        if (contains(v, n, "must-revalidate") || contains(v, n, "proxy-revalidate"))
+            h->must_revalidate = 1;
+        if (directive_seconds(v, n, "max-age") >= 0)
+            h->max_age = directive_seconds(v, n, "max-age");
+        if (directive_seconds(v, n, "s-maxage") >= 0)
+            h->s_maxage = directive_seconds(v, n, "s-maxage");
+        if (directive_seconds(v, n, "stale-while-revalidate") >= 0)
+            h->swr = directive_seconds(v, n, "stale-while-revalidate");
+    }
+    if (header_value(hdrs, len, "Cache-Control", &v) < 0 &&
+            (n = header_value(hdrs, len, "Pragma", &v)) >= 0 && contains(v, n, "no-cache"))
+        h->no_cache = 1;
+}
+
+static void fresh_hdrs_init(struct fresh_hdrs *h) {
+    memset(h, 0, sizeof(struct fresh_hdrs));
+    h->date = h->expires = h->last_modified = h->age = -1;
+    h->max_age = h->s_maxage = h->swr = -1;
+}
+
+/*
+ * work out from h how long a response received at now stays fresh,
+ * a shared cache's lifetime first, then max-age, Expires, and a tenth
+ * of its age since Last-Modified, and how long after that it may still
+ * be served while it is refreshed; return 0 if it must not be stored
+ */
+static int fresh_of(struct fresh_hdrs *h, long now, struct cache_fresh *fr) {
+    long age = 0, lifetime;
+
+    if (h->no_store)
+        return 0;
+    if (h->date >= 0 && h->date < now)
+        age = now - h->date;
+    if (h->age > age)
+        age = h->age;
+    fr->date = now - age;
+
+    if (h->no_cache)
+        lifetime = 0;
+    else if (h->s_maxage >= 0)
+        lifetime = h->s_maxage;
+    else if (h->max_age >= 0)
+        lifetime = h->max_age;
+    else if (h->expires >= 0)
+        lifetime = h->expires - ((h->date >= 0) ? h->date : now);
+    else if (h->last_modified >= 0 && h->last_modified <= fr->date)
+        lifetime = (fr->date - h->last_modified) / 10;
+    else
+        lifetime = FRESH_DEFAULT;
+    if (lifetime > FRESH_HEURISTIC_MAX && h->last_modified >= 0 &&
+            h->max_age < 0 && h->s_maxage < 0 && h->expires < 0)
+        lifetime = FRESH_HEURISTIC_MAX;
+    fr->expires = fr->date + ((lifetime > 0) ? lifetime : 0);
+    fr->must_revalidate = h->must_revalidate || h->no_cache;
+    fr->usable = fr->expires;
+    if (h->swr > 0 && !fr->must_revalidate)
+        fr->usable += h->swr;
+    return 1;
+}
+
+/* statuses a cache may store without explicit freshness, RFC 9110 15.1 */
+static int status_storable(int status) {
+    return status == 200 || status == 203 || status == 204 || status == 300 ||
+        status == 301 || status == 308 || status == 404 || status == 410;
+}
+
+/*
+ * may the response with these headers be cached at all; one that may
+ * not need not be buffered or followed
+ */
+int http_storable(http_response *resp) {
+    struct fresh_hdrs h;
+
+    fresh_hdrs_init(&h);
+    scan_fresh(resp->buf, resp->len, &h);
+    return status_storable(resp->status) && !h.no_store;
+}
+
+/*
+ * is the response a text the cache should keep gzip coded: one the
+ * origin did not code itself, of a type that compresses, and with room
+ * left for the headers that say so
+ */
+static int compressible(http_response *resp) {
+    char *v;
+    long n;
+
+    if ((n = header_value(resp->buf, resp->len, "Content-Encoding", &v)) >= 0 &&
+            !(n == 8 && !strncasecmp(v, "identity", 8)))
+        return 0;
+    if ((n = header_value(resp->buf, resp->len, "Content-Type", &v)) < 0)
+        return 0;
+    if (resp->len + 2 * HDR_SLACK >= sizeof(resp->buf))
+        return 0;
+    return contains(v, n, "text/") || contains(v, n, "json") ||
+        contains(v, n, "javascript") || contains(v, n, "xml");
+}
+
+/*
+ * store a complete raw origin response in the cache in the form hits
+ * are served from: the end to end headers with the body length in a
+ * Content-Length, then the blank line and the body, chunks decoded and
+ * gzip coded if it is text that shrinks. The block's hdr_len marks
+ * where a hit adds its Age and Connection headers. responses the
+ * headers say a shared cache must not keep are dropped
+ */
+void http_cache_response(char *key, char *raw, size_t len) {
+    http_response *resp;
+    struct fresh_hdrs h;
+    struct cache_fresh fr;
+    arena_t *a;
+    char *body, *buf, *gz, *v, tag[MAXLINE];
+    size_t hdrs_len, gz_len;
+    long body_len, n;
+
+    if ((body = http_body_start(raw, len)) == NULL || body - raw >= MAXBUF)
+        return;
+    hdrs_len = body - raw - 2;
+    body_len = len - (body - raw);
+
+    /* scratch from an arena of this thread, it is put back warm */
+    a = arena_get();
+    resp = arena_alloc(a, sizeof(http_response));
+    buf = arena_alloc(a, MAXBUF + len);
+    memcpy(buf, raw, hdrs_len);
+    buf[hdrs_len] = '\0';
+    if (http_parse_response(buf, resp) != HTTP_OK || !status_storable(resp->status))
+        goto out;
+    fresh_hdrs_init(&h);
+    scan_fresh(resp->buf, resp->len, &h);
+    if (!fresh_of(&h, time(NULL), &fr))
+        goto out;
+    memcpy(buf, body, body_len);
+    if (resp->chunked && (body_len = dechunk(buf, body_len)) < 0)
+        goto out;
+    if (resp->content_length >= 0 && resp->content_length != body_len)
+        goto out;
+
+    resp->len = strip_header(resp->buf, resp->len, "Transfer-Encoding");
+    resp->len = strip_header(resp->buf, resp->len, "Content-Length");
+    resp->len = strip_header(resp->buf, resp->len, "Age");
+    if (body_len >= GZIP_MIN_SIZE && compressible(resp) &&
+            (gz = gzip_compress(buf, body_len, &gz_len)) != NULL) {
+        memcpy(buf, gz, gz_len);
+        Free(gz);
+        body_len = gz_len;
+        resp->len = strip_header(resp->buf, resp->len, "Content-Encoding");
+        resp->len += sprintf(resp->buf + resp->len, "Content-Encoding: gzip\r\n");
+        if ((n = header_value(resp->buf, resp->len, "Vary", &v)) < 0 ||
+                !contains(v, n, "Accept-Encoding"))
+            resp->len += sprintf(resp->buf + resp->len, "Vary: Accept-Encoding\r\n");
+        /* the coded body is not the origin's, nor may its strong tag be */
+        if ((n = header_value(resp->buf, resp->len, "ETag", &v)) > 1 && v[n - 1] == '"') {
+            snprintf(tag, sizeof(tag), "%.*s%s", (int)n - 1, v, gzip_tag);
+            resp->len = strip_header(resp->buf, resp->len, "ETag");
+            resp->len += snprintf(resp->buf + resp->len, sizeof(resp->buf) - resp->len,
+                    "ETag: %s\r\n", tag);
+        }
+    }
+    resp->len += sprintf(resp->buf + resp->len, "Content-Length: %ld\r\n", body_len);
+    if (resp->len + 2 + body_len <= MAX_OBJECT_SIZE) {
+        memmove(buf + resp->len + 2, buf, body_len);
+        memcpy(buf, resp->buf, resp->len);
+        memcpy(buf + resp->len, "\r\n", 2);
+        insert_block(key, buf, resp->len + 2 + body_len, resp->len, &fr);
+    }
+out:
+    arena_put(a);
+}
+
+/*
+ * copy the ETag the origin gave the len bytes of stored header lines at
+ * hdrs into buf, without the suffix added when the proxy coded the
+ * body; return its length, 0 if there is none or it does not fit
+ */
+static int origin_etag(char *hdrs, size_t len, char *buf, size_t size) {
+    char *v, *coding;
+    long n, t = strlen(gzip_tag);
+    int rc;
+
+    if ((n = header_value(hdrs, len, "ETag", &v)) <= 0)
+        return 0;
+    if (header_value(hdrs, len, "Content-Encoding", &coding) == 4 &&
+            !strncasecmp(coding, "gzip", 4) && n > t && !strncmp(v + n - t, gzip_tag, t))
+        rc = snprintf(buf, size, "%.*s\"", (int)(n - t), v);
+    else
+        rc = snprintf(buf, size, "%.*s", (int)n, v);
+    return (rc < (int)size) ? rc : 0;
+}
+
+/*
+ * format the conditional headers for the validators stored with b into
+ * buf, return their length, 0 if there are none or they do not fit
+ */
+static int validators(struct cache_block *b, char *buf, size_t size) {
+    char *v, tag[MAXLINE];
+    long n;
+    int len = 0;
+
+    if (origin_etag(b->response, b->hdr_len, tag, sizeof(tag)) > 0)
+        len += snprintf(buf, size, "If-None-Match: %s\r\n", tag);
+    if ((n = header_value(b->response, b->hdr_len, "Last-Modified", &v)) > 0 &&
+            len < (int)size)
+        len += snprintf(buf + len, size - len, "If-Modified-Since: %.*s\r\n",
+                (int)n, v);
+    return (len < (int)size) ? len : 0;
+}
+
+/*
+ * add the stored validators of the stale block b to req as conditional
+ * headers, so the origin can answer 304 instead of the whole object;
+ * return 0 if b has none
+ */
+int http_add_conditional(http_request *req, struct cache_block *b) {
+    int len = validators(b, req->extra, sizeof(req->extra));
+
+    if (len == 0 || req->iovcnt == HTTP_MAX_IOV)
+        return 0;
+
+    /* in front of the blank line ending the request */
+    req->iov[req->iovcnt] = req->iov[req->iovcnt - 1];
+    req->iov[req->iovcnt - 1].iov_base = req->extra;
+    req->iov[req->iovcnt - 1].iov_len = len;
+    req->iovcnt++;
+    req->len += len;
+    return 1;
+}
+
+/*
+ * format a request revalidating b at path on host:port, with nobody
+ * waiting for it, into buf; return its length, -1 if it does not fit
+ */
+int http_refresh_request(char *buf, size_t size, char *host, char *port,
+        char *path, struct cache_block *b) {
+    int n, len;
+
+    n = snprintf(buf, size, "GET %s HTTP/1.1\r\nHost: %s:%s\r\n%s%s%s%s",
+            path[0] ? path : "/", host, port, user_agent_hdr, keep_alive_hdr,
+            accept_hdr, accept_encoding_hdr);
+    if (n < 0 || (size_t)n >= size)
+        return -1;
+    len = validators(b, buf + n, size - n);
+    n += len;
+    if ((size_t)n + 2 >= size)
+        return -1;
+    strcpy(buf + n, "\r\n");
+    return n + 2;
+}
+
+/*
+ * the origin answered a revalidation of b with 304 and the len bytes of
+ * header lines at hdrs: its headers update the stored ones, and b is
+ * fresh again for as long as they say together
+ */
+void http_revalidated(struct cache_block *b, char *hdrs, size_t len) {
+    struct fresh_hdrs h;
+    struct cache_fresh fr;
+
+    fresh_hdrs_init(&h);
+    scan_fresh(b->response, b->hdr_len, &h);
+    h.date = h.age = -1;        /* the 304 is what was just generated */
+    scan_fresh(hdrs, len, &h);
+    if (fresh_of(&h, time(NULL), &fr))
+        cache_refresh(b, &fr);
+}
+
+/*
+ * copy the strong validator among the len bytes of header lines at
+ * hdrs into buf, the ETag unless it is weak, else the Last-Modified
+ * date; return its length, 0 if there is none or it does not fit
+ */
+int http_range_validator(char *hdrs, size_t len, char *buf, size_t size) {
+    char *v;
+    long n;
+
+    if (((n = header_value(hdrs, len, "ETag", &v)) <= 0 || !strncmp(v, "W/", 2)) &&
+            (n = header_value(hdrs, len, "Last-Modified", &v)) <= 0)
+        return 0;
+    if ((size_t)n >= size)
+        return 0;
+    memcpy(buf, v, n);
+    buf[n] = '\0';
+    return n;
+}
+
+/*
+ * rewrite req into iov as a request for bytes first to last of the
+ * uncoded object, if it still has validator when validator is not
+ * empty; the new headers are formatted into extra. return the number
+ * of iovecs, 0 if they do not fit
+ */
+int http_range_request(http_request *req, struct iovec *iov, char *extra,
+        size_t size, long first, long last, char *validator) {
+    size_t n;
+
+    n = snprintf(extra, size, "Range: bytes=%ld-%ld\r\n", first, last);
+    if (validator[0] && n < size)
+        n += snprintf(extra + n, size - n, "If-Range: %s\r\n", validator);
+    if (n >= size || req->range_at < 0 || req->coding_at < 0)
+        return 0;
+    memcpy(iov, req->iov, req->iovcnt * sizeof(struct iovec));
+    iov[req->range_at].iov_base = extra;
+    iov[req->range_at].iov_len = n;
+    iov[req->coding_at].iov_base = (char *)identity_hdr;
+    iov[req->coding_at].iov_len = strlen(identity_hdr);
+    return req->iovcnt;
+}
+
+/*
+ * which bytes of the object resp carries: a 206 its Content-Range, a
+ * 200 all of them, into *first, *last and *total; and how long the
+ * object stays fresh into fr. return 1, 0 if a shared cache must not
+ * keep it, -1 if it is not one complete byte range of an object of
+ * known length
+ */
+int http_partial(http_response *resp, long *first, long *last, long *total,
+        struct cache_fresh *fr) {
+    struct fresh_hdrs h;
+    char *v, range[64];
+    long n;
+
+    if (resp->chunked || resp->content_length <= 0)
+        return -1;
+    if (resp->status == 200) {
+        *first = 0;
+        *last = resp->content_length - 1;
+        *total = resp->content_length;
+    } else {
+        if (resp->status != 206 ||
+                (n = header_value(resp->buf, resp->len, "Content-Range", &v)) < 0 ||
+                n >= (long)sizeof(range))
+            return -1;
+        memcpy(range, v, n);
+        range[n] = '\0';
+        if (sscanf(range, "bytes %ld-%ld/%ld", first, last, total) != 3 ||
+                *first < 0 || *last < *first || *last >= *total ||
+                resp->content_length != *last - *first + 1)
+            return -1;
+    }
+    fresh_hdrs_init(&h);
+    scan_fresh(resp->buf, resp->len, &h);
+    return fresh_of(&h, time(NULL), fr);
+}
+
+/*
+ * format the headers of a 206 carrying bytes first to last of an
+ * object of total bytes into out, from its stored origin headers hdrs
+ * past their status line, or of a 416 if first is past its end; return
+ * their length, -1 if they do not fit
+ */
+int http_partial_header(char *out, size_t size, char *hdrs, size_t len,
+        long first, long last, long total, long age, int keep_alive) {
+    char *line = memchr(hdrs, '\n', len);
+    size_t n;
+    int rc;
+
+    if (first >= total) {
+        rc = snprintf(out, size, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n%s\r\n",
+                total, keep_alive ? keep_alive_hdr : connection_hdr);
+        return (rc < (int)size) ? rc : -1;
+    }
+    line = line ? line + 1 : hdrs + len;
+    n = strlen("HTTP/1.1 206 Partial Content\r\n");
+    if (n + (hdrs + len - line) + HDR_SLACK * 2 >= size)
+        return -1;
+    memcpy(out, "HTTP/1.1 206 Partial Content\r\n", n);
+    memcpy(out + n, line, hdrs + len - line);
+    n += hdrs + len - line;
+    n = strip_header(out, n, "Content-Range");
+    n = strip_header(out, n, "Content-Length");
+    n = strip_header(out, n, "Transfer-Encoding");
+    n = strip_header(out, n, "Age");
+    rc = snprintf(out + n, size - n, "Content-Range: bytes %ld-%ld/%ld\r\n"
+            "Content-Length: %ld\r\nAge: %ld\r\n%s\r\n", first, last, total,
+            last - first + 1, (age > 0) ? age : 0,
+            keep_alive ? keep_alive_hdr : connection_hdr);
+    return (rc < (int)(size - n)) ? (int)n + rc : -1;
+}
+
+/*
+ * the gzip stored body of b decoded for a client that does not take
+ * gzip: its headers without the coding, then the Age and Connection
+ * headers and the blank line, all in conn_buf, and the decoded body in
+ * req->decoded; return the number of iovecs, 0 if it cannot be decoded
+ */
+static int decoded_hit_iov(struct cache_block *b, http_request *req,
+        struct iovec *iov, char *conn_buf, long age) {
+    char *body = b->response + b->hdr_len + 2, tag[MAXLINE];
+    size_t len, n;
+    int has_tag;
+
+    if ((req->decoded = gzip_decompress(body, b->size - b->hdr_len - 2,
+                    DECODED_MAX, &len)) == NULL)
+        return 0;
+    has_tag = origin_etag(b->response, b->hdr_len, tag, sizeof(tag)) > 0;
+    memcpy(conn_buf, b->response, b->hdr_len);
+    n = strip_header(conn_buf, b->hdr_len, "Content-Encoding");
+    n = strip_header(conn_buf, n, "Content-Length");
+    /* decoded, it is the origin's body again and takes back its tag */
+    n = strip_header(conn_buf, n, "ETag");
+    if (has_tag)
+        n += sprintf(conn_buf + n, "ETag: %s\r\n", tag);
+    n += sprintf(conn_buf + n, "Content-Length: %lu\r\nAge: %ld\r\n%s\r\n",
+            (unsigned long)len, age, req->keep_alive ? keep_alive_hdr : connection_hdr);
+    iov[0].iov_base = conn_buf;
+    iov[0].iov_len = n;
+    iov[1].iov_base = req->decoded;
+    iov[1].iov_len = len;
+    return 2;
+}
+
+/*
+ * describe a cache hit for the client in iov, with its Age and a
+ * Connection header formatted into conn_buf of MAXBUF bytes; a body
+ * stored gzip coded is decoded first if the client does not take it.
+ * return the number of iovecs, the caller frees req->decoded
+ */
+int http_hit_iov(struct cache_block *b, http_request *req, struct iovec *iov,
+        char *conn_buf) {
+    long age = time(NULL) - __atomic_load_n(&b->fresh.date, __ATOMIC_RELAXED);
+    char *v;
+    long n;
+    int cnt;
+
+    if (age < 0)
+        age = 0;
+    if (!req->accept_gzip && b->hdr_len + 2 * HDR_SLACK < MAXBUF &&
+            (n = header_value(b->response, b->hdr_len, "Content-Encoding", &v)) == 4 &&
+            !strncasecmp(v, "gzip", 4) &&
+            (cnt = decoded_hit_iov(b, req, iov, conn_buf, age)) > 0)
+        return cnt;
+
+    iov[0].iov_base = b->response;
+    iov[0].iov_len = b->hdr_len;
+    iov[1].iov_base = conn_buf;
+    iov[1].iov_len = sprintf(conn_buf, "Age: %ld\r\n%s", age,
+            req->keep_alive ? keep_alive_hdr : connection_hdr);
+    iov[2].iov_base = b->response + b->hdr_len;
+    iov[2].iov_len = b->size - b->hdr_len;
+    return 3;
+}
+
+/*
+ * http_error_response - format an error message for the client into
+ * out, return its length
+ */
+int http_error_response(char *out, size_t size, char *cause, char *errnum,
+        char *shortmsg, char *longmsg) {
+    char body[MAXBUF];
+    int n;
+
+    /* Build the HTTP response body */
+    n = snprintf(body, sizeof(body), "<html><title>Proxy Error</title>"
+            "<body bgcolor=""ffffff"">\r\n"
+            "%s: %s\r\n"
+            "<p>%s: %.512s\r\n"
+            "<hr><em>The Tiny Web server</em>\r\n",
+            errnum, shortmsg, longmsg, cause);
+
+    /* Print the HTTP response */
+    n = snprintf(out, size, "HTTP/1.0 %s %s\r\n"
+            "Content-type: text/html\r\n"
+            "Content-length: %d\r\n\r\n%s",
+            errnum, shortmsg, n, body);
+    return (n < (int)size) ? n : (int)size - 1;
+}
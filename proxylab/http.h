@@ -0,0 +1,142 @@
+/*
+ * http.h - request parsing and rewriting shared by the proxy engines
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+#include <sys/uio.h>
+#include "cache.h"
+#include "stats.h"
+#include "arena.h"
+
+#define RELAY_CHUNK 32768   /* bytes moved per read from the server */
+#define CLIENT_IDLE_TIMEOUT 15  /* seconds a client may take to send a request */
+#define HDR_SLACK 64        /* room left in http_response.buf for one more header */
+
+#define FRESH_DEFAULT 300          /* seconds fresh with no freshness headers at all */
+#define FRESH_HEURISTIC_MAX 86400  /* cap on a lifetime guessed from Last-Modified */
+
+#define DECODED_MAX (16 << 20)     /* largest body a gzip stored hit is decoded to */
+
+#define HTTP_MAX_HEADERS 64                 /* request headers accepted */
+#define HTTP_MAX_IOV (HTTP_MAX_HEADERS + 16)  /* pieces of a rewritten request */
+
+/* bytes at an offset of the buffer being parsed, which may move */
+typedef struct {
+    size_t off;
+    size_t len;
+} http_slice;
+
+struct http_header {
+    http_slice line;            /* whole line with its line break */
+    http_slice name;
+    http_slice value;           /* without surrounding blanks */
+};
+
+enum http_parse_state {
+    P_METHOD, P_URI, P_VERSION, P_REQUEST_LF, P_NAME_START, P_NAME,
+    P_VALUE_START, P_VALUE, P_LINE_LF, P_END_LF
+};
+
+/* incremental request parser, it copies nothing out of the buffer */
+typedef struct {
+    char *base;                 /* buffer of the last feed */
+    size_t pos;                 /* next byte to look at */
+    size_t tok;                 /* start of the token being read */
+    enum http_parse_state state;
+    http_slice method;
+    http_slice uri;
+    http_slice version;
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int nheaders;
+    size_t len;                 /* length of the complete request */
+} http_parser;
+
+/*
+ * client request and its rewritten form for the origin, which points
+ * into the parsed buffer and must not outlive it
+ */
+typedef struct {
+    struct iovec method;
+    struct iovec path;          /* empty for "/" */
+    char host[MAXLINE];         /* origin host */
+    char port[MAXLINE];         /* origin port, "80" by default */
+    char cache_key[MAXLINE];
+    struct iovec iov[HTTP_MAX_IOV]; /* request to send to the origin */
+    int iovcnt;
+    size_t len;
+    int http11;                 /* client speaks HTTP/1.1 */
+    int keep_alive;             /* client wants the connection kept open */
+    int no_store;               /* the response must not be cached */
+    int credentials;            /* sent Cookie or Authorization, its response is its own */
+    int no_cache;               /* a cached response must be revalidated first */
+    int conditional;            /* conditional or range request, its answer is its own */
+    char extra[MAXLINE];        /* headers the proxy adds, its own validators */
+    int ranged;                 /* asks for the single byte range below */
+    long range_first;           /* -1 for a suffix of range_last bytes */
+    long range_last;            /* -1 for a range to the end */
+    int range_at;               /* iov of the Range header */
+    int coding_at;              /* iov of the Accept-Encoding header */
+    int accept_gzip;            /* client takes gzip coded bodies */
+    char *decoded;              /* body of a gzip stored hit decoded for the client */
+    int origin_form;            /* its URI was a path alone, not a proxy request */
+    stats_timer timer;          /* when it was parsed and first answered */
+    arena_t *arena;             /* the connection's memory for this request */
+} http_request;
+
+/* origin response headers and their rewritten form for the client */
+typedef struct {
+    int status;
+    long content_length;        /* -1 when the origin sent none */
+    int chunked;                /* Transfer-Encoding: chunked */
+    int keep_alive;             /* origin keeps the connection open */
+    char buf[MAXBUF];           /* status line and end to end headers, no blank line */
+    size_t len;
+} http_response;
+
+/* a chunked body being decoded as it streams by, see http_dechunk */
+typedef struct {
+    int state;
+    long size;                  /* of the chunk whose size line is being read */
+    long left;                  /* data bytes left in the current chunk */
+} http_dechunker;
+
+/* http_parse_request results */
+#define HTTP_OK           0
+#define HTTP_BAD_REQUEST -1
+#define HTTP_NOT_IMPL    -2
+#define HTTP_MORE         1     /* http_parse_feed needs more bytes */
+
+void http_parser_init(http_parser *p);
+int http_parse_feed(http_parser *p, char *buf, size_t len);
+int http_read_request(rio_t *rp, http_parser *p);
+int http_parse_request(http_parser *p, http_request *req, int keep_alive);
+int http_read_headers(rio_t *rp, char *hdrs, size_t size);
+int http_parse_response(char *hdrs, http_response *resp);
+int http_has_body(http_response *resp);
+int http_client_framed(http_response *resp, http_request *req);
+void http_strip_chunked(http_response *resp);
+void http_dechunk_init(http_dechunker *d);
+long http_dechunk(http_dechunker *d, char *buf, size_t len);
+int http_conn_header(char *buf, int keep_alive);
+char *http_body_start(char *raw, size_t len);
+int http_storable(http_response *resp);
+void http_cache_response(char *key, char *raw, size_t len);
+int http_add_conditional(http_request *req, struct cache_block *b);
+int http_refresh_request(char *buf, size_t size, char *host, char *port,
+        char *path, struct cache_block *b);
+void http_revalidated(struct cache_block *b, char *hdrs, size_t len);
+int http_range_validator(char *hdrs, size_t len, char *buf, size_t size);
+int http_range_request(http_request *req, struct iovec *iov, char *extra,
+        size_t size, long first, long last, char *validator);
+int http_partial(http_response *resp, long *first, long *last, long *total,
+        struct cache_fresh *fr);
+int http_partial_header(char *out, size_t size, char *hdrs, size_t len,
+        long first, long last, long total, long age, int keep_alive);
+int http_hit_iov(struct cache_block *b, http_request *req, struct iovec *iov,
+        char *conn_buf);
+int http_error_response(char *out, size_t size, char *cause, char *errnum,
+        char *shortmsg, char *longmsg);
+
+#endif /* __HTTP_H__ */
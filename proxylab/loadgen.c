@@ -0,0 +1,440 @@
+/*
+ * loadgen.c - load generator and benchmark for the proxy
+ *
+ * A number of client threads each keep one connection to the proxy
+ * busy, asking for objects picked by a Zipf distribution over a fixed
+ * set, so a few objects are hot and most are rare, as on the web. By
+ * default the set is tiny's home.html, csapp.c and godzilla.jpg, most
+ * popular first; -b instead starts an origin inside loadgen that
+ * serves objects of the sizes given with -z, whatever the tiny
+ * directory holds.
+ *
+ * Each request is timed from the first byte written to the last byte
+ * read, over a kept connection with -k or a new one per request. The
+ * run ends after -n requests or -d seconds and reports requests per
+ * second, latency percentiles and the proxy's hit ratio, read off its
+ * stats page before and after the run. A run that made the proxy evict
+ * also reports how much of MAX_CACHE_SIZE the cached objects fill, and
+ * flags a cache evicting while still well under its budget.
+ */
+#include "csapp.h"
+#include <math.h>
+#include <netinet/tcp.h>
+#include "stats.h"
+#include "cache.h"
+
+#define LOADGEN_REQUESTS 10000      /* requests per run without -n or -d */
+#define LOADGEN_CLIENTS 8           /* client threads without -c */
+#define LOADGEN_OBJECTS 100         /* built-in origin objects without -m */
+#define LOADGEN_MAX_SIZE (16 << 20) /* largest built-in origin object */
+#define LOADGEN_MAX_SIZES 64        /* sizes -z takes */
+#define LOADGEN_MIN_FILL 0.8        /* fill of an evicting cache below which it is flagged */
+
+/* a client thread's share of the run */
+struct client {
+    pthread_t tid;
+    unsigned int seed;
+    long *lat;                      /* microseconds per request */
+    long nlat;
+    long cap;
+    long errors;
+    long bytes;
+};
+
+static char *proxy_host = "localhost", *proxy_port = "15214";
+static char *origin_host = "localhost", *origin_port = "15213";
+static char *tiny_paths[] = {"/home.html", "/csapp.c", "/godzilla.jpg"};
+static char **paths;                /* the objects, most popular first */
+static double *cdf;                 /* Zipf cumulative probability of paths */
+static int npaths;
+static int keep_alive = 0;
+static long budget;                 /* requests left to start, -1 in a timed run */
+static long deadline;               /* end of a timed run, microseconds */
+static sem_t budget_mutex;
+
+static long sizes[LOADGEN_MAX_SIZES];   /* built-in origin object sizes */
+static int nsizes = 0;
+static char *filler;                /* body bytes of every built-in object */
+static long origin_requests = 0;
+
+/* is there another request to make in this run */
+static int next_request() {
+    int more;
+
+    if (budget < 0)
+        return stats_now() < deadline;
+    P(&budget_mutex);
+    if ((more = (budget > 0)))
+        budget--;
+    V(&budget_mutex);
+    return more;
+}
+
+/* set up the Zipf distribution with exponent s over npaths objects */
+static void zipf_init(double s) {
+    double sum = 0;
+    int i;
+
+    cdf = Malloc(npaths * sizeof(double));
+    for (i = 0; i < npaths; i++)
+        cdf[i] = (sum += 1 / pow(i + 1, s));
+    for (i = 0; i < npaths; i++)
+        cdf[i] /= sum;
+}
+
+/* the index of a random object drawn from the Zipf distribution */
+static int zipf_pick(unsigned int *seed) {
+    double u = rand_r(seed) / ((double)RAND_MAX + 1);
+    int lo = 0, hi = npaths - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] > u)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* does the header value at v name close among its tokens */
+static int says_close(char *v) {
+    for (; *v; v++)
+        if (!strncasecmp(v, "close", 5))
+            return 1;
+    return 0;
+}
+
+/*
+ * read one response from rio: headers, then a body framed by
+ * Content-Length or by the end of the connection; return the body
+ * length, -1 on error, and set *closed if the connection cannot carry
+ * another request
+ */
+static long read_response(rio_t *rio, int *closed) {
+    char line[MAXLINE], buf[MAXBUF];
+    long len = -1, got = 0;
+    ssize_t n;
+
+    *closed = !keep_alive;
+    if (rio_readlineb(rio, line, sizeof(line)) <= 0 || strncmp(line, "HTTP/1.", 7))
+        return -1;
+    if (strncmp(line + 8, " 200", 4) && strncmp(line + 8, " 206", 4))
+        return -1;
+    if (line[7] == '0')
+        *closed = 1;
+    while ((n = rio_readlineb(rio, line, sizeof(line))) > 0 && strcmp(line, "\r\n")) {
+        if (!strncasecmp(line, "Content-Length:", 15))
+            len = atol(line + 15);
+        else if (!strncasecmp(line, "Connection:", 11) && says_close(line + 11))
+            *closed = 1;
+    }
+    if (n <= 0)
+        return -1;
+    if (len < 0)
+        *closed = 1;
+    while (len < 0 || got < len) {
+        n = sizeof(buf);
+        if (len >= 0 && len - got < n)
+            n = len - got;
+        if ((n = rio_readnb(rio, buf, n)) < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return (len >= 0 && got < len) ? -1 : got;
+}
+
+/* write one request for path to fd, -1 on failure */
+static int send_request(int fd, char *path) {
+    char buf[MAXBUF];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "GET http://%s:%s%s HTTP/1.1\r\nHost: %s:%s\r\n"
+            "Connection: %s\r\nProxy-Connection: %s\r\n\r\n", origin_host, origin_port,
+            path, origin_host, origin_port, keep_alive ? "keep-alive" : "close",
+            keep_alive ? "keep-alive" : "close");
+    return (rio_writen(fd, buf, n) == n) ? 0 : -1;
+}
+
+/* keep one connection to the proxy busy until the run is over */
+static void *client_thread(void *vargp) {
+    struct client *cl = vargp;
+    rio_t rio;
+    long start, n;
+    int fd = -1, closed;
+
+    while (next_request()) {
+        start = stats_now();
+        if (fd < 0) {
+            if ((fd = open_clientfd(proxy_host, proxy_port)) < 0) {
+                cl->errors++;
+                continue;
+            }
+            Rio_readinitb(&rio, fd);
+        }
+        if (send_request(fd, paths[zipf_pick(&cl->seed)]) < 0 ||
+                (n = read_response(&rio, &closed)) < 0) {
+            cl->errors++;
+            Close(fd);
+            fd = -1;
+            continue;
+        }
+        if (cl->nlat == cl->cap) {
+            cl->cap = cl->cap ? cl->cap * 2 : 1024;
+            cl->lat = Realloc(cl->lat, cl->cap * sizeof(long));
+        }
+        cl->lat[cl->nlat++] = stats_now() - start;
+        cl->bytes += n;
+        if (closed) {
+            Close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        Close(fd);
+    return NULL;
+}
+
+/* what a run needs off the proxy's stats page */
+struct proxy_counts {
+    long requests;
+    long hits;
+    long evictions;
+    long cached;                    /* object bytes in its memory cache */
+};
+
+/* read the proxy's counters off its stats page, return -1 if it has none */
+static int proxy_counters(struct proxy_counts *pc) {
+    char line[MAXLINE];
+    rio_t rio;
+    int fd, n = 0;
+
+    if ((fd = open_clientfd(proxy_host, proxy_port)) < 0)
+        return -1;
+    snprintf(line, sizeof(line), "GET %s HTTP/1.0\r\nHost: %s:%s\r\n\r\n",
+            STATS_PATH, proxy_host, proxy_port);
+    if (rio_writen(fd, line, strlen(line)) == strlen(line)) {
+        Rio_readinitb(&rio, fd);
+        while (rio_readlineb(&rio, line, sizeof(line)) > 0) {
+            n += sscanf(line, "requests %ld", &pc->requests) == 1;
+            n += sscanf(line, "hits %ld", &pc->hits) == 1;
+            n += sscanf(line, "evictions %ld", &pc->evictions) == 1;
+            n += sscanf(line, "cached_bytes %ld", &pc->cached) == 1;
+        }
+    }
+    Close(fd);
+    return (n == 4) ? 0 : -1;
+}
+
+/* built-in origin: answer the requests of one connection for /obj/<i> */
+static void *origin_thread(void *vargp) {
+    int fd = (int)(long)vargp, closed, i;
+    char line[MAXLINE], hdr[MAXLINE];
+    rio_t rio;
+    long size;
+    int one = 1;
+
+    Pthread_detach(pthread_self());
+    /* headers and body go out in two writes, which Nagle would hold up */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    Rio_readinitb(&rio, fd);
+    while (rio_readlineb(&rio, line, sizeof(line)) > 0) {
+        closed = (strstr(line, "HTTP/1.0") != NULL);
+        i = (sscanf(line, "GET /obj/%d", &i) == 1 && i >= 0) ? i : -1;
+        while (rio_readlineb(&rio, hdr, sizeof(hdr)) > 0 && strcmp(hdr, "\r\n"))
+            if (!strncasecmp(hdr, "Connection:", 11))
+                closed = says_close(hdr + 11);
+        __atomic_add_fetch(&origin_requests, 1, __ATOMIC_RELAXED);
+        if (i < 0) {
+            snprintf(hdr, sizeof(hdr), "HTTP/1.1 404 Not Found\r\n"
+                    "Content-Length: 0\r\nConnection: close\r\n\r\n");
+            rio_writen(fd, hdr, strlen(hdr));
+            break;
+        }
+        size = sizes[i % nsizes];
+        snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                "Content-Length: %ld\r\nCache-Control: max-age=3600\r\nConnection: %s\r\n\r\n",
+                size, closed ? "close" : "keep-alive");
+        if (rio_writen(fd, hdr, strlen(hdr)) != strlen(hdr) ||
+                rio_writen(fd, filler, size) != size || closed)
+            break;
+    }
+    Close(fd);
+    return NULL;
+}
+
+static void *origin_listener(void *vargp) {
+    int listenfd = (int)(long)vargp, fd;
+    pthread_t tid;
+
+    while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+        Pthread_create(&tid, NULL, origin_thread, (void *)(long)fd);
+    return NULL;
+}
+
+/* parse -z, a comma separated list of byte sizes with an optional k or m */
+static int parse_sizes(char *arg) {
+    char *end;
+
+    for (nsizes = 0; *arg && nsizes < LOADGEN_MAX_SIZES; arg = end + (*end == ',')) {
+        sizes[nsizes] = strtol(arg, &end, 10);
+        if (*end == 'k' || *end == 'K') {
+            sizes[nsizes] <<= 10;
+            end++;
+        } else if (*end == 'm' || *end == 'M') {
+            sizes[nsizes] <<= 20;
+            end++;
+        }
+        if (end == arg || sizes[nsizes] < 0 || sizes[nsizes] > LOADGEN_MAX_SIZE ||
+                (*end && *end != ','))
+            return -1;
+        nsizes++;
+    }
+    return (nsizes > 0 && !*arg) ? 0 : -1;
+}
+
+/* split host:port in place */
+static void split_hostport(char *arg, char **host, char **port) {
+    char *colon = strrchr(arg, ':');
+
+    if (colon == NULL) {
+        *port = arg;
+        return;
+    }
+    *colon = '\0';
+    *host = arg;
+    *port = colon + 1;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    struct client *clients;
+    long requests = LOADGEN_REQUESTS, seconds = 0, nlat, errors, bytes, i, j;
+    struct proxy_counts pc0, pc1;
+    long start, elapsed, *lat;
+    double fill;
+    int nclients = LOADGEN_CLIENTS, nobjects = LOADGEN_OBJECTS, opt, k;
+    int have_stats, usage = 0;
+    char *builtin = NULL, *path;
+    double zipf_s = 1.0;
+    pthread_t tid;
+
+    while ((opt = getopt(argc, argv, "p:o:c:n:d:ks:b:m:z:")) != -1) {
+        switch (opt) {
+        case 'p':
+            split_hostport(optarg, &proxy_host, &proxy_port);
+            break;
+        case 'o':
+            split_hostport(optarg, &origin_host, &origin_port);
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'd':
+            seconds = atol(optarg);
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 's':
+            zipf_s = atof(optarg);
+            break;
+        case 'b':
+            builtin = optarg;
+            break;
+        case 'm':
+            nobjects = atoi(optarg);
+            break;
+        case 'z':
+            if (parse_sizes(optarg) < 0)
+                usage = 1;
+            break;
+        default:
+            usage = 1;
+            break;
+        }
+    }
+    if (usage || optind != argc || nclients < 1 || requests < 1 || seconds < 0 ||
+            nobjects < 1 || zipf_s < 0) {
+        fprintf(stderr, "usage: %s [-p proxy_host:port] [-o origin_host:port] [-c clients]\n"
+                "       [-n requests | -d seconds] [-k] [-s zipf_exponent]\n"
+                "       [-b origin_port [-m objects] [-z size,...]]\n", argv[0]);
+        exit(1);
+    }
+    Signal(SIGPIPE, SIG_IGN);
+
+    if (builtin) {
+        origin_port = builtin;
+        if (nsizes == 0)
+            sizes[nsizes++] = 10 << 10;
+        filler = Malloc(LOADGEN_MAX_SIZE);
+        memset(filler, 'x', LOADGEN_MAX_SIZE);
+        npaths = nobjects;
+        paths = Malloc(npaths * sizeof(char *));
+        for (k = 0; k < npaths; k++) {
+            path = paths[k] = Malloc(32);
+            snprintf(path, 32, "/obj/%d", k);
+        }
+        Pthread_create(&tid, NULL, origin_listener, (void *)(long)Open_listenfd(builtin));
+    } else {
+        paths = tiny_paths;
+        npaths = sizeof(tiny_paths) / sizeof(tiny_paths[0]);
+    }
+    zipf_init(zipf_s);
+
+    Sem_init(&budget_mutex, 0, 1);
+    budget = seconds ? -1 : requests;
+    have_stats = (proxy_counters(&pc0) == 0);
+    clients = Calloc(nclients, sizeof(struct client));
+    start = stats_now();
+    deadline = start + seconds * 1000000;
+    for (k = 0; k < nclients; k++) {
+        clients[k].seed = start + k;
+        Pthread_create(&clients[k].tid, NULL, client_thread, &clients[k]);
+    }
+    for (k = 0; k < nclients; k++)
+        Pthread_join(clients[k].tid, NULL);
+    elapsed = stats_now() - start;
+
+    for (k = 0, nlat = errors = bytes = 0; k < nclients; k++) {
+        nlat += clients[k].nlat;
+        errors += clients[k].errors;
+        bytes += clients[k].bytes;
+    }
+    lat = Malloc((nlat + 1) * sizeof(long));
+    for (k = 0, i = 0; k < nclients; k++)
+        for (j = 0; j < clients[k].nlat; j++)
+            lat[i++] = clients[k].lat[j];
+    qsort(lat, nlat, sizeof(long), compare_long);
+
+    printf("%ld requests, %ld errors, %d clients, keep-alive %s, %d objects\n",
+            nlat, errors, nclients, keep_alive ? "on" : "off", npaths);
+    printf("%.1f requests/s, %.1f MB/s over %.2f s\n", nlat * 1e6 / elapsed,
+            bytes / (elapsed / 1e6) / (1 << 20), elapsed / 1e6);
+    if (nlat > 0)
+        printf("latency_us p50 %ld p99 %ld p999 %ld max %ld\n", lat[nlat / 2],
+                lat[nlat * 99 / 100], lat[nlat * 999 / 1000], lat[nlat - 1]);
+    /* the second stats request counts itself before it answers */
+    if (have_stats && proxy_counters(&pc1) == 0 && pc1.requests - pc0.requests > 1) {
+        printf("hit_ratio %.3f (proxy)\n", (double)(pc1.hits - pc0.hits) /
+                (pc1.requests - pc0.requests - 1));
+        if (pc1.evictions > pc0.evictions) {
+            fill = (double)pc1.cached / MAX_CACHE_SIZE;
+            printf("cache_fill %.2f of %d bytes%s\n", fill, MAX_CACHE_SIZE,
+                    (fill < LOADGEN_MIN_FILL) ? ", evicting under budget" : "");
+        }
+    }
+    if (builtin && nlat > 0)
+        printf("hit_ratio %.3f (origin saw %ld requests)\n",
+                1 - (double)origin_requests / nlat, origin_requests);
+    exit(0);
+}
@@ -0,0 +1,207 @@
+/*
+ * pool.c - self-sizing worker pool with per-thread accept
+ *
+ * The proxy listens on several SO_REUSEPORT sockets, so the kernel
+ * spreads incoming connections over them. Each listener has its own
+ * group of workers, and every idle worker waits on its group's socket
+ * and accepts for itself; there is no shared queue and no hand-off
+ * through the main thread.
+ *
+ * A group always tries to keep SPARE_WORKERS idle: the worker that
+ * takes a connection and leaves fewer spares behind starts a new one,
+ * and a manager thread adds workers while a listener's accept backlog
+ * is not empty, at most doubling the group each tick. When the running
+ * average request latency passes SLOW_REQUEST, each worker stays busy
+ * longer, so twice as many spares are kept. The handler reports every
+ * request it serves, so a keep-alive connection waiting for its next
+ * request does not count as a slow one. A surplus worker that has been
+ * idle for IDLE_TIMEOUT seconds exits, down to MIN_WORKERS per listener.
+ */
+#include "csapp.h"
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "pool.h"
+
+struct listener {
+    int fd;
+    int workers;                /* threads in this group */
+    int idle;                   /* threads waiting to accept */
+    sem_t mutex;
+};
+
+static struct listener *listeners;
+static int nlisteners;
+static int total_workers = 0;
+static pool_handler handler;
+
+static long latency_avg = 0;    /* running average request time, usec */
+static sem_t latency_mutex;
+
+static void *worker(void *vargp);
+
+/* open a non-blocking listening socket on port that shares it with others */
+static int open_reuseport_listenfd(char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    Getaddrinfo(NULL, port, &hints, &listp);
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        Close(listenfd);
+    }
+    Freeaddrinfo(listp);
+    if (!p || listen(listenfd, LISTENQ) < 0)
+        unix_error("open_reuseport_listenfd error");
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+    return listenfd;
+}
+
+/* idle workers a listener should keep given the current latency */
+static int spare_target() {
+    long avg;
+
+    P(&latency_mutex);
+    avg = latency_avg;
+    V(&latency_mutex);
+    return (avg > SLOW_REQUEST * 1000L) ? 2 * SPARE_WORKERS : SPARE_WORKERS;
+}
+
+/* fold one request's service time, in microseconds, into the running average */
+void pool_request_time(long usec) {
+    P(&latency_mutex);
+    latency_avg += (usec - latency_avg) / 8;
+    V(&latency_mutex);
+}
+
+/* start n more workers on listener l, as many as the cap allows */
+static void spawn(struct listener *l, int n) {
+    pthread_t tid;
+
+    while (n-- > 0) {
+        if (__atomic_add_fetch(&total_workers, 1, __ATOMIC_RELAXED) > MAX_WORKERS) {
+            __atomic_sub_fetch(&total_workers, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        P(&l->mutex);
+        l->workers++;
+        V(&l->mutex);
+        Pthread_create(&tid, NULL, worker, l);
+    }
+}
+
+/*
+ * wait for a connection on l; return it, or -1 if this worker has
+ * been surplus and idle for IDLE_TIMEOUT and should exit
+ */
+static int wait_accept(struct listener *l) {
+    struct pollfd pfd;
+    int connfd, rc;
+
+    pfd.fd = l->fd;
+    pfd.events = POLLIN;
+    while (1) {
+        rc = poll(&pfd, 1, IDLE_TIMEOUT * 1000);
+        if (rc == 0) {
+            P(&l->mutex);
+            if (l->workers > MIN_WORKERS && l->idle > spare_target()) {
+                l->idle--;
+                l->workers--;
+                V(&l->mutex);
+                return -1;
+            }
+            V(&l->mutex);
+            continue;
+        }
+        /* another worker may have won the race for this connection */
+        if ((connfd = accept(l->fd, NULL, NULL)) >= 0)
+            return connfd;
+    }
+}
+
+/*
+ * routine for every worker
+ */
+static void *worker(void *vargp) {
+    struct listener *l = vargp;
+    int connfd, need, one = 1;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        P(&l->mutex);
+        l->idle++;
+        V(&l->mutex);
+        if ((connfd = wait_accept(l)) < 0)
+            break;
+
+        /* keep enough spares behind so the next client is not stuck */
+        P(&l->mutex);
+        l->idle--;
+        need = spare_target() - l->idle;
+        V(&l->mutex);
+        if (need > 0)
+            spawn(l, need);
+
+        /* accepted sockets inherit O_NONBLOCK from the listener */
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) & ~O_NONBLOCK);
+        /* relayed responses go out in pieces, don't let Nagle hold them */
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        handler(connfd);
+        Close(connfd);
+    }
+    __atomic_sub_fetch(&total_workers, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* accept backlog of a listening socket, the kernel reports it in tcpi_unacked */
+static int backlog(int fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return 0;
+    return info.tcpi_unacked;
+}
+
+/*
+ * start the listeners and their workers on port, then keep adding
+ * workers wherever connections queue up; never returns
+ */
+void pool_run(char *port, int n, pool_handler fn) {
+    int i, queued;
+
+    handler = fn;
+    nlisteners = n;
+    Sem_init(&latency_mutex, 0, 1);
+    listeners = Calloc(n, sizeof(struct listener));
+    for (i = 0; i < n; i++) {
+        listeners[i].fd = open_reuseport_listenfd(port);
+        Sem_init(&listeners[i].mutex, 0, 1);
+    }
+    for (i = 0; i < n; i++)
+        spawn(&listeners[i], MIN_WORKERS);
+
+    while (1) {
+        usleep(POOL_TICK * 1000);
+        for (i = 0; i < nlisteners; i++) {
+            struct listener *l = &listeners[i];
+            if ((queued = backlog(l->fd)) > 0) {
+                P(&l->mutex);
+                queued -= l->idle;
+                if (queued > l->workers)
+                    queued = l->workers;
+                V(&l->mutex);
+                if (queued > 0)
+                    spawn(l, queued);
+            }
+        }
+    }
+}
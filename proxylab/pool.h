@@ -0,0 +1,19 @@
+/*
+ * pool.h - self-sizing worker pool with per-thread accept
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#define MIN_WORKERS    2    /* workers per listener that never exit */
+#define MAX_WORKERS    512  /* cap on workers across all listeners */
+#define SPARE_WORKERS  2    /* idle workers kept waiting per listener */
+#define IDLE_TIMEOUT   10   /* seconds before a surplus idle worker exits */
+#define SLOW_REQUEST   200  /* ms, above this average twice the spares are kept */
+#define POOL_TICK      100  /* ms between accept backlog checks */
+
+typedef void (*pool_handler)(int connfd);
+
+void pool_run(char *port, int nlisteners, pool_handler handler);
+void pool_request_time(long usec);
+
+#endif /* __POOL_H__ */
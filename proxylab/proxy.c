@@ -2,403 +2,612 @@
  *
  */
 #include <stdio.h>
+#include <poll.h>
 #include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "event.h"
+#include "uring.h"
+#include "pool.h"
+#include "upstream.h"
+#include "dns.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "flight.h"
+#include "zerocopy.h"
+#include "refresh.h"
+#include "range.h"
+#include "arena.h"
+#include "fairq.h"
+
+#define EVENT_LOOPS 4
+#define CLIENT_MAX_REQUESTS 100     /* requests served on one connection */
+#define FOLLOW_RETRY -2             /* followed flight failed, nothing sent yet */
+#define NOT_MODIFIED -3             /* the origin confirmed the stale cached copy */
+#define FOLLOW_ALONE -4             /* followed flight was not shared, nothing sent yet */
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_THREAD 5
-
-/* You won't lose style points for including these long lines in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *http_version_hdr = "HTTP/1.0\r\n";
-static const char *connection_hdr = "Connection: close\r\n";
-static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
-static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
-
-void* thread();
-void destroy();
 void do_proxy(int client_fd);
-void get_port(char* host_port, char* host, char* port);
-void read_requesthdrs(rio_t *rp);
-int parse_uri(char* uri, char* hostname, char* filename);
+int serve(http_parser *p, http_request *req, int client_fd, int last, long start);
+int serve_miss(http_request *req, int client_fd);
+int serve_hit(struct cache_block *block, http_request *req, int client_fd);
+int serve_stats(http_request *req, int client_fd, int json);
+int lead(struct flight *f, http_request *req, int client_fd);
+int follow(struct flight *f, http_request *req, int client_fd);
+int wait_readable(int fd, int timeout);
+int writev_full(int fd, struct iovec *iov, int cnt);
+int fetch(http_request *req, int client_fd, struct flight *f,
+        struct cache_block *stale);
+int transfer(http_request *req, int client_fd, struct flight *f,
+        struct cache_block *stale);
+int relay_response(http_request *req, rio_t *server_rio, int client_fd,
+        http_response *resp, int keep_alive, struct flight *f);
+int relay_spliced(rio_t *server_rio, int client_fd, long n, struct flight *f, char *buf);
+int relay_bytes(rio_t *server_rio, int client_fd, long n, struct flight *f, char *buf);
+int relay_chunked(rio_t *server_rio, int client_fd, struct flight *f, char *buf, int raw);
 void clienterror(int fd, char *cause, char *errnum,
 		 char *shortmsg, char *longmsg);
+void report_and_exit(int sig);
 
-//shared buffer data structure
-typedef struct {
-    int *buf;
-    int n;
-    int front;
-    int rear;
-    sem_t mutex;
-    sem_t slots;
-    sem_t items;
-} sbuf_t;
-sbuf_t sbuf;
-
-
-//cache block data structure
-struct cache_block{
-    char uri[MAXLINE];
-    char response[MAX_OBJECT_SIZE];
-    struct cache_block *next;
-};
-struct cache_block* head;
-struct cache_block* tail;
-int rcnt = 0;
-sem_t cache_mutex, cache_w;
-int total = 0;
-sem_t total_mutex;
-
-void sbuf_init(sbuf_t *sp, int n);
-void sbuf_deinit(sbuf_t * sp);
-void sbuf_insert(sbuf_t *sp, int item);
-int sbuf_remove(sbuf_t *sp);
-void cache_init();
-struct cache_block* find_cache(char* cache_key);
-void insert_block(char* cache_key, char* buf);
-void evict_block(char* cache_key, char* buf);
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    char *engine = "thread", *policy = "tinylfu";
+    int loops = EVENT_LOOPS;
+    int nlisteners = sysconf(_SC_NPROCESSORS_ONLN);
+    char *hosts_file = NULL, *disk_dir = NULL, *snap_file = NULL;
+    long disk_mb = DISK_DEFAULT_LIMIT;
+    int slots = FAIRQ_SLOTS;
+    double connect_s = UPSTREAM_CONNECT_TIMEOUT / 1000.0;
+    double first_byte_s = UPSTREAM_FIRST_BYTE_TIMEOUT / 1000.0;
+    double stall_s = UPSTREAM_STALL_TIMEOUT / 1000.0;
+    int hedge = 0, timeouts_ok = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:n:l:H:d:s:S:a:q:t:h")) != -1) {
+        switch (opt) {
+        case 'e':
+            engine = optarg;
+            break;
+        case 'n':
+            loops = atoi(optarg);
+            break;
+        case 'l':
+            nlisteners = atoi(optarg);
+            break;
+        case 'H':
+            hosts_file = optarg;
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 's':
+            disk_mb = atol(optarg);
+            break;
+        case 'S':
+            snap_file = optarg;
+            break;
+        case 'a':
+            policy = optarg;
+            break;
+        case 'q':
+            slots = atoi(optarg);
+            break;
+        case 't':
+            /* seconds, 0 for no limit */
+            timeouts_ok = sscanf(optarg, "%lf,%lf,%lf", &connect_s, &first_byte_s,
+                    &stall_s) == 3 && connect_s >= 0 && first_byte_s >= 0 && stall_s >= 0;
+            break;
+        case 'h':
+            hedge = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || loops < 1 || nlisteners < 1 || disk_mb < 1 || slots < 0 ||
+            !timeouts_ok ||
+            (strcmp(engine, "thread") && strcmp(engine, "epoll") && strcmp(engine, "uring")) ||
+            (strcmp(policy, "tinylfu") && strcmp(policy, "lru"))) {
+        fprintf(stderr, "usage: %s [-e thread|epoll|uring] [-n loops] [-l listeners] [-H hosts]\n"
+                "       [-a tinylfu|lru] [-d cache_dir [-s megabytes]] [-S snapshot]\n"
+                "       [-q transfers] [-t connect,first_byte,idle] [-h] <port>\n",
+                argv[0]);
         exit(1);
     }
-    sbuf_init(&sbuf, MAX_THREAD);
+    stats_init();
+    arena_init();
     cache_init();
+    cache_admission(!strcmp(policy, "tinylfu"));
+    /* before any other thread, they leave the dump signals to its thread */
+    if (snap_file && snapshot_init(snap_file) < 0)
+        fprintf(stderr, "cannot restore the cache from %s, starting empty\n", snap_file);
+    if (disk_dir && disk_init(disk_dir, disk_mb) < 0)
+        fprintf(stderr, "cannot use %s for the disk cache, running without it\n", disk_dir);
+    dns_init(hosts_file);
+    upstream_init(connect_s * 1000, first_byte_s * 1000, stall_s * 1000, hedge);
+    flight_init();
+    refresh_init();
+    zerocopy_init();
+    fairq_init(slots);
     Signal(SIGPIPE, SIG_IGN);
+    Signal(SIGINT, report_and_exit);
+    Signal(SIGTERM, report_and_exit);
 
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-
-    int i = 0;
-    pthread_t tid[MAX_THREAD];
-    //thread pool of 5 threads
-    for (; i < MAX_THREAD; i ++) {
-        Pthread_create(&tid[i], NULL, thread, NULL);
+    if (!strcmp(engine, "uring") && !uring_supported()) {
+        fprintf(stderr, "io_uring is not available, using epoll instead\n");
+        engine = "epoll";
     }
-
-    listenfd = Open_listenfd(argv[1]);
-    while (1) {
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE,
-                port, MAXLINE, 0);
-        sbuf_insert(&sbuf, connfd);
-    }
-
-    destroy();
+    if (!strcmp(engine, "uring"))
+        uring_run(Open_listenfd(argv[optind]), loops);
+    else if (!strcmp(engine, "epoll"))
+        event_run(Open_listenfd(argv[optind]), loops);
+    else
+        pool_run(argv[optind], nlisteners, do_proxy);
+
+    cache_deinit();
     return 0;
 }
 
 /*
- * routine for every thread
+ * serve requests from one client connection until it asks to close,
+ * sits idle for CLIENT_IDLE_TIMEOUT seconds or has made
+ * CLIENT_MAX_REQUESTS requests; pipelined requests are already in the
+ * rio buffer and are read without waiting. each request is parsed and
+ * answered in memory from an arena, reset between pipelined requests
+ * and given back while the connection waits idle for the next one
  */
+void do_proxy(int client_fd) {
+    arena_t *arena = NULL;
+    http_parser *parser;
+    http_request *req;
+    rio_t rio;
+    long start;
+    int served, rc = 0;
 
-void* thread() {
-    Pthread_detach(pthread_self());
-    while (1) {
-        int connfd = sbuf_remove(&sbuf);
-        do_proxy(connfd);
-        Close(connfd);
+    Rio_readinitb(&rio, client_fd);
+    for (served = 0; served < CLIENT_MAX_REQUESTS && rc == 0; served++) {
+        if (rio.rio_cnt == 0) {
+            if (arena) {
+                arena_put(arena);
+                arena = NULL;
+            }
+            if (!wait_readable(client_fd, CLIENT_IDLE_TIMEOUT))
+                break;
+        }
+        if (arena)
+            arena_reset(arena);
+        else
+            arena = arena_get();
+        parser = arena_alloc(arena, sizeof(http_parser));
+        req = arena_alloc(arena, sizeof(http_request));
+        start = stats_now();
+        if (http_read_request(&rio, parser) < 0)
+            break;
+        req->arena = arena;
+        req->timer.start = 0;
+        rc = serve(parser, req, client_fd, served == CLIENT_MAX_REQUESTS - 1, start);
+        if (req->timer.start)
+            stats_since(STAGE_TOTAL, req->timer.start);
+        pool_request_time(stats_now() - start);
     }
+    if (arena)
+        arena_put(arena);
 }
 
 /*
- * do proxy job
+ * answer the request parsed by p, whose bytes started coming at start,
+ * from the cache or the origin, telling the client to close after the
+ * last one. return -1 if the connection cannot carry another request
  */
-
-void do_proxy(int client_fd) {
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE];
-    char server_host_port[MAXLINE], server_port[MAXLINE], server_host[MAXLINE];
-    char request_buf[MAXLINE];
-    char cache_key[MAXLINE];
-    int accept_encoding = 0, accept = 0, host = 0;
-    rio_t rio;
-
-    /* Read request line and headers */
-    Rio_readinitb(&rio, client_fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))
-        return;
-
-    /* parse request line */
-    sscanf(buf, "%s %s %s", method, uri, version);
-    if (strcasecmp(method, "GET")) {
+int serve(http_parser *p, http_request *req, int client_fd, int last, long start) {
+    struct cache_block *block;
+    char method[MAXLINE];
+    int rc, json;
+    long looked;
+
+    if ((rc = http_parse_request(p, req, 1)) == HTTP_NOT_IMPL) {
+        snprintf(method, sizeof(method), "%.*s", (int)req->method.iov_len,
+                (char *)req->method.iov_base);
         clienterror(client_fd, method, "501", "Not Implemented",
                 "Tiny does not implement this method");
-        return;
+        return -1;
+    } else if (rc != HTTP_OK) {
+        return -1;
     }
-    strcpy(cache_key, "");
-    strcpy(server_host_port, "");
-    strcpy(server_port, "80");
-
-    if (parse_uri(uri, server_host_port, filename) < 0)
-        return;
-    strcpy(request_buf, method);
-    strcat(request_buf, " ");
-    strcat(request_buf, filename);
-    strcat(request_buf, " ");
-    strcat(request_buf, http_version_hdr);
-    get_port(server_host_port, server_host, server_port);
-
-    /* Get header key-value pair */
-    Rio_readlineb(&rio, buf, MAXLINE);
-
-    while (strcmp(buf, "\r\n")) {
-        if (strstr(buf, "Accept-Encoding: ") != NULL) {
-            strcat(request_buf, buf);
-            accept_encoding = 1;
-        } else if (strstr(buf, "Accept: ") != NULL) {
-            strcat(request_buf, buf);
-            accept = 1;
-        } else if (strstr(buf, "Host: ") != NULL) {
-            strcat(request_buf, buf);
-            if (strlen(server_host_port) <= 1) {
-                sscanf(buf, "Host: %s", server_host_port);
-                get_port(server_host_port, server_host, server_port);
+    if (last)
+        req->keep_alive = 0;
+    stats_start(&req->timer, start);
+    stats_add(STAT_REQUESTS, 1);
+    if (req->origin_form &&
+            (json = stats_wanted(req->path.iov_base, req->path.iov_len)) != 0)
+        return serve_stats(req, client_fd, json == 2);
+
+    looked = stats_now();
+    block = cache_lookup(req->cache_key);
+    stats_since(STAGE_LOOKUP, looked);
+    if (block != NULL) {
+        if (cache_usable(block) && !req->no_cache) {
+            /* a stale but usable copy goes out now and is refreshed later */
+            if (!cache_fresh(block)) {
+                refresh_schedule(block, req);
+                stats_add(STAT_STALE_HITS, 1);
             }
-            host = 1;
-        } else {
-            strcat(request_buf, buf);
+            return (serve_hit(block, req, client_fd) > 0) ? 0 : -1;
         }
+        cache_release(block);
+    }
 
-        Rio_readlineb(&rio, buf, MAXLINE);
+    return serve_miss(req, client_fd);
+}
+
+/*
+ * answer req, which the cache cannot, through the origin; concurrent
+ * misses on a key share one origin fetch. return -1 if the connection
+ * cannot carry another request
+ */
+int serve_miss(http_request *req, int client_fd) {
+    struct flight *f;
+    char *key;
+    int rc, leader, tries;
+
+    /* a single byte range comes from cached chunks where it can */
+    if (req->ranged && !req->no_store &&
+            (rc = range_serve(req, client_fd)) != RANGE_PASS)
+        return (rc > 0) ? 0 : -1;
+
+    /* nobody else may see the response to this one, or keep it */
+    if (req->no_store || req->conditional || req->credentials) {
+        f = flight_solo(req->cache_key);
+        rc = fetch(req, client_fd, f, NULL);
+        flight_leave(f);
+        return (rc > 0) ? 0 : -1;
     }
 
-    strcat(request_buf, user_agent_hdr);
-    strcat(request_buf, connection_hdr);
-    strcat(request_buf, proxy_connection_hdr);
-    if (!accept_encoding)
-        strcat(request_buf, accept_encoding_hdr);
-    if (!accept)
-        strcat(request_buf, accept_hdr);
-    if (!host) {
-        sprintf(buf, "Host: %s\r\n", server_host_port);
-        strcat(request_buf, buf);
-        get_port(server_host_port, server_host, server_port);
+    /* followers get the leader's coding, so gzip takers fly apart from the rest */
+    key = arena_alloc(req->arena, MAXLINE + 8);
+    sprintf(key, "%s%s", req->cache_key, req->accept_gzip ? " gzip" : "");
+
+    /* a follower whose flight fails before it sent anything tries once more */
+    for (tries = 0; tries < 2; tries++) {
+        f = flight_join(key, &leader);
+        rc = leader ? lead(f, req, client_fd) : follow(f, req, client_fd);
+        flight_leave(f);
+        if (rc != FOLLOW_RETRY)
+            break;
     }
-    strcat(request_buf, "\r\n");
-    if (strcmp(server_host_port, "") == 0)
-        return;
-    strcat(cache_key, server_host_port);
-    strcat(cache_key, filename);
-
-
-    /* find if there exists cache */
-    char response[MAX_OBJECT_SIZE];
-    P(&cache_mutex);
-    rcnt ++;
-    if (rcnt == 1)
-        P(&cache_w);
-    V(&cache_mutex);
-    struct cache_block* pre_block = find_cache(cache_key);
-    if (pre_block != NULL)
-        strcpy(response, pre_block->next->response);
-    P(&cache_mutex);
-    rcnt --;
-    if (rcnt == 0)
-        V(&cache_w);
-    V(&cache_mutex);
-
-    if (pre_block == NULL) {
-        /* forward to server */
-        int forward_fd = Open_clientfd(server_host, server_port);
-        rio_t server_rio;
-        size_t num_of_bytes;
-        char server_buf[MAXLINE];
-        char total_buf[10 * MAX_OBJECT_SIZE];
-        strcpy(total_buf, "");
-        if (forward_fd == -1)
-            return;
-        Rio_readinitb(&server_rio, forward_fd);
-        Rio_writen(forward_fd, request_buf, strlen(request_buf));
-
-        /* forward to client */
-
-        while ((num_of_bytes = Rio_readlineb(&server_rio, server_buf, MAXLINE)) != 0) {
-            Rio_writen(client_fd, server_buf, num_of_bytes);
-            strcat(total_buf, server_buf);
-        }
-        Close(forward_fd);
-
-        //insert the buf into cache
-        num_of_bytes = strlen(total_buf);
-        if (num_of_bytes <= MAX_OBJECT_SIZE) {
-            if (num_of_bytes + total <= MAX_CACHE_SIZE) {
-                P(&cache_w);
-                insert_block(cache_key, total_buf);
-                V(&cache_w);
-            } else {
-                P(&cache_w);
-                evict_block(cache_key, total_buf);
-                V(&cache_w);
-            }
-            P(&total_mutex);
-            total += num_of_bytes;
-            V(&total_mutex);
-        }
-    } else {
-        Rio_writen(client_fd, response, strlen(response));
+    /* a response its leader would not share is fetched alone */
+    if (rc == FOLLOW_ALONE) {
+        f = flight_solo(req->cache_key);
+        rc = fetch(req, client_fd, f, NULL);
+        flight_leave(f);
     }
+    return (rc > 0) ? 0 : -1;
+}
+
+/* write a cache hit, return -1 on error, else whether to keep the connection */
+int serve_hit(struct cache_block *block, http_request *req, int client_fd) {
+    char *conn = arena_alloc(req->arena, MAXBUF);
+    struct iovec iov[3];
+    int rc, cnt, i;
+
+    cnt = http_hit_iov(block, req, iov, conn);
+    stats_add(STAT_HITS, 1);
+    for (i = 0; i < cnt; i++)
+        stats_add(STAT_BYTES_SAVED, iov[i].iov_len);
+    stats_first_byte(&req->timer);
+    rc = writev_full(client_fd, iov, cnt);
+    cache_release(block);
+    Free(req->decoded);
+    return (rc < 0) ? -1 : req->keep_alive;
+}
+
+/* write the stats page, as JSON or text; return as serve_hit does */
+int serve_stats(http_request *req, int client_fd, int json) {
+    char *page = arena_alloc(req->arena, STATS_PAGE_MAX + MAXLINE);
+    int n;
 
+    if ((n = stats_page(page, STATS_PAGE_MAX + MAXLINE, json, req->keep_alive)) < 0) {
+        clienterror(client_fd, "stats", "500", "Internal Server Error",
+                "The stats do not fit the page");
+        return -1;
+    }
+    stats_first_byte(&req->timer);
+    return (rio_writen(client_fd, page, n) != n) ? -1 : req->keep_alive;
 }
 
 /*
- * parse request line
+ * fetch req from the origin for the flight f, relaying to the client
+ * and to any followers, then cache the response; the cache is checked
+ * again first, a flight that just finished may have filled it. a stale
+ * copy with validators is revalidated, and if the origin still stands
+ * by it the followers retry and find it fresh
  */
-int parse_uri(char* uri, char* hostname, char* filename) {
-    char protocol[MAXLINE];
-    strcpy(filename, "/");
-    if (strstr(uri, "://") != NULL) {
-       sscanf(uri, "%[^:]://%[^/]%s", protocol, hostname, filename);
-       if (strcasecmp(protocol, "http"))
-           return -1;
-       else
-           return 0;
-    } else {
-        sscanf(uri, "%[^/]%s", hostname, filename);
-        return 0;
+int lead(struct flight *f, http_request *req, int client_fd) {
+    struct cache_block *block;
+    int rc;
+
+    if ((block = cache_peek(req->cache_key)) != NULL) {
+        if (cache_fresh(block) && !req->no_cache) {
+            flight_end(f, 0);
+            return serve_hit(block, req, client_fd);
+        }
+        if (!http_add_conditional(req, block)) {
+            cache_release(block);
+            block = NULL;
+        }
     }
+    rc = fetch(req, client_fd, f, block);
+    if (rc == NOT_MODIFIED) {
+        stats_add(STAT_REVALIDATED, 1);
+        flight_end(f, 0);
+        return serve_hit(block, req, client_fd);
+    }
+    if (block)
+        cache_release(block);
+    if (rc >= 0 && !f->dropped)
+        http_cache_response(req->cache_key, f->data, f->len);
+    flight_end(f, rc >= 0);
+    return rc;
 }
 
 /*
- * get host and port
+ * serve req from the response another request is fetching into f,
+ * with this client's own Connection header; return FOLLOW_RETRY if the
+ * flight failed before anything was sent, FOLLOW_ALONE if its response
+ * is not shared, -1 if it failed later, else whether to keep the
+ * connection
  */
-
-void get_port(char* hostport, char* host, char* port) {
-    char* pos = NULL;
-    pos = index(hostport, ':');
-    if (pos != NULL) {
-        strcpy(port, pos + 1);
-        *pos = '\0';
-    } else {
-        strcpy(port, "80");
+int follow(struct flight *f, http_request *req, int client_fd) {
+    char *hdrs = arena_alloc(req->arena, MAXBUF);
+    char *buf = arena_alloc(req->arena, RELAY_CHUNK);
+    http_response *resp = arena_alloc(req->arena, sizeof(http_response));
+    http_dechunker dc;
+    size_t hdr_len, off;
+    ssize_t n;
+    long len;
+    int keep, unchunk;
+
+    if ((hdr_len = flight_wait_headers(f)) == 0)
+        return (f->done == FLIGHT_UNSHARED) ? FOLLOW_ALONE : FOLLOW_RETRY;
+    if (hdr_len >= MAXBUF)
+        return FOLLOW_RETRY;
+    if (flight_read(f, 0, hdrs, hdr_len) != hdr_len)
+        return FOLLOW_RETRY;
+    hdrs[hdr_len] = '\0';
+    if (http_parse_response(hdrs, resp) != HTTP_OK)
+        return FOLLOW_RETRY;
+
+    keep = req->keep_alive && http_client_framed(resp, req);
+    if ((unchunk = resp->chunked && !req->http11)) {
+        http_strip_chunked(resp);
+        http_dechunk_init(&dc);
     }
-    strcpy(host, hostport);
+    n = resp->len + http_conn_header(resp->buf + resp->len, keep);
+    stats_add(STAT_MISSES, 1);
+    stats_add(STAT_COALESCED, 1);
+    stats_first_byte(&req->timer);
+    if (rio_writen(client_fd, resp->buf, n) != n)
+        return -1;
+    for (off = hdr_len + 2; (n = flight_read(f, off, buf, RELAY_CHUNK)) > 0; off += n) {
+        len = unchunk ? http_dechunk(&dc, buf, n) : n;
+        if (len < 0 || rio_writen(client_fd, buf, len) != len)
+            return -1;
+    }
+    return (n < 0) ? -1 : keep;
 }
 
-/* initialize cache list */
-void cache_init() {
-    Sem_init(&cache_mutex, 0, 1);
-    Sem_init(&cache_w, 0, 1);
-    Sem_init(&total_mutex, 0, 1);
-    head = Malloc(sizeof(struct cache_block));
-    tail = Malloc(sizeof(struct cache_block));
-    head->next = NULL;
-    tail->next = NULL;
-    tail = head;
+/* wait up to timeout seconds for fd to become readable, 0 if it did not */
+int wait_readable(int fd, int timeout) {
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, timeout * 1000) > 0;
 }
 
-/* find cache by cache_key */
-struct cache_block* find_cache(char* cache_key) {
-    struct cache_block* pre = head;
-    struct cache_block* walker = head->next;
-    while (walker != NULL) {
-        if (!strcasecmp(walker->uri, cache_key))
-            return pre;
-        pre = pre->next;
-        walker = walker->next;
+/* write every iovec, resuming after short writes; -1 on error */
+int writev_full(int fd, struct iovec *iov, int cnt) {
+    ssize_t n;
+
+    while (cnt > 0) {
+        if ((n = writev(fd, iov, cnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
-    return NULL;
+    return 0;
 }
 
-/* insert a new buf into cache */
-void insert_block(char* cache_key, char* buf) {
-    struct cache_block* new_block = Malloc(sizeof(struct cache_block*));
-    strcpy(new_block->uri, cache_key);
-    strcpy(new_block->response, buf);
-    new_block->next = NULL;
-    if (head->next == NULL) {
-        head->next = new_block;
-        tail = new_block;
-    } else {
-        tail->next = new_block;
-        tail = new_block;
-    }
+/*
+ * send req to its origin and relay the response to the client once it
+ * is given a transfer slot; only requests that reach the origin queue
+ * for one, hits and followers never do. req may revalidate the stale
+ * block, which a 304 refreshes without relaying anything. return
+ * NOT_MODIFIED then, -1 if the response did not make it through
+ * complete, else whether the client connection stays open
+ */
+int fetch(http_request *req, int client_fd, struct flight *f,
+        struct cache_block *stale) {
+    fairq_ticket ticket;
+    int rc;
+
+    fairq_enter(&ticket, client_fd);
+    rc = transfer(req, client_fd, f, stale);
+    fairq_leave(&ticket, client_fd);
+    return rc;
 }
 
-/* evict a block using LRU */
-void evict_block(char* cache_key, char* buf) {
-    struct cache_block* new_block = Malloc(sizeof(struct cache_block*));
-    strcpy(new_block->uri, cache_key);
-    strcpy(new_block->response, buf);
-    new_block->next = NULL;
-    struct cache_block* pre = head;
-    struct cache_block* walker = head->next;
-    int buf_size = strlen(buf);
-    int temp = 0;
-    while (walker != NULL) {
-        int size = strlen(walker->response);
-        pre->next = walker->next;
-        if (walker == tail)
-            tail = pre;
-        Free(walker);
-        walker = pre->next;
-        temp += size;
-        if (temp >= buf_size) {
-            tail->next = new_block;
-            tail = new_block;
-            P(&total_mutex);
-            total -= temp;
-            V(&total_mutex);
-            return;
-        }
+/* fetch, holding a transfer slot */
+int transfer(http_request *req, int client_fd, struct flight *f,
+        struct cache_block *stale) {
+    char *hdrs = arena_alloc(req->arena, MAXBUF);
+    http_response *resp = arena_alloc(req->arena, sizeof(http_response));
+    rio_t *server_rio = arena_alloc(req->arena, sizeof(rio_t));
+    int server_fd, rc, keep;
+
+    /* only GETs get here, so the request is safe to hedge */
+    if ((server_fd = upstream_request(req->host, req->port, req->iov, req->iovcnt, 1)) < 0)
+        return -1;
+    Rio_readinitb(server_rio, server_fd);
+    if (http_read_headers(server_rio, hdrs, MAXBUF) < 0 ||
+            http_parse_response(hdrs, resp) != HTTP_OK) {
+        Close(server_fd);
+        return -1;
+    }
+    if (stale != NULL && resp->status == 304) {
+        http_revalidated(stale, hdrs, strlen(hdrs));
+        if (resp->keep_alive && server_rio->rio_cnt == 0)
+            upstream_put(req->host, req->port, server_fd);
+        else
+            Close(server_fd);
+        return NOT_MODIFIED;
     }
-    return;
+    keep = req->keep_alive && http_client_framed(resp, req);
+    stats_add(STAT_MISSES, 1);
+    rc = relay_response(req, server_rio, client_fd, resp, keep, f);
+    if (rc == 0 && resp->keep_alive && server_rio->rio_cnt == 0)
+        upstream_put(req->host, req->port, server_fd);
+    else
+        Close(server_fd);
+    return (rc < 0) ? -1 : keep;
 }
 
-/* create an empty, bounded, shared FIFO buffer withn slots */
-void sbuf_init(sbuf_t *sp, int n) {
-    sp->buf = Calloc(n, sizeof(int));
-    sp->n = n;
-    sp->front  = sp->rear = 0;
-    Sem_init(&sp->mutex, 0, 1);
-    Sem_init(&sp->slots, 0, n);
-    Sem_init(&sp->items, 0, 0);
+/*
+ * relay the rewritten headers with a Connection header telling the
+ * client whether to keep the connection, then the body, framed by
+ * Content-Length, chunked encoding or the end of the connection;
+ * append the origin's headers and body to the flight f. followers get
+ * the headers once the response is known to be stored whole, and are
+ * sent off to fetch it alone if it is too large or not cacheable; a
+ * whole object too large for the cache is kept in chunks for req's
+ * later ranges of it instead. return -1 if either side fails
+ */
+int relay_response(http_request *req, rio_t *server_rio, int client_fd,
+        http_response *resp, int keep_alive, struct flight *f) {
+    char *buf = arena_alloc(req->arena, RELAY_CHUNK);
+    size_t n, hdr_len = resp->len;
+    int rc;
+
+    flight_append(f, resp->buf, resp->len);
+    flight_append(f, "\r\n", 2);
+    if (!http_storable(resp) || (resp->content_length >= 0 &&
+                hdr_len + 2 + resp->content_length > MAX_OBJECT_SIZE))
+        flight_detach(f);
+    else if (resp->content_length >= 0 || !http_has_body(resp))
+        flight_headers_done(f, hdr_len);
+    if (resp->chunked && !req->http11)
+        http_strip_chunked(resp);
+    n = resp->len + http_conn_header(resp->buf + resp->len, keep_alive);
+    stats_first_byte(&req->timer);
+    if (rio_writen(client_fd, resp->buf, n) != n)
+        return -1;
+    if (!http_has_body(resp))
+        return 0;
+    if (resp->chunked)
+        rc = relay_chunked(server_rio, client_fd, f, buf, req->http11);
+    else if (f->dropped && resp->content_length > MAX_OBJECT_SIZE &&
+            (rc = range_fill(req, server_rio, client_fd, resp)) != RANGE_PASS)
+        return rc;
+    else if (f->dropped && resp->content_length >= 0)
+        rc = relay_spliced(server_rio, client_fd, resp->content_length, f, buf);
+    else
+        rc = relay_bytes(server_rio, client_fd, resp->content_length, f, buf);
+    /* a body of unknown length is shared once it is all in and fits */
+    if (rc == 0)
+        flight_headers_done(f, hdr_len);
+    return rc;
 }
 
-/* clean up buffer sp */
-void sbuf_deinit(sbuf_t *sp) {
-    Free(sp->buf);
+/*
+ * relay n body bytes of a response nobody will cache or follow: what
+ * rio already buffered is written out, the rest is spliced from socket
+ * to socket without passing through user space
+ */
+int relay_spliced(rio_t *server_rio, int client_fd, long n, struct flight *f, char *buf) {
+    long buffered = (server_rio->rio_cnt < n) ? server_rio->rio_cnt : n;
+    int rc;
+
+    if (rio_writen(client_fd, server_rio->rio_bufptr, buffered) != buffered)
+        return -1;
+    server_rio->rio_bufptr += buffered;
+    server_rio->rio_cnt -= buffered;
+    n -= buffered;
+    if ((rc = zerocopy_relay(server_rio->rio_fd, client_fd, n)) == ZEROCOPY_UNSUPPORTED)
+        return relay_bytes(server_rio, client_fd, n, f, buf);
+    return rc;
 }
 
-/* clean up extra allocated memory */
-void destroy() {
-    sbuf_deinit(&sbuf);
-    struct cache_block* pre = head;
-    struct cache_block* walker = head->next;
-    while (walker != NULL) {
-        pre->next = walker->next;
-        Free(walker);
-        walker = pre->next;
+/*
+ * relay n body bytes, or everything up to end of file if n is
+ * negative, in RELAY_CHUNK reads through buf
+ */
+int relay_bytes(rio_t *server_rio, int client_fd, long n, struct flight *f, char *buf) {
+    ssize_t rc;
+    size_t want;
+
+    while (n != 0) {
+        want = (n < 0 || n > RELAY_CHUNK) ? RELAY_CHUNK : n;
+        if ((rc = rio_readnb(server_rio, buf, want)) <= 0)
+            return (rc == 0 && n < 0) ? 0 : -1;
+        if (rio_writen(client_fd, buf, rc) != rc)
+            return -1;
+        flight_append(f, buf, rc);
+        if (n > 0)
+            n -= rc;
     }
-    Free(head);
+    return 0;
 }
 
-/* Insert item onto the rear of shared buffer sp */
-void sbuf_insert(sbuf_t *sp, int item) {
-    P(&sp->slots);
-    P(&sp->mutex);
-    sp->buf[(++sp->rear) % (sp->n)] = item;
-    V(&sp->mutex);
-    V(&sp->items);
-}
+/*
+ * relay a chunked body, chunk size lines, data and trailers; the flight
+ * gets all of it, the client only the data unless raw
+ */
+int relay_chunked(rio_t *server_rio, int client_fd, struct flight *f, char *buf, int raw) {
+    char line[MAXLINE];
+    ssize_t n;
+    long size;
 
-/* Remove and return the first item from buffer sp */
-int sbuf_remove(sbuf_t *sp) {
-    int item;
+    while (1) {
+        if ((n = rio_readlineb(server_rio, line, MAXLINE)) <= 0)
+            return -1;
+        if (raw && rio_writen(client_fd, line, n) != n)
+            return -1;
+        flight_append(f, line, n);
+        if ((size = strtol(line, NULL, 16)) < 0)
+            return -1;
+        if (size == 0)
+            break;
+        /* chunk data plus its trailing CRLF */
+        if (raw) {
+            if (relay_bytes(server_rio, client_fd, size + 2, f, buf) < 0)
+                return -1;
+            continue;
+        }
+        if (relay_bytes(server_rio, client_fd, size, f, buf) < 0 ||
+                rio_readnb(server_rio, line, 2) != 2)
+            return -1;
+        flight_append(f, line, 2);
+    }
 
-    P(&sp->items);
-    P(&sp->mutex);
-    item = sp->buf[(++sp->front) % (sp->n)];
-    V(&sp->mutex);
-    V(&sp->slots);
-    return item;
+    /* trailers up to the final blank line */
+    do {
+        if ((n = rio_readlineb(server_rio, line, MAXLINE)) <= 0)
+            return -1;
+        if (raw && rio_writen(client_fd, line, n) != n)
+            return -1;
+        flight_append(f, line, n);
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    return 0;
 }
 
 /*
@@ -407,22 +616,23 @@ int sbuf_remove(sbuf_t *sp) {
 /* $begin clienterror */
 void clienterror(int fd, char *cause, char *errnum,
 		 char *shortmsg, char *longmsg) {
-    char buf[MAXLINE], body[MAXBUF];
-
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    char buf[MAXBUF];
+    int n = http_error_response(buf, sizeof(buf), cause, errnum, shortmsg, longmsg);
+    rio_writen(fd, buf, n);
 }
 /* $end clienterror */
+
+/* on SIGINT or SIGTERM, print the cache hit ratio and exit */
+void report_and_exit(int sig) {
+    long lookups, hits;
+
+    cache_stats(&lookups, &hits);
+    Sio_puts("cache: ");
+    Sio_putl(hits);
+    Sio_puts(" hits in ");
+    Sio_putl(lookups);
+    Sio_puts(" lookups, ");
+    Sio_putl(lookups ? hits * 100 / lookups : 0);
+    Sio_puts("%\n");
+    _exit(0);
+}
@@ -0,0 +1,375 @@
+/*
+ * range.c - byte range requests answered from cached chunks
+ *
+ * An object over MAX_OBJECT_SIZE never fits the cache whole, but the
+ * clients of large objects mostly ask for byte ranges of them anyway,
+ * resuming a download or seeking in a video. The cache keeps such an
+ * object in RANGE_CHUNK pieces: a range request is split at chunk
+ * boundaries, chunks found in the cache go out from there, and each run
+ * of missing ones is asked of the origin as one aligned range, cached
+ * and passed on.
+ *
+ * A meta block per URL holds the object's length and its origin
+ * headers. Chunks are keyed by the URL, the object's validator and
+ * their index, so a changed object never mixes with old chunks, and
+ * every run asked for carries If-Range: an origin that sends the whole
+ * object instead has no ranges or a new object, and the URL's ranges
+ * go to the origin as they are for a while.
+ */
+#include "csapp.h"
+#include "range.h"
+#include "upstream.h"
+#include "fairq.h"
+
+/* what is known of the object a range request is for */
+struct range_obj {
+    long total;                 /* its length, -1 until the origin says */
+    char validator[MAXLINE];    /* strong validator, empty if it has none */
+    char *hdrs;                 /* origin response headers, status line first */
+    size_t hdrs_len;
+    struct cache_fresh fr;
+    int cacheable;              /* chunks may be cached and looked up */
+};
+
+/* the key of the meta block of req's object, or with obj of chunk index */
+static int range_key(char *key, http_request *req, struct range_obj *obj, long index) {
+    int n;
+
+    if (obj == NULL)
+        n = snprintf(key, MAXLINE, "%s\nrange", req->cache_key);
+    else
+        n = snprintf(key, MAXLINE, "%s\n%s\n%ld", req->cache_key, obj->validator, index);
+    return (n < MAXLINE) ? 0 : -1;
+}
+
+/* remember for a while that the ranges of req's object are the origin's */
+static void store_pass(http_request *req) {
+    struct cache_fresh fr;
+    char key[MAXLINE];
+
+    fr.date = time(NULL);
+    fr.expires = fr.usable = fr.date + FRESH_DEFAULT;
+    fr.must_revalidate = 0;
+    if (range_key(key, req, NULL, -1) == 0)
+        insert_block(key, "-1\r\n", 4, 4, &fr);
+}
+
+/*
+ * fill obj from the meta block of req's object; return 1 if there is
+ * a usable one, RANGE_PASS if it says to leave ranges to the origin
+ */
+static int load_meta(http_request *req, struct range_obj *obj) {
+    struct cache_block *b;
+    char key[MAXLINE], *p;
+
+    obj->total = -1;
+    obj->validator[0] = '\0';
+    obj->hdrs = NULL;
+    obj->hdrs_len = 0;
+    obj->cacheable = 0;
+    if (range_key(key, req, NULL, -1) < 0 || (b = cache_lookup(key)) == NULL)
+        return 0;
+    if (!cache_usable(b) || (p = memchr(b->response, '\n', b->size)) == NULL) {
+        cache_release(b);
+        return 0;
+    }
+    if ((obj->total = atol(b->response)) < 0) {
+        cache_release(b);
+        return RANGE_PASS;
+    }
+    p++;
+    obj->hdrs_len = b->response + b->size - p;
+    obj->hdrs = arena_alloc(req->arena, obj->hdrs_len);
+    memcpy(obj->hdrs, p, obj->hdrs_len);
+    obj->fr.date = __atomic_load_n(&b->fresh.date, __ATOMIC_RELAXED);
+    obj->fr.expires = __atomic_load_n(&b->fresh.expires, __ATOMIC_RELAXED);
+    obj->fr.usable = __atomic_load_n(&b->fresh.usable, __ATOMIC_RELAXED);
+    obj->fr.must_revalidate = b->fresh.must_revalidate;
+    obj->cacheable = http_range_validator(obj->hdrs, obj->hdrs_len, obj->validator,
+            sizeof(obj->validator)) > 0;
+    cache_release(b);
+    return 1;
+}
+
+/*
+ * learn obj from the origin's first 206 for it, resp, and keep it in
+ * a meta block if its chunks may be cached
+ */
+static void learn(http_request *req, struct range_obj *obj, http_response *resp,
+        long total, struct cache_fresh *fr, int storable) {
+    char key[MAXLINE], *buf;
+    int n;
+
+    obj->total = total;
+    obj->fr = *fr;
+    obj->hdrs_len = resp->len;
+    obj->hdrs = arena_alloc(req->arena, resp->len);
+    memcpy(obj->hdrs, resp->buf, resp->len);
+    obj->cacheable = storable && http_range_validator(resp->buf, resp->len,
+            obj->validator, sizeof(obj->validator)) > 0;
+    if (!obj->cacheable) {
+        store_pass(req);
+        return;
+    }
+    if (range_key(key, req, NULL, -1) < 0)
+        return;
+    buf = arena_alloc(req->arena, resp->len + 32);
+    n = sprintf(buf, "%ld\r\n", total);
+    memcpy(buf + n, resp->buf, resp->len);
+    insert_block(key, buf, n + resp->len, n + resp->len, fr);
+}
+
+/* the bytes of chunk index, which is all of the object up to its end */
+static long chunk_len(struct range_obj *obj, long index) {
+    long left = obj->total - index * RANGE_CHUNK;
+    return (left < RANGE_CHUNK) ? left : RANGE_CHUNK;
+}
+
+/* find and pin chunk index of obj, NULL if it is not cached whole */
+static struct cache_block *chunk(http_request *req, struct range_obj *obj,
+        long index) {
+    struct cache_block *b;
+    char key[MAXLINE];
+
+    if (range_key(key, req, obj, index) < 0)
+        return NULL;
+    if ((b = cache_lookup(key)) != NULL &&
+            (long)b->size != chunk_len(obj, index)) {
+        cache_release(b);
+        b = NULL;
+    }
+    return b;
+}
+
+/*
+ * is chunk index of obj cached; the lookup counts, so that a chunk
+ * about to be fetched has the frequency to be admitted
+ */
+static int chunk_cached(http_request *req, struct range_obj *obj, long index) {
+    struct cache_block *b;
+
+    if (!obj->cacheable || (b = chunk(req, obj, index)) == NULL)
+        return 0;
+    cache_release(b);
+    return 1;
+}
+
+/*
+ * send the client what of chunk index, len bytes at buf, falls in
+ * *pos to last, and move *pos past it; -1 if the client went away
+ */
+static int send_slice(int fd, char *buf, long index, long len, long *pos, long last) {
+    long start = index * RANGE_CHUNK;
+    long from = *pos - start, to = last + 1 - start;
+
+    if (to > len)
+        to = len;
+    if (from < 0 || from >= to)
+        return 0;
+    if (rio_writen(fd, buf + from, to - from) != to - from)
+        return -1;
+    *pos = start + to;
+    return 0;
+}
+
+/*
+ * ask the origin for chunks i to j of obj as one range and read the
+ * headers of the answer, learning the object from it if it is new; set
+ * *end to the last byte coming and *keep to whether the connection
+ * outlives it. return 0, RANGE_PASS if the answer is of no use here,
+ * -1 if the origin could not be asked
+ */
+static int open_run(http_request *req, struct range_obj *obj, long i, long j,
+        int *fd, rio_t *rio, long *end, int *keep) {
+    char extra[MAXLINE], hdrs[MAXBUF];
+    struct iovec iov[HTTP_MAX_IOV];
+    http_response resp;
+    struct cache_fresh fr;
+    long first, total;
+    int cnt, rc;
+
+    if ((cnt = http_range_request(req, iov, extra, sizeof(extra), i * RANGE_CHUNK,
+                    (j + 1) * RANGE_CHUNK - 1, obj->validator)) == 0)
+        return RANGE_PASS;
+    if ((*fd = upstream_request(req->host, req->port, iov, cnt, 1)) < 0)
+        return -1;
+
+    Rio_readinitb(rio, *fd);
+    if (http_read_headers(rio, hdrs, sizeof(hdrs)) < 0 ||
+            http_parse_response(hdrs, &resp) != HTTP_OK) {
+        Close(*fd);
+        return -1;
+    }
+    rc = http_partial(&resp, &first, end, &total, &fr);
+    if (rc < 0 || resp.status != 206 || first != i * RANGE_CHUNK ||
+            (obj->total >= 0 && total != obj->total)) {
+        /* the whole object: no ranges here, or not the object we know */
+        if (resp.status == 200)
+            store_pass(req);
+        Close(*fd);
+        return RANGE_PASS;
+    }
+    if (obj->total < 0)
+        learn(req, obj, &resp, total, &fr, rc);
+    *keep = resp.keep_alive;
+    return 0;
+}
+
+/*
+ * read the chunks from i up to byte end of the object off the origin
+ * through buf, RANGE_CHUNK bytes, caching them, and send the client
+ * what of them falls in *pos to last; a client that goes away does
+ * not stop the chunks being cached. return -1 if the client went
+ * away, -2 if the origin did
+ */
+static int read_run(rio_t *rio, http_request *req, struct range_obj *obj, long i,
+        long end, long *pos, long last, int client_fd, char *buf) {
+    char key[MAXLINE];
+    long k, len;
+    int rc = 0;
+
+    for (k = i; k * RANGE_CHUNK <= end; k++) {
+        len = end + 1 - k * RANGE_CHUNK;
+        if (len > RANGE_CHUNK)
+            len = RANGE_CHUNK;
+        if (rio_readnb(rio, buf, len) != len) {
+            rc = -2;
+            break;
+        }
+        if (obj->cacheable && len == chunk_len(obj, k) &&
+                range_key(key, req, obj, k) == 0)
+            insert_block(key, buf, len, 0, &obj->fr);
+        if (rc == 0 && send_slice(client_fd, buf, k, len, pos, last) < 0)
+            rc = -1;
+    }
+    return rc;
+}
+
+/*
+ * send the client the headers of its answer once the object's length
+ * is known, clipping the range to it; return 1 if that was all there
+ * is to send, a 416, 0 if the body is to follow, -1 on failure
+ */
+static int start_answer(http_request *req, struct range_obj *obj, long first,
+        long *last, int client_fd) {
+    char hdrs[MAXBUF];
+    int n;
+
+    if (*last < 0 || *last >= obj->total)
+        *last = obj->total - 1;
+    if ((n = http_partial_header(hdrs, sizeof(hdrs), obj->hdrs, obj->hdrs_len, first,
+                    *last, obj->total, time(NULL) - obj->fr.date, req->keep_alive)) < 0)
+        return -1;
+    stats_first_byte(&req->timer);
+    if (rio_writen(client_fd, hdrs, n) != n)
+        return -1;
+    return first >= obj->total;
+}
+
+/*
+ * relay the body of resp, all of an object too large to cache whole,
+ * to the client, keeping it in chunks for later ranges of it; return
+ * RANGE_PASS before reading anything if it may not be kept, -1 if
+ * either side fails
+ */
+int range_fill(http_request *req, rio_t *rio, int client_fd, http_response *resp) {
+    struct range_obj obj;
+    struct cache_fresh fr;
+    long first, last, total, pos = 0;
+    int rc;
+
+    if (req->no_store || req->conditional || resp->status != 200 ||
+            http_partial(resp, &first, &last, &total, &fr) != 1 ||
+            http_range_validator(resp->buf, resp->len, obj.validator,
+                sizeof(obj.validator)) == 0)
+        return RANGE_PASS;
+    learn(req, &obj, resp, total, &fr, 1);
+    rc = read_run(rio, req, &obj, 0, last, &pos, last, client_fd,
+            arena_alloc(req->arena, RANGE_CHUNK));
+    return (rc < 0) ? -1 : 0;
+}
+
+/*
+ * answer req, which asks for a single byte range, from cached chunks
+ * and origin ranges; return RANGE_PASS if it is better sent to the
+ * origin as it is and nothing went to the client, -1 if the
+ * connection cannot carry another request, else whether to keep it
+ */
+int range_serve(http_request *req, int client_fd) {
+    struct range_obj obj;
+    struct cache_block *b;
+    long first = req->range_first, last = req->range_last, pos, start, i, j, end;
+    int fd, keep = 0, sent = 0, fetched = 0, rc = 0;
+    char *buf = NULL;
+    fairq_ticket ticket;
+    rio_t rio;
+
+    if (load_meta(req, &obj) == RANGE_PASS)
+        return RANGE_PASS;
+    if (first < 0) {
+        if (obj.total < 0) {
+            /* a suffix cannot be split into chunks before the length is known */
+            return RANGE_PASS;
+        }
+        first = (last < obj.total) ? obj.total - last : 0;
+        last = obj.total - 1;
+    }
+
+    for (pos = first; rc == 0; ) {
+        if (obj.total >= 0 && !sent) {
+            sent = 1;
+            if ((rc = start_answer(req, &obj, first, &last, client_fd)) != 0)
+                break;
+        }
+        if (sent && pos > last)
+            break;
+
+        i = pos / RANGE_CHUNK;
+        if (obj.cacheable && (b = chunk(req, &obj, i)) != NULL) {
+            start = pos;
+            rc = send_slice(client_fd, b->response, i, b->size, &pos, last);
+            stats_add(STAT_BYTES_SAVED, pos - start);
+            cache_release(b);
+            continue;
+        }
+
+        /*
+         * one origin range for this chunk and the missing ones after it;
+         * an object not known yet, perhaps only its meta block dropped
+         * out of the cache, is learned from this chunk alone
+         */
+        j = i;
+        while (obj.total >= 0 && j + 1 <= last / RANGE_CHUNK &&
+                j - i + 1 < RANGE_FETCH_MAX && !chunk_cached(req, &obj, j + 1))
+            j++;
+        /* the origin range waits its client's turn for a transfer slot */
+        fairq_enter(&ticket, client_fd);
+        if ((rc = open_run(req, &obj, i, j, &fd, &rio, &end, &keep)) < 0) {
+            fairq_leave(&ticket, client_fd);
+            break;
+        }
+        fetched = 1;
+        if (!sent) {
+            sent = 1;
+            if ((rc = start_answer(req, &obj, first, &last, client_fd)) != 0) {
+                Close(fd);
+                fairq_leave(&ticket, client_fd);
+                break;
+            }
+        }
+        if (buf == NULL)
+            buf = arena_alloc(req->arena, RANGE_CHUNK);
+        rc = read_run(&rio, req, &obj, i, end, &pos, last, client_fd, buf);
+        if (rc != -2 && keep && rio.rio_cnt == 0)
+            upstream_put(req->host, req->port, fd);
+        else
+            Close(fd);
+        fairq_leave(&ticket, client_fd);
+        if (rc < 0)
+            rc = -1;
+    }
+    if (rc == RANGE_PASS && !sent)
+        return RANGE_PASS;
+    stats_add(fetched ? STAT_MISSES : STAT_HITS, 1);
+    return (rc < 0) ? -1 : req->keep_alive;
+}
@@ -0,0 +1,16 @@
+/*
+ * range.h - byte range requests answered from cached chunks
+ */
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "http.h"
+
+#define RANGE_CHUNK 65536       /* bytes per cached piece of an object */
+#define RANGE_FETCH_MAX 16      /* chunks asked of the origin at once */
+#define RANGE_PASS -2           /* not answered here, nothing sent yet */
+
+int range_serve(http_request *req, int client_fd);
+int range_fill(http_request *req, rio_t *rio, int client_fd, http_response *resp);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,226 @@
+/*
+ * refresh.c - background refresh of stale cache entries
+ *
+ * A response stored with stale-while-revalidate may still be served for
+ * a while after it expires, as long as somebody refreshes it. The
+ * request that finds it stale sends the stored copy right away and
+ * queues the block here; a few worker threads revalidate queued blocks
+ * with the origin, so only they ever wait for it. A 304 refreshes the
+ * block in place, any other cacheable answer replaces it.
+ *
+ * The queue is bounded and a block is queued once however many requests
+ * find it stale. No origin gets more than REFRESH_PER_ORIGIN workers at
+ * a time, a slow origin only holds up its own refreshes.
+ */
+#include "csapp.h"
+#include "refresh.h"
+#include "upstream.h"
+
+struct refresh_job {
+    struct cache_block *b;      /* pinned stale block */
+    char *host;
+    char *port;
+    char *path;                 /* empty for "/" */
+};
+
+static struct refresh_job *queue[REFRESH_QUEUE];    /* oldest first */
+static int queued = 0;
+static struct refresh_job *running[REFRESH_WORKERS];
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+
+static void *refresh_thread(void *vargp);
+
+static char *copy_str(char *s, size_t len) {
+    char *p = Malloc(len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/* let the block be queued again and forget the job */
+static void job_free(struct refresh_job *job) {
+    __atomic_store_n(&job->b->refreshing, 0, __ATOMIC_RELEASE);
+    cache_release(job->b);
+    Free(job->host);
+    Free(job->port);
+    Free(job->path);
+    Free(job);
+}
+
+/* start the refresh workers */
+void refresh_init() {
+    pthread_t tid;
+    long i;
+
+    for (i = 0; i < REFRESH_WORKERS; i++)
+        Pthread_create(&tid, NULL, refresh_thread, (void *)i);
+}
+
+/*
+ * queue the stale block b, pinned by the caller, for a refresh from the
+ * origin of req unless it is queued already or the queue is full
+ */
+void refresh_schedule(struct cache_block *b, http_request *req) {
+    struct refresh_job *job;
+    int idle = 0;
+
+    if (!__atomic_compare_exchange_n(&b->refreshing, &idle, 1, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+    __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+    job = Malloc(sizeof(struct refresh_job));
+    job->b = b;
+    job->host = copy_str(req->host, strlen(req->host));
+    job->port = copy_str(req->port, strlen(req->port));
+    job->path = copy_str(req->path.iov_base, req->path.iov_len);
+
+    pthread_mutex_lock(&refresh_lock);
+    if (queued < REFRESH_QUEUE) {
+        queue[queued++] = job;
+        job = NULL;
+        pthread_cond_signal(&refresh_cond);
+    }
+    pthread_mutex_unlock(&refresh_lock);
+    if (job != NULL)
+        job_free(job);
+}
+
+/*
+ * take the oldest queued job whose origin has a worker to spare, NULL
+ * if there is none; caller holds refresh_lock
+ */
+static struct refresh_job *take() {
+    struct refresh_job *job;
+    int i, j, busy;
+
+    for (i = 0; i < queued; i++) {
+        job = queue[i];
+        for (j = busy = 0; j < REFRESH_WORKERS; j++)
+            if (running[j] && !strcasecmp(running[j]->host, job->host) &&
+                    !strcmp(running[j]->port, job->port))
+                busy++;
+        if (busy < REFRESH_PER_ORIGIN) {
+            memmove(&queue[i], &queue[i + 1], (queued - i - 1) * sizeof(job));
+            queued--;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * read n bytes, or everything up to end of file if n is negative,
+ * into ob; -1 if they are cut short or grow too large to cache
+ */
+static int read_bytes(rio_t *rp, long n, objbuf_t *ob) {
+    char buf[RELAY_CHUNK];
+    ssize_t rc;
+    size_t want;
+
+    while (n != 0) {
+        want = (n < 0 || n > RELAY_CHUNK) ? RELAY_CHUNK : n;
+        if ((rc = rio_readnb(rp, buf, want)) <= 0)
+            return (rc == 0 && n < 0) ? 0 : -1;
+        objbuf_append(ob, buf, rc);
+        if (ob->too_large)
+            return -1;
+        if (n > 0)
+            n -= rc;
+    }
+    return 0;
+}
+
+/* read the body of resp as the origin frames it into ob, -1 on failure */
+static int read_body(rio_t *rp, http_response *resp, objbuf_t *ob) {
+    char line[MAXLINE];
+    ssize_t n;
+    long size;
+
+    if (!http_has_body(resp))
+        return 0;
+    if (!resp->chunked)
+        return read_bytes(rp, resp->content_length, ob);
+    do {
+        if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0)
+            return -1;
+        objbuf_append(ob, line, n);
+        if ((size = strtol(line, NULL, 16)) < 0)
+            return -1;
+        if (size > 0 && read_bytes(rp, size + 2, ob) < 0)
+            return -1;
+    } while (size > 0);
+    do {
+        if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0)
+            return -1;
+        objbuf_append(ob, line, n);
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    return 0;
+}
+
+/*
+ * revalidate the job's block with its origin, then refresh it on a
+ * 304 or cache whatever replaced it; it is not hedged, nobody waits on it
+ */
+static void refresh(struct refresh_job *job) {
+    char req[MAXBUF], hdrs[MAXBUF];
+    http_response resp;
+    objbuf_t ob;
+    struct iovec iov;
+    rio_t rio;
+    int fd, n, ok = 1;
+
+    if ((n = http_refresh_request(req, sizeof(req), job->host, job->port,
+                    job->path, job->b)) < 0)
+        return;
+    iov.iov_base = req;
+    iov.iov_len = n;
+    if ((fd = upstream_request(job->host, job->port, &iov, 1, 0)) < 0)
+        return;
+    Rio_readinitb(&rio, fd);
+    if (http_read_headers(&rio, hdrs, sizeof(hdrs)) < 0 ||
+            http_parse_response(hdrs, &resp) != HTTP_OK) {
+        Close(fd);
+        return;
+    }
+    if (resp.status == 304) {
+        http_revalidated(job->b, hdrs, strlen(hdrs));
+        stats_add(STAT_REVALIDATED, 1);
+    } else {
+        objbuf_init(&ob);
+        objbuf_append(&ob, hdrs, strlen(hdrs));
+        objbuf_append(&ob, "\r\n", 2);
+        if ((ok = (read_body(&rio, &resp, &ob) == 0)) && http_storable(&resp))
+            http_cache_response(job->b->key, ob.data, ob.len);
+        objbuf_free(&ob);
+    }
+    if (ok && resp.keep_alive && rio.rio_cnt == 0)
+        upstream_put(job->host, job->port, fd);
+    else
+        Close(fd);
+}
+
+/* routine for a refresh worker, slot is its place in running */
+static void *refresh_thread(void *vargp) {
+    long slot = (long)vargp;
+    struct refresh_job *job;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&refresh_lock);
+        while ((job = take()) == NULL)
+            pthread_cond_wait(&refresh_cond, &refresh_lock);
+        running[slot] = job;
+        pthread_mutex_unlock(&refresh_lock);
+
+        refresh(job);
+
+        /* the origin has a worker to spare again */
+        pthread_mutex_lock(&refresh_lock);
+        running[slot] = NULL;
+        pthread_cond_broadcast(&refresh_cond);
+        pthread_mutex_unlock(&refresh_lock);
+        job_free(job);
+    }
+    return NULL;
+}
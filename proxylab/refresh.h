@@ -0,0 +1,16 @@
+/*
+ * refresh.h - background refresh of stale cache entries
+ */
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "http.h"
+
+#define REFRESH_WORKERS    4    /* refreshes running at once */
+#define REFRESH_PER_ORIGIN 2    /* of which against any one origin */
+#define REFRESH_QUEUE      64   /* refreshes waiting for a worker */
+
+void refresh_init();
+void refresh_schedule(struct cache_block *b, http_request *req);
+
+#endif /* __REFRESH_H__ */
@@ -0,0 +1,72 @@
+/*
+ * sketch.c - count-min frequency sketch for cache admission
+ *
+ * Every cache lookup adds its key's hash; the estimate for a key is the
+ * smallest of its SKETCH_DEPTH counters, which can only overcount. The
+ * counters are small and saturate at SKETCH_MAX, and every
+ * SKETCH_SAMPLE additions all of them are halved, so the sketch tracks
+ * recent popularity and an object that was hot long ago fades.
+ *
+ * Counters are read and written with relaxed atomics and no lock: an
+ * increment racing another one or an aging may be lost, which only
+ * makes an estimate a little lower.
+ */
+#include "csapp.h"
+#include "sketch.h"
+
+static unsigned char counters[SKETCH_DEPTH][SKETCH_WIDTH];
+static unsigned long additions = 0;
+
+/* odd multipliers giving each row its own hash of the key hash */
+static const unsigned long long seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full,
+    0x165667b19e3779f9ull, 0xd6e8feb86659fd93ull,
+};
+
+static unsigned int slot(int row, unsigned int hash) {
+    unsigned long long x = ((unsigned long long)hash + row) * seeds[row];
+    return (x >> 32) & (SKETCH_WIDTH - 1);
+}
+
+/* halve every counter */
+static void age() {
+    int i, j;
+
+    for (i = 0; i < SKETCH_DEPTH; i++)
+        for (j = 0; j < SKETCH_WIDTH; j++) {
+            unsigned char c = __atomic_load_n(&counters[i][j], __ATOMIC_RELAXED);
+            __atomic_store_n(&counters[i][j], c >> 1, __ATOMIC_RELAXED);
+        }
+}
+
+/* start with every count at zero */
+void sketch_init() {
+    memset(counters, 0, sizeof(counters));
+    additions = 0;
+}
+
+/* count one more access to the key with this hash */
+void sketch_add(unsigned int hash) {
+    int i;
+
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        unsigned char *c = &counters[i][slot(i, hash)];
+        unsigned char v = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (v < SKETCH_MAX)
+            __atomic_store_n(c, v + 1, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&additions, 1, __ATOMIC_RELAXED) % SKETCH_SAMPLE == 0)
+        age();
+}
+
+/* estimated recent accesses to the key with this hash */
+int sketch_estimate(unsigned int hash) {
+    int i, v, min = SKETCH_MAX;
+
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        v = __atomic_load_n(&counters[i][slot(i, hash)], __ATOMIC_RELAXED);
+        if (v < min)
+            min = v;
+    }
+    return min;
+}
@@ -0,0 +1,16 @@
+/*
+ * sketch.h - count-min frequency sketch for cache admission
+ */
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#define SKETCH_DEPTH  4                     /* rows, one hash each */
+#define SKETCH_WIDTH  8192                  /* counters per row, a power of two */
+#define SKETCH_MAX    15                    /* counters saturate here */
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)   /* additions between agings */
+
+void sketch_init();
+void sketch_add(unsigned int hash);
+int sketch_estimate(unsigned int hash);
+
+#endif /* __SKETCH_H__ */
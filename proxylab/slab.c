@@ -0,0 +1,164 @@
+/*
+ * slab.c - size class arena for cache objects
+ *
+ * Requests are rounded up to one of a geometric series of size classes
+ * (factor 1.25), so the waste per object stays under a quarter of its
+ * size. Each class carves fixed-size chunks out of SLAB_PAGE_SIZE
+ * pages; classes larger than a page get one chunk per page. A page
+ * whose chunks are all free again is handed back to malloc, so memory
+ * held by the arena tracks what the cache actually stores.
+ *
+ * The arena is not locked, its owner serializes access.
+ */
+#include "csapp.h"
+#include "slab.h"
+
+struct slab_page {
+    struct slab_class *class;
+    struct slab_page *prev;     /* partial list links */
+    struct slab_page *next;
+    void *free;                 /* free chunks in this page */
+    size_t used;                /* chunks handed out */
+    size_t nchunks;
+    size_t bytes;               /* size of this page */
+};
+
+/* every chunk starts with a pointer back to its page */
+struct slab_chunk {
+    struct slab_page *page;
+    size_t pad;
+};
+
+#define PAGE_HDR  ((sizeof(struct slab_page) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+#define CHUNK_HDR sizeof(struct slab_chunk)
+
+/* set up size classes large enough for max_size byte requests */
+void slab_init(slab_arena *a, size_t max_size) {
+    size_t size = SLAB_MIN_CHUNK;
+    int i;
+
+    memset(a, 0, sizeof(*a));
+    for (i = 0; i < SLAB_MAX_CLASSES - 1 && size < max_size + CHUNK_HDR; i++) {
+        a->class[i].size = size;
+        size = (size * 5 / 4 + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    }
+    a->class[i].size = (max_size + CHUNK_HDR + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    a->nclass = i + 1;
+}
+
+static void partial_remove(struct slab_class *c, struct slab_page *pg) {
+    if (pg->prev)
+        pg->prev->next = pg->next;
+    else
+        c->partial = pg->next;
+    if (pg->next)
+        pg->next->prev = pg->prev;
+    pg->prev = pg->next = NULL;
+}
+
+static void partial_push(struct slab_class *c, struct slab_page *pg) {
+    pg->prev = NULL;
+    pg->next = c->partial;
+    if (c->partial)
+        c->partial->prev = pg;
+    c->partial = pg;
+}
+
+/* allocate a page for class c and thread its chunks on the free list */
+static struct slab_page *new_page(slab_arena *a, struct slab_class *c) {
+    size_t n = (SLAB_PAGE_SIZE - PAGE_HDR) / c->size;
+    struct slab_page *pg;
+    char *chunk;
+    size_t i;
+
+    if (n == 0)
+        n = 1;
+    pg = Malloc(PAGE_HDR + n * c->size);
+    pg->class = c;
+    pg->prev = pg->next = NULL;
+    pg->used = 0;
+    pg->nchunks = n;
+    pg->bytes = PAGE_HDR + n * c->size;
+    pg->free = NULL;
+    chunk = (char *)pg + PAGE_HDR;
+    for (i = 0; i < n; i++, chunk += c->size) {
+        *(void **)(chunk + CHUNK_HDR) = pg->free;
+        pg->free = chunk;
+    }
+    c->pages++;
+    a->bytes += pg->bytes;
+    partial_push(c, pg);
+    return pg;
+}
+
+/* smallest class whose chunks hold size bytes, NULL if none does */
+static struct slab_class *class_of(slab_arena *a, size_t size) {
+    int i;
+    for (i = 0; i < a->nclass; i++)
+        if (a->class[i].size >= size + CHUNK_HDR)
+            return &a->class[i];
+    return NULL;
+}
+
+/* return a chunk of at least size bytes, NULL if no class is that large */
+void *slab_alloc(slab_arena *a, size_t size) {
+    struct slab_class *c = class_of(a, size);
+    struct slab_page *pg;
+    struct slab_chunk *chunk;
+
+    if (c == NULL)
+        return NULL;
+    if ((pg = c->partial) == NULL)
+        pg = new_page(a, c);
+
+    chunk = pg->free;
+    pg->free = *(void **)((char *)chunk + CHUNK_HDR);
+    if (++pg->used == pg->nchunks)
+        partial_remove(c, pg);
+    chunk->page = pg;
+    return (char *)chunk + CHUNK_HDR;
+}
+
+/* give a chunk back, releasing its page once the page is empty */
+void slab_free(slab_arena *a, void *p) {
+    struct slab_chunk *chunk = (struct slab_chunk *)((char *)p - CHUNK_HDR);
+    struct slab_page *pg = chunk->page;
+    struct slab_class *c = pg->class;
+
+    if (pg->used-- == pg->nchunks)
+        partial_push(c, pg);
+    if (pg->used == 0) {
+        partial_remove(c, pg);
+        c->pages--;
+        a->bytes -= pg->bytes;
+        Free(pg);
+        return;
+    }
+    *(void **)p = pg->free;
+    pg->free = chunk;
+}
+
+/* bytes a chunk really occupies, page share aside */
+size_t slab_chunk_size(void *p) {
+    struct slab_chunk *chunk = (struct slab_chunk *)((char *)p - CHUNK_HDR);
+    return chunk->page->class->size;
+}
+
+/* bytes a chunk for a size byte request would occupy, 0 if too large */
+size_t slab_class_size(slab_arena *a, size_t size) {
+    struct slab_class *c = class_of(a, size);
+    return c ? c->size : 0;
+}
+
+/* release the pages still on the partial lists, the owner frees its chunks first */
+void slab_deinit(slab_arena *a) {
+    int i;
+    for (i = 0; i < a->nclass; i++) {
+        struct slab_page *pg;
+        while ((pg = a->class[i].partial) != NULL) {
+            partial_remove(&a->class[i], pg);
+            Free(pg);
+        }
+    }
+    a->bytes = 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * slab.h - size class arena for cache objects
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+#define SLAB_PAGE_SIZE   32768  /* bytes carved into chunks per page */
+#define SLAB_MIN_CHUNK   64     /* smallest size class */
+#define SLAB_MAX_CLASSES 48
+#define SLAB_ALIGN       16
+
+struct slab_page;
+
+/* one size class: pages with at least one free chunk */
+struct slab_class {
+    size_t size;                /* chunk size including chunk header */
+    size_t pages;               /* pages owned by this class */
+    struct slab_page *partial;  /* pages with free chunks */
+};
+
+typedef struct {
+    int nclass;
+    size_t bytes;               /* bytes held by live pages */
+    struct slab_class class[SLAB_MAX_CLASSES];
+} slab_arena;
+
+void slab_init(slab_arena *a, size_t max_size);
+void slab_deinit(slab_arena *a);
+void *slab_alloc(slab_arena *a, size_t size);
+void slab_free(slab_arena *a, void *p);
+size_t slab_chunk_size(void *p);
+size_t slab_class_size(slab_arena *a, size_t size);
+
+#endif /* __SLAB_H__ */
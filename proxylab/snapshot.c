@@ -0,0 +1,339 @@
+/*
+ * snapshot.c - dump the memory cache to a file and restore it lazily
+ *
+ * On SIGUSR1, and on SIGINT or SIGTERM before the proxy exits, a
+ * signal thread writes every cached object, each shard's blocks from
+ * the most recently used, to the snapshot file: a header, a table of
+ * bucket heads and the records, each linked to the one before it in
+ * its bucket. It is written under a temporary name and renamed over
+ * the old one, so a snapshot on disk is always whole.
+ *
+ * On startup the snapshot is only mapped and its header checked, so
+ * the proxy is up in the same time whatever its size. A lookup that
+ * misses in memory follows its bucket in the mapping and copies the
+ * object back into the cache; that is the first time its pages are
+ * read. Each record is handed out at most once, and one the cache
+ * replaced since is never handed out, so the memory copy always wins.
+ * Objects that were never asked for are carried over into the next
+ * snapshot behind the ones in memory, as long as they fit the cache.
+ */
+#include "snapshot.h"
+#include "cache.h"
+#include "stats.h"
+
+static char *snap_path;
+static char *map = NULL;            /* the restored snapshot, read only */
+static size_t map_len;
+static struct snap_header *hdr;
+static uint32_t *heads;             /* its bucket heads */
+static unsigned char *taken;        /* per record, handed out or replaced */
+static sigset_t dump_signals;
+
+static void *signal_thread(void *vargp);
+
+/* FNV-1a over n bytes, continuing from h */
+static uint32_t fnv(uint32_t h, const char *buf, size_t n) {
+    while (n-- > 0) {
+        h ^= (unsigned char)*buf++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* bytes a record takes in the file, kept 8 byte aligned */
+static size_t rec_len(size_t key_len, size_t size) {
+    return (sizeof(struct snap_rec) + key_len + size + 7) & ~(size_t)7;
+}
+
+/* where the records start in a file of nbuckets buckets */
+static size_t recs_start(uint32_t nbuckets) {
+    return sizeof(struct snap_header) + (size_t)nbuckets * sizeof(uint32_t);
+}
+
+/* the record at off in the mapping if it is whole, else NULL */
+static struct snap_rec *rec_at(size_t off) {
+    struct snap_rec *r;
+    char *key;
+
+    if (off % 8 || off < recs_start(hdr->nbuckets) ||
+            off + sizeof(struct snap_rec) > map_len)
+        return NULL;
+    r = (struct snap_rec *)(map + off);
+    if (r->index >= hdr->nrecs || r->key_len == 0 || r->key_len > MAXLINE ||
+            r->size > MAX_OBJECT_SIZE || r->hdr_len > r->size ||
+            off + rec_len(r->key_len, r->size) > map_len)
+        return NULL;
+    key = (char *)(r + 1);
+    if (key[r->key_len - 1] != '\0')
+        return NULL;
+    return r;
+}
+
+/*
+ * the record for key in the mapping, NULL if there is none; chains
+ * only ever point back towards the start, so a damaged one ends
+ */
+static struct snap_rec *rec_find(char *key, unsigned int hash) {
+    struct snap_rec *r;
+    size_t off = heads[hash & (hdr->nbuckets - 1)];
+
+    while (off != 0 && (r = rec_at(off)) != NULL) {
+        if (r->hash == hash && !strcmp((char *)(r + 1), key))
+            return r;
+        if (r->next >= off)
+            break;
+        off = r->next;
+    }
+    return NULL;
+}
+
+/* map the snapshot at path; return -1 if there is one but it is unusable */
+static int restore(char *path) {
+    struct stat st;
+    char *m;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return (errno == ENOENT) ? 0 : -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct snap_header) ||
+            st.st_size > UINT32_MAX) {
+        close(fd);
+        return -1;
+    }
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+        return -1;
+    hdr = (struct snap_header *)m;
+    if (hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION ||
+            hdr->len != (uint64_t)st.st_size || hdr->nbuckets == 0 ||
+            (hdr->nbuckets & (hdr->nbuckets - 1)) ||
+            recs_start(hdr->nbuckets) > hdr->len) {
+        munmap(m, st.st_size);
+        return -1;
+    }
+    /* lookups touch a few scattered pages, reading ahead only wastes memory */
+    madvise(m, st.st_size, MADV_RANDOM);
+    heads = (uint32_t *)(hdr + 1);
+    taken = Calloc(hdr->nrecs ? hdr->nrecs : 1, 1);
+    map_len = st.st_size;
+    map = m;
+    return 0;
+}
+
+/*
+ * keep the cache in the snapshot at path: restore it now, and start
+ * the thread that dumps it. must be called before any other thread is
+ * started, they all have to leave the dump signals to it. return -1 if
+ * there was a snapshot that could not be used
+ */
+int snapshot_init(char *path) {
+    pthread_t tid;
+    int rc;
+
+    snap_path = path;
+    rc = restore(path);
+    sigemptyset(&dump_signals);
+    sigaddset(&dump_signals, SIGUSR1);
+    sigaddset(&dump_signals, SIGINT);
+    sigaddset(&dump_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &dump_signals, NULL);
+    Pthread_create(&tid, NULL, signal_thread, NULL);
+    return rc;
+}
+
+/* is there a restored snapshot to look objects up in */
+int snapshot_active() {
+    return map != NULL;
+}
+
+/* do the key and object of r still match the checksum written with them */
+static int rec_intact(struct snap_rec *r) {
+    return fnv(2166136261u, (char *)(r + 1), r->key_len + r->size) == r->sum;
+}
+
+/*
+ * copy the object stored under key out of the snapshot, with its size,
+ * where its headers end and its freshness, unless it was handed out
+ * before; return NULL if there is none to hand out
+ */
+char *snapshot_read(char *key, unsigned int hash, size_t *size, size_t *hdr_len,
+        struct cache_fresh *fr) {
+    struct snap_rec *r;
+    char *buf;
+
+    if ((r = rec_find(key, hash)) == NULL ||
+            __atomic_exchange_n(&taken[r->index], 1, __ATOMIC_RELAXED))
+        return NULL;
+    if (!rec_intact(r))
+        return NULL;
+    buf = Malloc(r->size);
+    memcpy(buf, (char *)(r + 1) + r->key_len, r->size);
+    *size = r->size;
+    *hdr_len = r->hdr_len;
+    fr->date = r->date;
+    fr->expires = r->expires;
+    fr->usable = r->usable;
+    fr->must_revalidate = r->must_revalidate;
+    stats_add(STAT_RESTORED, 1);
+    return buf;
+}
+
+/* forget the object stored under key, a newer one replaced it */
+void snapshot_remove(char *key, unsigned int hash) {
+    struct snap_rec *r;
+
+    if ((r = rec_find(key, hash)) != NULL)
+        __atomic_store_n(&taken[r->index], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * append one record to fd at *off, linking it into its bucket in
+ * new_heads; return -1 if it could not be written
+ */
+static int put_rec(int fd, size_t *off, uint32_t *new_heads, uint32_t nbuckets,
+        uint32_t index, unsigned int hash, char *key, char *response, size_t size,
+        size_t hdr_len, struct cache_fresh *fr) {
+    static const char pad[8];
+    struct snap_rec r;
+    struct iovec iov[4];
+    size_t key_len = strlen(key) + 1, len = rec_len(key_len, size);
+
+    if (*off + len > UINT32_MAX)
+        return -1;
+    memset(&r, 0, sizeof(r));
+    r.next = new_heads[hash & (nbuckets - 1)];
+    r.index = index;
+    r.hash = hash;
+    r.key_len = key_len;
+    r.size = size;
+    r.hdr_len = hdr_len;
+    r.sum = fnv(fnv(2166136261u, key, key_len), response, size);
+    r.must_revalidate = fr->must_revalidate;
+    r.date = fr->date;
+    r.expires = fr->expires;
+    r.usable = fr->usable;
+    iov[0].iov_base = &r;
+    iov[0].iov_len = sizeof(r);
+    iov[1].iov_base = key;
+    iov[1].iov_len = key_len;
+    iov[2].iov_base = response;
+    iov[2].iov_len = size;
+    iov[3].iov_base = (void *)pad;
+    iov[3].iov_len = len - sizeof(r) - key_len - size;
+    if (writev(fd, iov, 4) != (ssize_t)len)
+        return -1;
+    new_heads[hash & (nbuckets - 1)] = *off;
+    *off += len;
+    return 0;
+}
+
+/*
+ * write the cache to the snapshot file: the blocks in memory, then the
+ * restored objects never asked for while there is room in the cache
+ * budget; return the number of objects written, -1 on failure
+ */
+int snapshot_dump() {
+    struct cache_block **blocks, *b;
+    struct snap_header h;
+    struct snap_rec *r;
+    struct cache_fresh fr;
+    char tmp[MAXLINE], *key;
+    uint32_t *new_heads, nbuckets = 64, n = 0;
+    size_t off, at, bytes = 0;
+    long i, nblocks;
+    int fd, rc = 0;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", snap_path) >= (int)sizeof(tmp) ||
+            (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+    blocks = cache_collect(&nblocks);
+    while (nbuckets < nblocks + (map ? hdr->nrecs : 0))
+        nbuckets *= 2;
+    new_heads = Calloc(nbuckets, sizeof(uint32_t));
+    off = recs_start(nbuckets);
+    if (lseek(fd, off, SEEK_SET) < 0)
+        rc = -1;
+
+    for (i = 0; i < nblocks && rc == 0; i++) {
+        b = blocks[i];
+        fr.date = __atomic_load_n(&b->fresh.date, __ATOMIC_RELAXED);
+        fr.expires = __atomic_load_n(&b->fresh.expires, __ATOMIC_RELAXED);
+        fr.usable = __atomic_load_n(&b->fresh.usable, __ATOMIC_RELAXED);
+        fr.must_revalidate = __atomic_load_n(&b->fresh.must_revalidate, __ATOMIC_RELAXED);
+        rc = put_rec(fd, &off, new_heads, nbuckets, n++, b->hash, b->key, b->response,
+                b->size, b->hdr_len, &fr);
+        bytes += b->charge;
+    }
+    for (i = 0; i < nblocks; i++)
+        cache_release(blocks[i]);
+    Free(blocks);
+
+    /* the records of the restored snapshot are in LRU order too */
+    for (at = map ? recs_start(hdr->nbuckets) : 0;
+            map && rc == 0 && (r = rec_at(at)) != NULL;
+            at += rec_len(r->key_len, r->size)) {
+        key = (char *)(r + 1);
+        if (__atomic_load_n(&taken[r->index], __ATOMIC_RELAXED))
+            continue;
+        /* a damaged record is dropped, not given a fresh checksum */
+        if (!rec_intact(r))
+            continue;
+        if ((b = cache_peek(key)) != NULL) {
+            cache_release(b);
+            continue;
+        }
+        if (!cache_charge_fits(&bytes, key, r->size))
+            break;
+        fr.date = r->date;
+        fr.expires = r->expires;
+        fr.usable = r->usable;
+        fr.must_revalidate = r->must_revalidate;
+        rc = put_rec(fd, &off, new_heads, nbuckets, n++, r->hash, key,
+                key + r->key_len, r->size, r->hdr_len, &fr);
+    }
+
+    /* the header goes last, a file cut short before it is never used */
+    memset(&h, 0, sizeof(h));
+    h.magic = SNAP_MAGIC;
+    h.version = SNAP_VERSION;
+    h.nbuckets = nbuckets;
+    h.nrecs = n;
+    h.len = off;
+    if (rc == 0 && (pwrite(fd, new_heads, nbuckets * sizeof(uint32_t),
+                    sizeof(h)) != (ssize_t)(nbuckets * sizeof(uint32_t)) ||
+                fsync(fd) < 0 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+                fsync(fd) < 0))
+        rc = -1;
+    Free(new_heads);
+    close(fd);
+    if (rc < 0 || rename(tmp, snap_path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * routine for the signal thread: dump the cache on every SIGUSR1, and
+ * on SIGINT or SIGTERM before passing the signal on to its handler
+ */
+static void *signal_thread(void *vargp) {
+    sigset_t one;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (sigwait(&dump_signals, &sig) != 0)
+            continue;
+        if (snapshot_dump() < 0)
+            fprintf(stderr, "cannot write the cache snapshot %s\n", snap_path);
+        if (sig == SIGUSR1)
+            continue;
+        sigemptyset(&one);
+        sigaddset(&one, sig);
+        pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+        pthread_kill(pthread_self(), sig);
+    }
+    return NULL;
+}
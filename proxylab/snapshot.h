@@ -0,0 +1,47 @@
+/*
+ * snapshot.h - dump the memory cache to a file and restore it lazily
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "csapp.h"
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define SNAP_MAGIC   0x50414e53u
+#define SNAP_VERSION 1
+
+/* start of a snapshot file, the bucket heads follow, then the records */
+struct snap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nbuckets;          /* a power of two */
+    uint32_t nrecs;
+    uint64_t len;               /* of the whole file */
+};
+
+/* one object, key and response follow, most recently used first */
+struct snap_rec {
+    uint32_t next;              /* offset of the next record in the bucket, 0 ends it */
+    uint32_t index;             /* position in LRU order */
+    uint32_t hash;              /* the cache's hash of the key */
+    uint32_t key_len;           /* with its nul */
+    uint32_t size;
+    uint32_t hdr_len;
+    uint32_t sum;               /* FNV-1a of the key and the response */
+    uint32_t must_revalidate;
+    int64_t date;               /* freshness, as in struct cache_fresh */
+    int64_t expires;
+    int64_t usable;
+};
+
+struct cache_fresh;
+
+int snapshot_init(char *path);
+int snapshot_active();
+char *snapshot_read(char *key, unsigned int hash, size_t *size, size_t *hdr_len,
+        struct cache_fresh *fr);
+void snapshot_remove(char *key, unsigned int hash);
+int snapshot_dump();
+
+#endif /* __SNAPSHOT_H__ */
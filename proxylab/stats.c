@@ -0,0 +1,250 @@
+/*
+ * stats.c - request counters and latency histograms
+ *
+ * Every thread counts into a block of its own, so counting is a plain
+ * load and store with no lock and no cache line shared between
+ * threads; only a reader adds the blocks up. A thread that exits hands
+ * its block, counts and all, to the next thread that starts.
+ *
+ * Latencies go into log-linear histograms: 8 buckets for each power of
+ * two of microseconds, so any percentile read off one is within an
+ * eighth of the true value, at 2 KB per stage and thread.
+ */
+#include "csapp.h"
+#include "stats.h"
+
+struct stats_block {
+    long counters[STAT_COUNTERS];
+    long hist[STAGE_COUNT][STATS_BUCKETS];
+    long sum[STAGE_COUNT];          /* microseconds, for the mean */
+    long max[STAGE_COUNT];
+    int owned;                      /* a live thread counts into it */
+    struct stats_block *next;
+};
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "requests", "hits", "stale_hits", "revalidated", "misses", "coalesced",
+    "lookups", "lookup_hits", "evictions", "bytes_saved", "restored",
+    "queued", "hedged", "hedge_wins", "upstream_timeouts",
+    "cached_bytes"
+};
+static const char *stage_names[STAGE_COUNT] = {
+    "parse", "lookup", "connect", "first_byte", "total", "queue"
+};
+
+static struct stats_block *blocks = NULL;   /* every block ever made */
+static sem_t blocks_mutex;
+static pthread_key_t block_key;
+static __thread struct stats_block *mine = NULL;
+
+/* thread exit, leave the block to a later thread */
+static void disown(void *arg) {
+    struct stats_block *b = arg;
+    __atomic_store_n(&b->owned, 0, __ATOMIC_RELEASE);
+}
+
+void stats_init() {
+    Sem_init(&blocks_mutex, 0, 1);
+    pthread_key_create(&block_key, disown);
+}
+
+/* the calling thread's block, taken over or made on first use */
+static struct stats_block *block() {
+    struct stats_block *b;
+
+    if (mine != NULL)
+        return mine;
+    P(&blocks_mutex);
+    for (b = blocks; b != NULL; b = b->next)
+        if (!__atomic_load_n(&b->owned, __ATOMIC_ACQUIRE))
+            break;
+    if (b == NULL) {
+        b = Calloc(1, sizeof(struct stats_block));
+        b->next = blocks;
+        __atomic_store_n(&blocks, b, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&b->owned, 1, __ATOMIC_RELAXED);
+    V(&blocks_mutex);
+    pthread_setspecific(block_key, b);
+    return mine = b;
+}
+
+/* add n to a value only this thread writes, readable from any other */
+static void bump(long *v, long n) {
+    __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* the histogram bucket of usec */
+static int bucket_of(long usec) {
+    int e, i;
+
+    if (usec < 8)
+        return (usec < 0) ? 0 : usec;
+    e = 63 - __builtin_clzl(usec);
+    i = (e - 2) * 8 + ((usec >> (e - 3)) & 7);
+    return (i < STATS_BUCKETS) ? i : STATS_BUCKETS - 1;
+}
+
+/* the smallest value counted in bucket i */
+static long bucket_floor(int i) {
+    if (i < 8)
+        return i;
+    return (long)(8 + i % 8) << (i / 8 - 1);
+}
+
+/* microseconds on the monotonic clock */
+long stats_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void stats_add(enum stats_counter c, long n) {
+    bump(&block()->counters[c], n);
+}
+
+/* count one stage that took usec */
+void stats_time(enum stats_stage s, long usec) {
+    struct stats_block *b = block();
+
+    bump(&b->hist[s][bucket_of(usec)], 1);
+    bump(&b->sum[s], usec);
+    if (usec > b->max[s])
+        __atomic_store_n(&b->max[s], usec, __ATOMIC_RELAXED);
+}
+
+/* count one stage that started at start and ends now */
+void stats_since(enum stats_stage s, long start) {
+    stats_time(s, stats_now() - start);
+}
+
+/* a request parsed now that started at start */
+void stats_start(stats_timer *t, long start) {
+    stats_since(STAGE_PARSE, start);
+    t->start = stats_now();
+    t->first_byte = 0;
+}
+
+/* the request of t is sending its first byte, if it has not yet */
+void stats_first_byte(stats_timer *t) {
+    if (t->first_byte)
+        return;
+    t->first_byte = stats_now();
+    stats_time(STAGE_FIRST_BYTE, t->first_byte - t->start);
+}
+
+/* counter c summed over all threads */
+long stats_total(enum stats_counter c) {
+    struct stats_block *b;
+    long n = 0;
+
+    for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+        n += __atomic_load_n(&b->counters[c], __ATOMIC_RELAXED);
+    return n;
+}
+
+/*
+ * does the request path at path ask for the stats: 1 as text, 2 as
+ * JSON when its query says json, 0 if it is any other path
+ */
+int stats_wanted(char *path, size_t len) {
+    size_t n = strlen(STATS_PATH);
+
+    if (len < n || memcmp(path, STATS_PATH, n))
+        return 0;
+    if (len == n)
+        return 1;
+    if (path[n] != '?')
+        return 0;
+    return (len - n == 5 && !memcmp(path + n, "?json", 5)) ||
+        (len - n == 12 && !memcmp(path + n, "?format=json", 12)) ? 2 : 1;
+}
+
+/* a stage's histograms and sums added up over all threads */
+struct stage_sum {
+    long hist[STATS_BUCKETS];
+    long count;
+    long sum;
+    long max;
+};
+
+static void sum_stage(enum stats_stage s, struct stage_sum *t) {
+    struct stats_block *b;
+    long v;
+    int i;
+
+    memset(t, 0, sizeof(struct stage_sum));
+    for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+        for (i = 0; i < STATS_BUCKETS; i++) {
+            v = __atomic_load_n(&b->hist[s][i], __ATOMIC_RELAXED);
+            t->hist[i] += v;
+            t->count += v;
+        }
+        t->sum += __atomic_load_n(&b->sum[s], __ATOMIC_RELAXED);
+        if ((v = __atomic_load_n(&b->max[s], __ATOMIC_RELAXED)) > t->max)
+            t->max = v;
+    }
+}
+
+/* the value below which permille of the counts of t fall */
+static long percentile(struct stage_sum *t, int permille) {
+    long want = (t->count * permille + 999) / 1000, seen = 0;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS; i++)
+        if ((seen += t->hist[i]) >= want && want > 0)
+            return bucket_floor(i);
+    return 0;
+}
+
+/*
+ * format an HTTP response showing every counter and, per stage, its
+ * count, mean and percentiles in microseconds into out, as text or
+ * JSON; return its length, -1 if it does not fit
+ */
+int stats_page(char *out, size_t size, int json, int keep_alive) {
+    static const int marks[] = {500, 900, 990, 999};
+    static const char *mark_names[] = {"p50", "p90", "p99", "p999"};
+    char body[STATS_PAGE_MAX];
+    struct stage_sum t;
+    size_t n = 0;
+    int c, s, m, hdr;
+
+    n += snprintf(body + n, sizeof(body) - n, json ? "{" : "");
+    for (c = 0; c < STAT_COUNTERS && n < sizeof(body); c++)
+        n += snprintf(body + n, sizeof(body) - n, json ? "\"%s\":%ld," : "%s %ld\n",
+                counter_names[c], stats_total(c));
+    n += snprintf(body + n, sizeof(body) - n, json ? "\"stages\":{" :
+            "\nstage count mean_us p50_us p90_us p99_us p999_us max_us\n");
+    for (s = 0; s < STAGE_COUNT && n < sizeof(body); s++) {
+        sum_stage(s, &t);
+        n += snprintf(body + n, sizeof(body) - n, json ?
+                "%s\"%s\":{\"count\":%ld,\"mean_us\":%ld" : "%s%s %ld %ld",
+                (json && s > 0) ? "," : "", stage_names[s], t.count,
+                t.count ? t.sum / t.count : 0);
+        for (m = 0; m < 4 && n < sizeof(body); m++) {
+            if (json)
+                n += snprintf(body + n, sizeof(body) - n, ",\"%s_us\":%ld",
+                        mark_names[m], percentile(&t, marks[m]));
+            else
+                n += snprintf(body + n, sizeof(body) - n, " %ld", percentile(&t, marks[m]));
+        }
+        if (n < sizeof(body))
+            n += snprintf(body + n, sizeof(body) - n, json ? ",\"max_us\":%ld}" : " %ld\n",
+                    t.max);
+    }
+    if (n < sizeof(body))
+        n += snprintf(body + n, sizeof(body) - n, json ? "}}\n" : "");
+    if (n >= sizeof(body))
+        return -1;
+
+    hdr = snprintf(out, size, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+            "Cache-Control: no-store\r\nContent-Length: %lu\r\nConnection: %s\r\n\r\n",
+            json ? "application/json" : "text/plain", (unsigned long)n,
+            keep_alive ? "keep-alive" : "close");
+    if (hdr < 0 || (size_t)hdr + n > size)
+        return -1;
+    memcpy(out + hdr, body, n);
+    return hdr + n;
+}
@@ -0,0 +1,62 @@
+/*
+ * stats.h - request counters and latency histograms
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+
+#define STATS_BUCKETS 256           /* histogram buckets, 8 per power of two */
+#define STATS_PAGE_MAX 8192         /* bytes of a formatted stats response */
+#define STATS_PATH "/__proxy_stats" /* path asked of the proxy itself that shows them */
+
+/* counted events */
+enum stats_counter {
+    STAT_REQUESTS,              /* requests parsed */
+    STAT_HITS,                  /* answered from the cache */
+    STAT_STALE_HITS,            /* of which stale, refreshed in the background */
+    STAT_REVALIDATED,           /* stale copies the origin confirmed with a 304 */
+    STAT_MISSES,                /* answered from the origin */
+    STAT_COALESCED,             /* misses that followed another request's fetch */
+    STAT_LOOKUPS,               /* cache lookups, requests and chunks alike */
+    STAT_LOOKUP_HITS,
+    STAT_EVICTIONS,             /* blocks pushed out of memory */
+    STAT_BYTES_SAVED,           /* bytes sent from the cache */
+    STAT_RESTORED,              /* objects brought back from a snapshot */
+    STAT_QUEUED,                /* requests that waited for a transfer slot */
+    STAT_HEDGED,                /* requests also sent to a second origin address */
+    STAT_HEDGE_WINS,            /* of which the second address answered first */
+    STAT_UPSTREAM_TIMEOUTS,     /* origins that did not connect or answer in time */
+    STAT_CACHED_BYTES,          /* object bytes the memory cache holds now */
+    STAT_COUNTERS
+};
+
+/* timed stages of a request, in microseconds */
+enum stats_stage {
+    STAGE_PARSE,                /* accept or readable to request parsed */
+    STAGE_LOOKUP,               /* cache lookup */
+    STAGE_CONNECT,              /* new upstream connection */
+    STAGE_FIRST_BYTE,           /* request parsed to first byte sent */
+    STAGE_TOTAL,                /* request parsed to response sent */
+    STAGE_QUEUE,                /* waiting for a transfer slot */
+    STAGE_COUNT
+};
+
+/* when a request started, and whether its first byte has gone out */
+typedef struct {
+    long start;
+    long first_byte;
+} stats_timer;
+
+void stats_init();
+long stats_now();
+void stats_add(enum stats_counter c, long n);
+void stats_time(enum stats_stage s, long usec);
+void stats_since(enum stats_stage s, long start);
+void stats_start(stats_timer *t, long start);
+void stats_first_byte(stats_timer *t);
+long stats_total(enum stats_counter c);
+int stats_wanted(char *path, size_t len);
+int stats_page(char *out, size_t size, int json, int keep_alive);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,433 @@
+/*
+ * upstream.c - connections to origin servers: pooling, timeouts, hedging
+ *
+ * After a response that leaves the connection usable, the worker hands
+ * the socket back here instead of closing it. The next request to the
+ * same host:port takes the most recently parked socket, so back-to-back
+ * misses on one origin skip the DNS lookup and the TCP handshake.
+ * Sockets idle for longer than UPSTREAM_IDLE_TTL, or that the origin
+ * has already closed, are dropped when they are found. A parked socket
+ * the origin closes just as a request goes out on it is replaced by a
+ * new connection and the request sent again.
+ *
+ * No origin can hold a worker for ever: connecting to each address is
+ * bounded by the connect timeout, the response has to start within the
+ * first byte timeout of the request going out, and after that every
+ * read and write on the socket gives up once the origin stalls for the
+ * stall timeout.
+ *
+ * With hedging on, each origin keeps its last HEDGE_SAMPLES first byte
+ * times. A request to an origin with more than one address that is
+ * still unanswered after the 95th percentile of them is sent again to
+ * another address, and whichever connection answers first is used; the
+ * other is closed. At most HEDGE_BUDGET percent of an origin's requests
+ * are hedged, so a slow origin does not get twice the load.
+ */
+#include "csapp.h"
+#include <poll.h>
+#include "upstream.h"
+#include "dns.h"
+#include "stats.h"
+
+struct idle_conn {
+    int fd;
+    time_t since;               /* when it was parked */
+    struct idle_conn *next;
+};
+
+struct origin {
+    char *key;                  /* host:port, host lower case */
+    int nidle;
+    struct idle_conn *idle;     /* most recently parked first */
+    long first_byte[HEDGE_SAMPLES];     /* recent first byte times, usec */
+    int nsamples;
+    int next_sample;
+    long requests;              /* answered, for the hedge budget */
+    long hedges;
+    struct origin *next;
+};
+
+/* a connection a request went out on, or is about to */
+struct attempt {
+    int fd;                     /* -1 once given up on */
+    int connecting;             /* the request goes out once connected */
+    int reused;                 /* taken from the pool */
+};
+
+static struct origin *origins[UPSTREAM_BUCKETS];
+static sem_t upstream_mutex;
+static int connect_timeout, first_byte_timeout, stall_timeout;
+static int hedging;
+
+static unsigned int hash_origin(char *key) {
+    unsigned int h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* find the origin for host:port, creating it if asked, caller holds the mutex */
+static struct origin *find_origin(char *host, char *port, int create) {
+    char key[MAXLINE], *p = key;
+    struct origin *o, **bucket;
+
+    while (*host && p < key + MAXLINE / 2)
+        *p++ = tolower((unsigned char)*host++);
+    snprintf(p, MAXLINE - (p - key), ":%s", port);
+    bucket = &origins[hash_origin(key) & (UPSTREAM_BUCKETS - 1)];
+    for (o = *bucket; o != NULL; o = o->next)
+        if (!strcmp(o->key, key))
+            return o;
+    if (!create)
+        return NULL;
+    o = Calloc(1, sizeof(struct origin));
+    o->key = Malloc(strlen(key) + 1);
+    strcpy(o->key, key);
+    o->next = *bucket;
+    *bucket = o;
+    return o;
+}
+
+/* an idle socket is still usable if the origin has sent nothing, not even EOF */
+static int still_open(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* has the origin started a response on fd, rather than closed it */
+static int answered(int fd) {
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+/*
+ * set up with the timeouts in milliseconds, 0 for none, and whether
+ * requests may be hedged
+ */
+void upstream_init(int connect_ms, int first_byte_ms, int stall_ms, int hedge) {
+    Sem_init(&upstream_mutex, 0, 1);
+    memset(origins, 0, sizeof(origins));
+    connect_timeout = connect_ms;
+    first_byte_timeout = first_byte_ms;
+    stall_timeout = stall_ms;
+    hedging = hedge;
+}
+
+/* the timeouts in milliseconds, for engines that keep their own deadlines */
+void upstream_timeouts(int *connect_ms, int *first_byte_ms, int *stall_ms) {
+    *connect_ms = connect_timeout;
+    *first_byte_ms = first_byte_timeout;
+    *stall_ms = stall_timeout;
+}
+
+/* poll timeout for ms milliseconds, 0 meaning for ever */
+static int poll_ms(int ms) {
+    return (ms > 0) ? ms : -1;
+}
+
+/* start connecting to a, without waiting; return the socket, -1 on failure */
+static int connect_start(struct dns_addr *a) {
+    int fd;
+
+    if ((fd = socket(a->family, a->socktype, a->protocol)) < 0)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, (struct sockaddr *)&a->addr, a->addrlen) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * finish a connection connect_start began once it is writable: make it
+ * blocking again with the stall timeout on both directions; -1 if the
+ * connection failed
+ */
+static int connect_done(int fd) {
+    struct timeval tv;
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    tv.tv_sec = stall_timeout / 1000;
+    tv.tv_usec = (stall_timeout % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return 0;
+}
+
+/* connect to the first address of host:port that answers in time, -1 if none */
+static int connect_any(char *host, char *port) {
+    struct pollfd pfd;
+    dns_result res;
+    long start = stats_now();
+    int i, fd, n, timed_out = 0;
+
+    if (dns_resolve(host, port, &res) < 0)
+        return -1;
+    for (i = 0; i < res.n; i++) {
+        if ((fd = connect_start(&res.addrs[i])) < 0)
+            continue;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if ((n = poll(&pfd, 1, poll_ms(connect_timeout))) > 0 && connect_done(fd) == 0) {
+            stats_since(STAGE_CONNECT, start);
+            return fd;
+        }
+        timed_out |= (n == 0);
+        close(fd);
+    }
+    if (timed_out)
+        stats_add(STAT_UPSTREAM_TIMEOUTS, 1);
+    return -1;
+}
+
+/* are a and the address of sockaddr ss the same host */
+static int same_host(struct dns_addr *a, struct sockaddr_storage *ss) {
+    if (a->family != ss->ss_family)
+        return 0;
+    if (a->family == AF_INET)
+        return !memcmp(&((struct sockaddr_in *)&a->addr)->sin_addr,
+                &((struct sockaddr_in *)ss)->sin_addr, sizeof(struct in_addr));
+    return !memcmp(&((struct sockaddr_in6 *)&a->addr)->sin6_addr,
+            &((struct sockaddr_in6 *)ss)->sin6_addr, sizeof(struct in6_addr));
+}
+
+/*
+ * start connecting to an address of host:port other than the one fd
+ * is connected to; return the socket, -1 if the origin has no other
+ */
+static int connect_other(char *host, char *port, int fd) {
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    dns_result res;
+    int i, other;
+
+    if (getpeername(fd, (struct sockaddr *)&peer, &len) < 0 ||
+            dns_resolve(host, port, &res) < 0)
+        return -1;
+    for (i = 0; i < res.n; i++)
+        if (!same_host(&res.addrs[i], &peer) &&
+                (other = connect_start(&res.addrs[i])) >= 0)
+            return other;
+    return -1;
+}
+
+/*
+ * return a connection to host:port, a parked one when there is one,
+ * else a new one; *reused tells which, -1 if no connection could be made
+ */
+static int get_conn(char *host, char *port, int *reused) {
+    struct origin *o;
+    struct idle_conn *ic;
+    time_t now = time(NULL);
+    int fd;
+
+    P(&upstream_mutex);
+    o = find_origin(host, port, 0);
+    while (o != NULL && (ic = o->idle) != NULL) {
+        o->idle = ic->next;
+        o->nidle--;
+        V(&upstream_mutex);
+        if (now - ic->since < UPSTREAM_IDLE_TTL && still_open(ic->fd)) {
+            fd = ic->fd;
+            Free(ic);
+            *reused = 1;
+            return fd;
+        }
+        Close(ic->fd);
+        Free(ic);
+        P(&upstream_mutex);
+    }
+    V(&upstream_mutex);
+
+    *reused = 0;
+    return connect_any(host, port);
+}
+
+/* write all of iov to fd, resuming after short writes; -1 on error */
+static int send_all(int fd, struct iovec *iov, int cnt) {
+    size_t off = 0;             /* bytes of iov[0] already sent */
+    ssize_t n;
+
+    while (cnt > 0) {
+        if (off > 0)
+            n = write(fd, (char *)iov->iov_base + off, iov->iov_len - off);
+        else
+            n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (n += off; cnt > 0 && (size_t)n >= iov->iov_len; iov++, cnt--)
+            n -= iov->iov_len;
+        off = n;
+    }
+    return 0;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * how long to wait before hedging a request to host:port, in ms: the
+ * 95th percentile of its recent first byte times; -1 not to hedge it
+ */
+static int hedge_delay(char *host, char *port) {
+    long sorted[HEDGE_SAMPLES], p95;
+    struct origin *o;
+    int n;
+
+    P(&upstream_mutex);
+    o = find_origin(host, port, 1);
+    if ((n = o->nsamples) < HEDGE_WARMUP || o->hedges * 100 >= o->requests * HEDGE_BUDGET) {
+        V(&upstream_mutex);
+        return -1;
+    }
+    memcpy(sorted, o->first_byte, n * sizeof(long));
+    V(&upstream_mutex);
+    qsort(sorted, n, sizeof(long), compare_long);
+    p95 = sorted[(n * 95) / 100] / 1000;
+    return (p95 > HEDGE_MIN) ? p95 : HEDGE_MIN;
+}
+
+/* note a request to host:port answered after usec, and whether it was hedged */
+static void record(char *host, char *port, long usec, int hedged) {
+    struct origin *o;
+
+    P(&upstream_mutex);
+    o = find_origin(host, port, 1);
+    o->first_byte[o->next_sample] = usec;
+    o->next_sample = (o->next_sample + 1) % HEDGE_SAMPLES;
+    if (o->nsamples < HEDGE_SAMPLES)
+        o->nsamples++;
+    o->requests++;
+    o->hedges += hedged;
+    V(&upstream_mutex);
+}
+
+/*
+ * send the request in iov to host:port and wait for its response to
+ * start, over a pooled connection when there is one. with hedge, and
+ * hedging turned on, the request may also go to a second address of
+ * the origin if it is slow to answer; it must be safe to send twice.
+ * return the connection the response is coming on, -1 if none started
+ * in time
+ */
+int upstream_request(char *host, char *port, struct iovec *iov, int cnt, int hedge) {
+    struct attempt at[2];
+    struct pollfd pfd[2];
+    long start, now, wait, hedge_at = -1;
+    int i, n, delay, hedged = 0, winner = -1;
+
+    if ((at[0].fd = get_conn(host, port, &at[0].reused)) < 0)
+        return -1;
+    at[0].connecting = 0;
+    at[1].fd = -1;
+    start = stats_now();
+    if (hedge && hedging && (delay = hedge_delay(host, port)) >= 0)
+        hedge_at = start + delay * 1000L;
+
+    if (send_all(at[0].fd, iov, cnt) < 0) {
+        /* a parked connection may have been closed under us, once */
+        Close(at[0].fd);
+        if (!at[0].reused || (at[0].fd = connect_any(host, port)) < 0 ||
+                send_all(at[0].fd, iov, cnt) < 0)
+            return -1;
+        at[0].reused = 0;
+    }
+
+    while (winner < 0 && (at[0].fd >= 0 || at[1].fd >= 0)) {
+        now = stats_now();
+        if (first_byte_timeout > 0 && now - start >= first_byte_timeout * 1000L)
+            break;
+        if (hedge_at >= 0 && now >= hedge_at) {
+            hedge_at = -1;
+            if (at[0].fd >= 0 && (at[1].fd = connect_other(host, port, at[0].fd)) >= 0) {
+                at[1].connecting = 1;
+                at[1].reused = 0;
+                hedged = 1;
+                stats_add(STAT_HEDGED, 1);
+            }
+        }
+
+        wait = (first_byte_timeout > 0) ? first_byte_timeout * 1000L - (now - start) : -1;
+        if (hedge_at >= 0 && (wait < 0 || hedge_at - now < wait))
+            wait = hedge_at - now;
+        for (i = 0; i < 2; i++) {
+            pfd[i].fd = at[i].fd;
+            pfd[i].events = at[i].connecting ? POLLOUT : POLLIN;
+            pfd[i].revents = 0;
+        }
+        if ((n = poll(pfd, 2, (wait < 0) ? -1 : (int)((wait + 999) / 1000))) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < 2 && winner < 0; i++) {
+            if (at[i].fd < 0 || pfd[i].revents == 0)
+                continue;
+            if (at[i].connecting) {
+                at[i].connecting = 0;
+                if (connect_done(at[i].fd) == 0 && send_all(at[i].fd, iov, cnt) == 0)
+                    continue;
+            } else if (answered(at[i].fd)) {
+                winner = i;
+                continue;
+            } else if (at[i].reused) {
+                /* the origin had closed the parked connection, try a new one */
+                Close(at[i].fd);
+                at[i].reused = 0;
+                if ((at[i].fd = connect_any(host, port)) >= 0 &&
+                        send_all(at[i].fd, iov, cnt) == 0)
+                    continue;
+            }
+            if (at[i].fd >= 0)
+                Close(at[i].fd);
+            at[i].fd = -1;
+        }
+    }
+
+    for (i = 0; i < 2; i++)
+        if (i != winner && at[i].fd >= 0)
+            Close(at[i].fd);
+    if (winner < 0) {
+        if (first_byte_timeout > 0 && stats_now() - start >= first_byte_timeout * 1000L)
+            stats_add(STAT_UPSTREAM_TIMEOUTS, 1);
+        return -1;
+    }
+    record(host, port, stats_now() - start, hedged);
+    if (winner == 1)
+        stats_add(STAT_HEDGE_WINS, 1);
+    return at[winner].fd;
+}
+
+/* park a connection whose last response left it reusable */
+void upstream_put(char *host, char *port, int fd) {
+    struct idle_conn *ic;
+    struct origin *o;
+
+    P(&upstream_mutex);
+    o = find_origin(host, port, 1);
+    if (o->nidle >= UPSTREAM_MAX_IDLE) {
+        V(&upstream_mutex);
+        Close(fd);
+        return;
+    }
+    ic = Malloc(sizeof(struct idle_conn));
+    ic->fd = fd;
+    ic->since = time(NULL);
+    ic->next = o->idle;
+    o->idle = ic;
+    o->nidle++;
+    V(&upstream_mutex);
+}
@@ -0,0 +1,28 @@
+/*
+ * upstream.h - connections to origin servers: pooling, timeouts, hedging
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <sys/uio.h>
+
+#define UPSTREAM_BUCKETS  256   /* origins hash table size, a power of two */
+#define UPSTREAM_MAX_IDLE 8     /* idle connections kept per origin */
+#define UPSTREAM_IDLE_TTL 30    /* seconds an idle connection is trusted */
+
+/* default timeouts in milliseconds, 0 waits for ever */
+#define UPSTREAM_CONNECT_TIMEOUT    5000    /* to connect to one origin address */
+#define UPSTREAM_FIRST_BYTE_TIMEOUT 30000   /* from the request sent to the response starting */
+#define UPSTREAM_STALL_TIMEOUT      30000   /* for the origin to send more of a response */
+
+#define HEDGE_SAMPLES 64        /* first byte times kept per origin */
+#define HEDGE_WARMUP  16        /* samples needed before hedging */
+#define HEDGE_MIN     5         /* ms, never hedge sooner */
+#define HEDGE_BUDGET  10        /* percent of an origin's requests that may be hedged */
+
+void upstream_init(int connect_ms, int first_byte_ms, int stall_ms, int hedge);
+void upstream_timeouts(int *connect_ms, int *first_byte_ms, int *stall_ms);
+int upstream_request(char *host, char *port, struct iovec *iov, int cnt, int hedge);
+void upstream_put(char *host, char *port, int fd);
+
+#endif /* __UPSTREAM_H__ */
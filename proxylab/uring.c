@@ -0,0 +1,669 @@
+/*
+ * uring.c - io_uring based proxy engine
+ *
+ * The connections go through the same states as in event.c, but
+ * instead of waiting for a socket to become ready and then making the
+ * read or write itself, a loop queues the operations on its io_uring
+ * and gets their results back as completions. A single io_uring_enter
+ * submits everything queued since the last one and waits for the next
+ * completions, so a busy loop makes one system call for a whole batch
+ * of accepts, receives, sends and connects.
+ *
+ * Each loop keeps one multishot accept on the shared listening socket
+ * and registers a pool of relay buffers with the kernel, which then
+ * reads into and sends from them without mapping them on every call;
+ * a connection finding the pool empty relays through a buffer of its
+ * own. A connection has at most one operation in flight, the next one
+ * is queued from the completion of the last, so it is only ever closed
+ * with nothing pending. What is done with the request is the exchange.c
+ * part of a connection, shared with event.c; this file only queues the
+ * operations it asks for.
+ *
+ * The deadline of a connection, see exchange_wait, rides along with its
+ * operation as a linked timeout, which cancels the operation when it
+ * fires; the connection then lets exchange_timeout decide between a
+ * 408, a 504 and just closing. While the dns.c thread resolves an
+ * origin name the operation in flight is a plain timeout, removed when
+ * the loop learns of the name through a read on its waker's eventfd.
+ *
+ * The ring is driven with the raw system calls, there is no liburing
+ * here. uring_supported probes the kernel for every operation used,
+ * and the proxy runs the epoll engine instead when one is missing.
+ */
+#include "csapp.h"
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#include "http.h"
+#include "exchange.h"
+#include "uring.h"
+
+#define URING_ENTRIES 1024          /* submission queue slots per loop */
+#define URING_BUFFERS 64            /* registered relay buffers per loop */
+
+/* user_data of what is not a connection's operation, accepts have 0 */
+#define TIMER_DATA ((void *)1)      /* linked timeouts and timeout removals */
+#define WAKE_DATA  ((void *)2)      /* the read on the waker's eventfd */
+
+enum conn_state {
+    READ_REQUEST,
+    RESOLVE,
+    CONNECT,
+    SEND_REQUEST,
+    RELAY_READ,                 /* reading the origin response */
+    RELAY_WRITE,                /* passing what was read to the client */
+    WRITE_OUT
+};
+
+/* one loop thread and its ring, mapped from the kernel */
+struct ring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int queued;        /* sqes not submitted yet */
+    int listenfd;
+    int multishot;              /* accept stays armed across connections */
+    char *buffers;              /* URING_BUFFERS registered relay buffers */
+    int free_buffers[URING_BUFFERS];
+    int nfree;
+    exchange_waker_t waker;     /* the dns.c thread's wakeups */
+    uint64_t wakes;             /* WAKE_DATA reads the eventfd count here */
+};
+
+struct conn {
+    exchange_t x;               /* first, exchange_resolved hands it back */
+    enum conn_state state;
+    struct ring *ring;
+    int client_fd;
+    int server_fd;
+    struct msghdr msg;          /* SEND_REQUEST and WRITE_OUT */
+    struct iovec *out_next;     /* WRITE_OUT: rest of x.out */
+    int buffer;                 /* registered relay buffer, -1 for relay */
+    char *relay;                /* where the origin response is read */
+    char *wbuf;                 /* RELAY_WRITE: bytes for the client */
+    size_t relay_len;
+    size_t relay_off;
+    struct __kernel_timespec timeout;   /* left of the deadline, for the kernel */
+    int timer;                  /* RESOLVE: a plain timeout is in flight */
+};
+
+static void conn_close(struct conn *c);
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int op, void *arg, unsigned int n) {
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/*
+ * submit what is queued and wait for at least wait completions;
+ * -1 on an error other than an interrupted or busy ring
+ */
+static int ring_enter(struct ring *r, unsigned int wait) {
+    int n;
+
+    if ((n = sys_enter(r->fd, r->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0)) < 0)
+        return (errno == EINTR || errno == EBUSY || errno == EAGAIN) ? 0 : -1;
+    r->queued -= n;
+    return 0;
+}
+
+/* submit until the submission queue has room for n more sqes */
+static void ring_room(struct ring *r, unsigned int n) {
+    while (*r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + n > r->sq_entries)
+        if (ring_enter(r, 0) < 0)
+            unix_error("io_uring_enter error");
+}
+
+/* a cleared sqe at the tail of the submission queue, room made if needed */
+static struct io_uring_sqe *ring_sqe(struct ring *r, int op, int fd, void *data) {
+    struct io_uring_sqe *sqe;
+    unsigned int tail, idx;
+
+    ring_room(r, 1);
+    tail = *r->sq_tail;
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long)data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    return sqe;
+}
+
+/* set up a ring of URING_ENTRIES, -1 if the kernel will not */
+static int ring_init(struct ring *r) {
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = sys_setup(URING_ENTRIES, &p)) < 0)
+        return -1;
+    /* one mapping for both rings, as every kernel with the ops used does */
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        return -1;
+    }
+    if (cq_size > sq_size)
+        sq_size = cq_size;
+    sq = cq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/* register the relay buffers, leaving the pool empty if the kernel refuses */
+static void ring_buffers(struct ring *r) {
+    struct iovec iov[URING_BUFFERS];
+    int i;
+
+    r->buffers = Malloc((size_t)URING_BUFFERS * RELAY_CHUNK);
+    for (i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = r->buffers + (size_t)i * RELAY_CHUNK;
+        iov[i].iov_len = RELAY_CHUNK;
+    }
+    if (sys_register(r->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0)
+        return;
+    for (i = 0; i < URING_BUFFERS; i++)
+        r->free_buffers[r->nfree++] = i;
+}
+
+/*
+ * can this kernel run the engine: a ring can be set up and it knows
+ * every operation used
+ */
+int uring_supported() {
+    static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_RECV,
+        IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+        IORING_OP_READ, IORING_OP_TIMEOUT, IORING_OP_TIMEOUT_REMOVE,
+        IORING_OP_LINK_TIMEOUT};
+    struct io_uring_probe *probe;
+    struct io_uring_params p;
+    size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int fd, ok, i;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = sys_setup(4, &p)) < 0)
+        return 0;
+    probe = Calloc(1, size);
+    ok = (p.features & IORING_FEAT_SINGLE_MMAP) &&
+        sys_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    Free(probe);
+    close(fd);
+    return ok;
+}
+
+/* arm an accept on the listening socket, multishot while the kernel takes it */
+static void queue_accept(struct ring *r) {
+    struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_ACCEPT, r->listenfd, NULL);
+
+    if (r->multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* read the eventfd the dns.c thread signals when it resolved a name */
+static void queue_wake(struct ring *r) {
+    struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_READ, r->waker.fd, WAKE_DATA);
+
+    sqe->addr = (unsigned long)&r->wakes;
+    sqe->len = sizeof(r->wakes);
+}
+
+/* what is left of the deadline of c, at least a millisecond */
+static struct __kernel_timespec *time_left(struct conn *c) {
+    long us = c->x.deadline - stats_now();
+
+    if (us < 1000)
+        us = 1000;
+    c->timeout.tv_sec = us / 1000000;
+    c->timeout.tv_nsec = (us % 1000000) * 1000;
+    return &c->timeout;
+}
+
+/*
+ * an sqe for an operation of c, followed by a timeout linked to it
+ * that cancels it at the connection's deadline
+ */
+static struct io_uring_sqe *conn_sqe(struct conn *c, int op, int fd) {
+    struct io_uring_sqe *sqe, *t;
+
+    /* an operation submitted without its timeout would wait for ever */
+    ring_room(c->ring, 2);
+    sqe = ring_sqe(c->ring, op, fd, c);
+    if (c->x.deadline) {
+        sqe->flags |= IOSQE_IO_LINK;
+        t = ring_sqe(c->ring, IORING_OP_LINK_TIMEOUT, -1, TIMER_DATA);
+        t->addr = (unsigned long)time_left(c);
+        t->len = 1;
+    }
+    return sqe;
+}
+
+static void queue_recv(struct conn *c, int fd, char *buf, size_t len) {
+    struct io_uring_sqe *sqe = conn_sqe(c, IORING_OP_RECV, fd);
+
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+}
+
+/* send the cnt iovecs at iov, all of them or as much as the socket takes */
+static void queue_sendmsg(struct conn *c, int fd, struct iovec *iov, int cnt) {
+    struct io_uring_sqe *sqe = conn_sqe(c, IORING_OP_SENDMSG, fd);
+
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = iov;
+    c->msg.msg_iovlen = cnt;
+    sqe->addr = (unsigned long)&c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/* read the next piece of the origin response into the relay buffer */
+static void queue_relay_read(struct conn *c) {
+    struct io_uring_sqe *sqe;
+
+    c->state = RELAY_READ;
+    if (c->buffer >= 0) {
+        sqe = conn_sqe(c, IORING_OP_READ_FIXED, c->server_fd);
+        sqe->buf_index = c->buffer;
+    } else {
+        sqe = conn_sqe(c, IORING_OP_RECV, c->server_fd);
+    }
+    sqe->addr = (unsigned long)c->relay;
+    sqe->len = RELAY_CHUNK;
+}
+
+/* send the rest of wbuf to the client, from the registered buffer if it is one */
+static void queue_relay_write(struct conn *c) {
+    struct io_uring_sqe *sqe;
+
+    c->state = RELAY_WRITE;
+    if (c->buffer >= 0 && c->wbuf == c->relay) {
+        sqe = conn_sqe(c, IORING_OP_WRITE_FIXED, c->client_fd);
+        sqe->buf_index = c->buffer;
+    } else {
+        sqe = conn_sqe(c, IORING_OP_SEND, c->client_fd);
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->addr = (unsigned long)(c->wbuf + c->relay_off);
+    sqe->len = c->relay_len - c->relay_off;
+}
+
+/* move the cnt iovecs at *iov past n written bytes, return 1 when all are out */
+static int advance(struct iovec **iov, int *cnt, size_t n) {
+    while (*cnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*cnt)--;
+    }
+    if (*cnt > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+    return *cnt == 0;
+}
+
+/* send the answer the exchange queued in x.out and close once it is out */
+static void write_out(struct conn *c) {
+    c->out_next = c->x.out;
+    c->state = WRITE_OUT;
+    exchange_wait(&c->x, WAIT_STALL);
+    queue_sendmsg(c, c->client_fd, c->out_next, c->x.out_cnt);
+}
+
+/*
+ * connect to the next origin address, close the connection once every
+ * address has failed
+ */
+static void start_connect(struct conn *c) {
+    struct io_uring_sqe *sqe;
+    struct dns_addr *p;
+
+    if (c->server_fd >= 0)
+        close(c->server_fd);
+    c->server_fd = -1;
+    while (c->x.next_addr < c->x.addrs->n) {
+        p = &c->x.addrs->addrs[c->x.next_addr++];
+        if ((c->server_fd = socket(p->family, p->socktype, p->protocol)) < 0)
+            continue;
+        c->state = CONNECT;
+        exchange_wait(&c->x, WAIT_CONNECT);
+        sqe = conn_sqe(c, IORING_OP_CONNECT, c->server_fd);
+        sqe->addr = (unsigned long)&p->addr;
+        sqe->off = p->addrlen;
+        return;
+    }
+    conn_close(c);
+}
+
+/* RESOLVE: wait for the dns.c thread, with a plain timeout for the deadline */
+static void start_resolve(struct conn *c) {
+    struct io_uring_sqe *sqe;
+
+    c->state = RESOLVE;
+    if (!c->x.deadline)
+        return;
+    sqe = ring_sqe(c->ring, IORING_OP_TIMEOUT, -1, c);
+    sqe->addr = (unsigned long)time_left(c);
+    sqe->len = 1;
+    c->timer = 1;
+}
+
+/* do what the exchange asked for next */
+static void proceed(struct conn *c, int next) {
+    switch (next) {
+    case XCHG_WRITE:
+        write_out(c);
+        break;
+    case XCHG_RESOLVE:
+        start_resolve(c);
+        break;
+    case XCHG_CONNECT:
+        start_connect(c);
+        break;
+    default:
+        conn_close(c);
+        break;
+    }
+}
+
+/*
+ * the waker's eventfd was read: connections whose origin name is in
+ * connect once their timeout is removed, or at once if they have none
+ */
+static void on_resolved(struct ring *r) {
+    struct io_uring_sqe *sqe;
+    exchange_t *x;
+
+    while ((x = exchange_resolved(&r->waker)) != NULL) {
+        struct conn *c = (struct conn *)x;
+        if (c->timer) {
+            sqe = ring_sqe(r, IORING_OP_TIMEOUT_REMOVE, -1, TIMER_DATA);
+            sqe->addr = (unsigned long)c;
+        } else {
+            proceed(c, x->addrs->n > 0 ? XCHG_CONNECT : XCHG_CLOSE);
+        }
+    }
+    queue_wake(r);
+}
+
+/* the deadline of c passed and cancelled its operation */
+static void on_timeout(struct conn *c) {
+    int next = exchange_timeout(&c->x);
+
+    if (next == XCHG_WRITE && c->server_fd >= 0) {
+        close(c->server_fd);
+        c->server_fd = -1;
+    }
+    proceed(c, next);
+}
+
+/* RESOLVE: the timeout went off or was removed once the name was in */
+static void on_resolve_timer(struct conn *c) {
+    c->timer = 0;
+    if (c->x.lookup != NULL)
+        on_timeout(c);
+    else
+        proceed(c, c->x.addrs->n > 0 ? XCHG_CONNECT : XCHG_CLOSE);
+}
+
+/* READ_REQUEST: n more bytes of the request arrived */
+static void on_request_data(struct conn *c, int n) {
+    exchange_t *x = &c->x;
+    int rc;
+
+    if (n <= 0) {
+        conn_close(c);
+        return;
+    }
+    if ((rc = exchange_feed(x, n)) == HTTP_OK) {
+        proceed(c, exchange_start(x, &c->ring->waker));
+        return;
+    }
+    if (rc != HTTP_MORE) {
+        conn_close(c);
+        return;
+    }
+    queue_recv(c, c->client_fd, x->in + x->in_len, sizeof(x->in) - x->in_len);
+}
+
+/* CONNECT: the connect finished with result rc */
+static void on_connected(struct conn *c, int rc) {
+    int one = 1;
+
+    if (rc < 0) {
+        start_connect(c);
+        return;
+    }
+    stats_since(STAGE_CONNECT, c->x.connecting);
+    setsockopt(c->server_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->state = SEND_REQUEST;
+    exchange_wait(&c->x, WAIT_STALL);
+    queue_sendmsg(c, c->server_fd, c->x.send, c->x.send_cnt);
+}
+
+/* SEND_REQUEST: n bytes of the request went to the origin */
+static void on_request_sent(struct conn *c, int n) {
+    struct ring *r = c->ring;
+
+    if (n < 0) {
+        conn_close(c);
+        return;
+    }
+    if (!advance(&c->x.send, &c->x.send_cnt, n)) {
+        exchange_wait(&c->x, WAIT_STALL);
+        queue_sendmsg(c, c->server_fd, c->x.send, c->x.send_cnt);
+        return;
+    }
+    if (r->nfree > 0) {
+        c->buffer = r->free_buffers[--r->nfree];
+        c->relay = r->buffers + (size_t)c->buffer * RELAY_CHUNK;
+    } else {
+        c->buffer = -1;
+        c->relay = arena_alloc(c->x.arena, RELAY_CHUNK);
+    }
+    exchange_wait(&c->x, WAIT_FIRST_BYTE);
+    queue_relay_read(c);
+}
+
+/* RELAY_READ: n bytes of the origin response are in, pass them on and capture them */
+static void on_relay_data(struct conn *c, int n) {
+    int rc;
+
+    if (n <= 0) {
+        if (n == 0)
+            exchange_response_end(&c->x);
+        conn_close(c);
+        return;
+    }
+    exchange_wait(&c->x, WAIT_STALL);
+    c->wbuf = c->relay;
+    c->relay_len = n;
+    c->relay_off = 0;
+    if ((rc = exchange_response(&c->x, &c->wbuf, &c->relay_len)) == XCHG_READ) {
+        queue_relay_read(c);
+        return;
+    }
+    if (rc == XCHG_WRITE) {
+        /* a 304 revalidated the stale copy, the origin is done with */
+        close(c->server_fd);
+        c->server_fd = -1;
+        write_out(c);
+        return;
+    }
+    queue_relay_write(c);
+}
+
+/* RELAY_WRITE: n relayed bytes reached the client */
+static void on_relay_written(struct conn *c, int n) {
+    if (n <= 0) {
+        conn_close(c);
+        return;
+    }
+    exchange_wait(&c->x, WAIT_STALL);
+    if ((c->relay_off += n) < c->relay_len) {
+        queue_relay_write(c);
+        return;
+    }
+    queue_relay_read(c);
+}
+
+/* WRITE_OUT: n bytes reached the client, close when all are out */
+static void on_written_out(struct conn *c, int n) {
+    if (n > 0 && !advance(&c->out_next, &c->x.out_cnt, n)) {
+        exchange_wait(&c->x, WAIT_STALL);
+        queue_sendmsg(c, c->client_fd, c->out_next, c->x.out_cnt);
+        return;
+    }
+    conn_close(c);
+}
+
+/* a connection was accepted as fd */
+static void on_accept(struct ring *r, int fd) {
+    struct conn *c;
+    int one = 1;
+
+    /* relayed responses go out in pieces, don't let Nagle hold them */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c = Calloc(1, sizeof(struct conn));
+    c->state = READ_REQUEST;
+    c->ring = r;
+    c->client_fd = fd;
+    c->server_fd = -1;
+    c->buffer = -1;
+    exchange_open(&c->x);
+    queue_recv(c, fd, c->x.in, sizeof(c->x.in));
+}
+
+/* hand the result of a connection's operation to its state */
+static void on_complete(struct conn *c, int res) {
+    if (c->state == RESOLVE) {
+        on_resolve_timer(c);
+        return;
+    }
+    if (res == -ECANCELED) {
+        on_timeout(c);
+        return;
+    }
+    switch (c->state) {
+    case RESOLVE:
+        break;
+    case READ_REQUEST:
+        on_request_data(c, res);
+        break;
+    case CONNECT:
+        on_connected(c, res);
+        break;
+    case SEND_REQUEST:
+        on_request_sent(c, res);
+        break;
+    case RELAY_READ:
+        on_relay_data(c, res);
+        break;
+    case RELAY_WRITE:
+        on_relay_written(c, res);
+        break;
+    case WRITE_OUT:
+        on_written_out(c, res);
+        break;
+    }
+}
+
+/* tear a connection down, it has no operation in flight */
+static void conn_close(struct conn *c) {
+    struct ring *r = c->ring;
+
+    close(c->client_fd);
+    if (c->server_fd >= 0)
+        close(c->server_fd);
+    if (c->buffer >= 0)
+        r->free_buffers[r->nfree++] = c->buffer;
+    exchange_close(&c->x);
+    Free(c);
+}
+
+static void *loop_thread(void *vargp) {
+    struct ring *r = vargp;
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+
+    queue_accept(r);
+    queue_wake(r);
+    while (1) {
+        if (ring_enter(r, 1) < 0)
+            unix_error("io_uring_enter error");
+        head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->user_data == (unsigned long)WAKE_DATA) {
+                on_resolved(r);
+            } else if (cqe->user_data == (unsigned long)TIMER_DATA) {
+                /* the operation a timeout belongs to reports for it */
+            } else if (cqe->user_data != 0) {
+                on_complete((struct conn *)(unsigned long)cqe->user_data, cqe->res);
+            } else {
+                if (cqe->res >= 0)
+                    on_accept(r, cqe->res);
+                else if (cqe->res == -EINVAL && r->multishot)
+                    r->multishot = 0;   /* a kernel without multishot accept */
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    queue_accept(r);
+            }
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/* run nloops io_uring loops on listenfd, never returns */
+void uring_run(int listenfd, int nloops) {
+    pthread_t *tid = Calloc(nloops, sizeof(pthread_t));
+    int i;
+
+    exchange_init();
+    for (i = 0; i < nloops; i++) {
+        struct ring *r = Calloc(1, sizeof(struct ring));
+        if (ring_init(r) < 0)
+            unix_error("io_uring_setup error");
+        ring_buffers(r);
+        exchange_waker_init(&r->waker);
+        r->listenfd = listenfd;
+        r->multishot = 1;
+        Pthread_create(&tid[i], NULL, loop_thread, r);
+    }
+    for (i = 0; i < nloops; i++)
+        Pthread_join(tid[i], NULL);
+    Free(tid);
+}
@@ -0,0 +1,10 @@
+/*
+ * uring.h - io_uring based proxy engine
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+int uring_supported();
+void uring_run(int listenfd, int nloops);
+
+#endif /* __URING_H__ */
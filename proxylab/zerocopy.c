@@ -0,0 +1,93 @@
+/*
+ * zerocopy.c - socket to socket relay that bypasses user space
+ *
+ * Body bytes go from the origin socket into a pipe and from the pipe
+ * to the client socket with splice, so the kernel moves page references
+ * instead of copying every byte out to a user buffer and back. Each
+ * thread keeps one pipe for its whole life.
+ *
+ * splice needs _GNU_SOURCE, which csapp.h does not get along with, so
+ * this file stays on the plain system headers.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "zerocopy.h"
+
+static __thread int pipefd[2] = {-1, -1};
+static pthread_key_t pipe_key;
+
+/* thread exit, close its pipe */
+static void close_pipe(void *arg) {
+    int *fds = arg;
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* the calling thread's pipe, made on first use; -1 if none can be made */
+static int thread_pipe() {
+    if (pipefd[0] >= 0)
+        return 0;
+    if (pipe(pipefd) < 0) {
+        pipefd[0] = pipefd[1] = -1;
+        return -1;
+    }
+    pthread_setspecific(pipe_key, pipefd);
+    return 0;
+}
+
+/* set up the per-thread pipes */
+void zerocopy_init() {
+    pthread_key_create(&pipe_key, close_pipe);
+}
+
+/* a failed relay may leave bytes in the pipe, start over with a new one */
+static void drop_pipe() {
+    close(pipefd[0]);
+    close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+    pthread_setspecific(pipe_key, NULL);
+}
+
+/* splice up to n bytes from in to out, retrying on EINTR */
+static ssize_t splice_some(int in, int out, size_t n) {
+    ssize_t rc;
+
+    while ((rc = splice(in, NULL, out, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0 &&
+            errno == EINTR)
+        ;
+    return rc;
+}
+
+/*
+ * move n bytes from the socket in to the socket out through the
+ * thread's pipe; return 0, -1 on an error or an early end of file, or
+ * ZEROCOPY_UNSUPPORTED if nothing could be spliced and the caller
+ * should copy instead
+ */
+int zerocopy_relay(int in, int out, long n) {
+    ssize_t got, put;
+    long moved = 0;
+
+    if (thread_pipe() < 0)
+        return ZEROCOPY_UNSUPPORTED;
+    while (moved < n) {
+        got = splice_some(in, pipefd[1], (n - moved > ZEROCOPY_CHUNK) ?
+                ZEROCOPY_CHUNK : n - moved);
+        if (got <= 0) {
+            if (got < 0 && moved == 0 && (errno == EINVAL || errno == ENOSYS))
+                return ZEROCOPY_UNSUPPORTED;
+            drop_pipe();
+            return -1;
+        }
+        for (; got > 0; got -= put, moved += put) {
+            if ((put = splice_some(pipefd[0], out, got)) <= 0) {
+                drop_pipe();
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
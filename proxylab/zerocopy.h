@@ -0,0 +1,13 @@
+/*
+ * zerocopy.h - socket to socket relay that bypasses user space
+ */
+#ifndef __ZEROCOPY_H__
+#define __ZEROCOPY_H__
+
+#define ZEROCOPY_CHUNK 65536        /* bytes per splice, one pipe's worth */
+#define ZEROCOPY_UNSUPPORTED -2     /* the kernel cannot splice these descriptors */
+
+void zerocopy_init();
+int zerocopy_relay(int in, int out, long n);
+
+#endif /* __ZEROCOPY_H__ */